@@ -0,0 +1,268 @@
+#pragma once
+
+#ifndef ASYNC_ADAPTIVE_LIMIT_HPP
+#define ASYNC_ADAPTIVE_LIMIT_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <type_traits>
+
+#include "each.hpp"
+#include "map.hpp"
+#include "parallel.hpp"
+#include "sequencer.hpp"
+
+namespace async {
+
+namespace detail {
+class AdaptiveLimitPolicy;
+}
+
+/**
+   A concurrency limit which finds its own level, for `map`, `each`, `parallel_limit`
+   and `sequencer`, passed in place of their fixed limit:
+
+     async::AdaptiveLimit limit(4, 256);
+     async::map<int>(data, func, final_callback, limit);
+
+   The limit grows by one each window in which the tasks kept it full and their latency
+   stayed within `tolerance` times the baseline: the lowest latency seen, or the latency
+   last seen with a limit of 1.  It is cut by
+   `backoff` when latency rises above that, and straight away when a task fails (with
+   any error but STOP or CANCELLED).  A window lasts twice as many completions as the
+   limit, and at least 16.
+
+   Latency is measured without timing each task: by Little's law, the mean latency over
+   a window is the time-integral of the number of tasks in flight, divided by the number
+   which completed.  So nothing is stored per task, and the clock is read once as each
+   task is spawned and completes.
+
+   One AdaptiveLimit is meant to be kept for the life of a downstream dependency, and
+   shared by every sequence which calls it: what it learns carries over from one to the
+   next.  Each sequence keeps its own outstanding tasks under the limit.  Like the serial
+   sequencer, it is not thread-safe, so there are no `concurrent` or executor variants.
+ */
+class AdaptiveLimit {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  explicit AdaptiveLimit(unsigned int initial_limit=4, unsigned int max_limit=1000,
+      double backoff=0.9, double tolerance=1.5)
+    : limit_(std::max(initial_limit, 1u)),
+      max_limit_(std::max(max_limit, 1u)),
+      backoff_(backoff),
+      tolerance_(tolerance),
+      last_event_(Clock::now()) {}
+
+  AdaptiveLimit(const AdaptiveLimit&) = delete;
+  AdaptiveLimit& operator=(const AdaptiveLimit&) = delete;
+
+  // The current limit, at least 1.
+  unsigned int limit() const {
+    return static_cast<unsigned int>(limit_);
+  }
+
+  // The tasks in flight, across every sequence using this limit.
+  unsigned int in_flight() const {
+    return in_flight_;
+  }
+
+  // The mean latency over the last window.
+  Clock::duration latency() const {
+    return to_duration(latency_);
+  }
+
+  // The latency which the limit grows against.
+  Clock::duration baseline_latency() const {
+    return to_duration(baseline_);
+  }
+
+private:
+  friend class detail::AdaptiveLimitPolicy;
+
+  static const unsigned int kMinWindow = 16;
+
+  static Clock::duration to_duration(double nanoseconds) {
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::nano>(nanoseconds));
+  }
+
+  void item_spawned() {
+    advance();
+    in_flight_++;
+    max_in_flight_ = std::max(max_in_flight_, in_flight_);
+  }
+
+  void item_done(ErrorCode error) {
+    advance();
+    in_flight_--;
+    completions_++;
+
+    if (error != OK && error != STOP && error != CANCELLED) {
+      // Back off once per window, not once per task failing together.
+      if (!backed_off_) {
+        back_off();
+        backed_off_ = true;
+      }
+    }
+
+    if (completions_ >= 2 * limit() && completions_ >= kMinWindow) {
+      end_window();
+    }
+  }
+
+  // Adds the time since the last event, weighted by the tasks in flight through it.
+  void advance() {
+    Clock::time_point now = Clock::now();
+    area_ += double(in_flight_) *
+        std::chrono::duration<double, std::nano>(now - last_event_).count();
+    last_event_ = now;
+  }
+
+  void end_window() {
+    latency_ = area_ / completions_;
+    // Where a window ends cuts across the tasks in flight, so one window's estimate may
+    // be high and the next low.  The baseline is kept from the average of the two, so
+    // that such a low doesn't stick.
+    smoothed_ = smoothed_ == 0 ? latency_ : (smoothed_ + latency_) / 2;
+    if (baseline_ == 0 || smoothed_ < baseline_ || limit() == 1) {
+      // At a limit of 1 we add no queueing of our own, so whatever the latency is, it's
+      // the dependency's.  This is how the baseline follows a dependency which has
+      // become slower for good; otherwise a baseline which crept up with the latency
+      // would let the limit creep up with it.
+      baseline_ = smoothed_;
+    }
+
+    if (!backed_off_) {
+      if (latency_ > baseline_ * tolerance_) {
+        back_off();
+      } else if (max_in_flight_ >= limit()) {
+        limit_ = std::min(limit_ + 1, double(max_limit_));
+      }
+    }
+
+    area_ = 0;
+    completions_ = 0;
+    max_in_flight_ = in_flight_;
+    backed_off_ = false;
+  }
+
+  void back_off() {
+    limit_ = std::max(limit_ * backoff_, 1.0);
+  }
+
+  double limit_;
+  unsigned int max_limit_;
+  double backoff_;
+  double tolerance_;
+
+  unsigned int in_flight_ = 0;
+  Clock::time_point last_event_;
+
+  // The current window.
+  double area_ = 0;
+  unsigned int completions_ = 0;
+  unsigned int max_in_flight_ = 0;
+  bool backed_off_ = false;
+
+  // In nanoseconds.
+  double latency_ = 0;
+  double smoothed_ = 0;
+  double baseline_ = 0;
+};
+
+namespace detail {
+
+// The sequencer's view of an AdaptiveLimit.
+class AdaptiveLimitPolicy {
+public:
+  explicit AdaptiveLimitPolicy(AdaptiveLimit &limit) : limit_(&limit) {}
+
+  bool allows(unsigned int outstanding) const {
+    return outstanding < limit_->limit();
+  }
+
+  template <typename State>
+  bool ready(State *state) {
+    return true;
+  }
+
+  void item_spawned() {
+    limit_->item_spawned();
+  }
+
+  void item_done(ErrorCode error) {
+    limit_->item_done(error);
+  }
+
+private:
+  AdaptiveLimit *limit_;
+};
+
+}
+
+// Same as `async::sequencer`, with an adaptive limit.
+template <typename T, typename TIter, typename Callback, typename FinalCallback>
+void sequencer(TIter items_begin, TIter items_end,
+    AdaptiveLimit &limit,
+    Callback callback,
+    FinalCallback final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  detail::run_sequencer(items_begin, items_end, detail::AdaptiveLimitPolicy(limit),
+      std::move(callback), std::move(final_callback), token);
+}
+
+// Same as `async::map`, with an adaptive limit.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
+void map(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    AdaptiveLimit &task_limit,
+    const CancellationToken &token=CancellationToken()) {
+
+  std::vector<T>* results = new std::vector<T>(data.size());
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::MapItemCallback<T, Func>(std::move(func), results),
+          detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+          token);
+}
+
+// Same as `async::each`, with an adaptive limit.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    AdaptiveLimit &task_limit,
+    const CancellationToken &token=CancellationToken()) {
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::EachItemCallback<T, Func>(std::move(func)),
+          typename std::decay<FinalCallback>::type(final_callback),
+          token);
+}
+
+// Same as `async::parallel_limit`, with an adaptive limit.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(std::vector<TTask> &tasks,
+    AdaptiveLimit &limit,
+    const FinalCallback &final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  auto results = new detail::ResultSlots<T>(tasks.size());
+
+  sequencer<TTask>
+      (tasks.begin(), tasks.end(), limit,
+          detail::ParallelSlotItemCallback<T, TTask>(results),
+          detail::ParallelFinalCallback<detail::ResultSlots<T>, FinalCallback>(
+              final_callback, results),
+          token);
+}
+
+}
+
+#endif
@@ -8,46 +8,81 @@
 #include <vector>
 
 #include "debug.hpp"
+#include "function.hpp"
 
 namespace async {
 
 typedef enum {
   OK = 0,
   FAIL = -1,
-  STOP = -2
+  STOP = -2,
+  CANCELLED = -3,
+  TIMEOUT = -4
 } ErrorCode;
 
+// The type of the library's callbacks and tasks: std::function, or async::function if
+// ASYNC_USE_ASYNC_FUNCTION is defined, so that callables too large for std::function's
+// small buffer don't allocate, and callbacks may hold move-only values.  Define it, or
+// not, the same way in every translation unit of a program.
+#ifdef ASYNC_USE_ASYNC_FUNCTION
+template<typename Signature>
+using CallbackFunction = function<Signature>;
+#else
+template<typename Signature>
+using CallbackFunction = std::function<Signature>;
+#endif
+
 template<typename T>
-using TaskCallback = std::function<void(ErrorCode error, T result)>;
+using TaskCallback = CallbackFunction<void(ErrorCode error, T result)>;
 
 template<typename T>
 void noop_task_callback(ErrorCode e, T result) {};
 
 template<typename T>
-using TaskCompletionCallback = std::function<void(ErrorCode, std::vector<T>&)>;
+using TaskCompletionCallback = CallbackFunction<void(ErrorCode, std::vector<T>&)>;
 
 template<typename T>
 void noop_task_final_callback(ErrorCode e, std::vector<T>& p) {};
 
 template <typename T>
-using Task = std::function<void(TaskCallback<T>&)>;
+using Task = CallbackFunction<void(TaskCallback<T>&)>;
 
 template<typename T>
 using TaskVector = std::vector<Task<T>>;
 
-using BoolCallback = std::function<void(bool)>;
+class CancellationToken;
+
+// A task which is also handed a token, cancelled once its result is no longer wanted.
+template <typename T>
+using CancellableTask = CallbackFunction<void(TaskCallback<T>&, CancellationToken)>;
+
+using BoolCallback = CallbackFunction<void(bool)>;
 
-using ErrorCodeCallback = std::function<void(ErrorCode)>;
+using ErrorCodeCallback = CallbackFunction<void(ErrorCode)>;
 inline void noop_error_code_final_callback(ErrorCode e) {};
 
 }
 
+#include "adaptive_limit.hpp"
+#include "batch.hpp"
+#include "cancellation.hpp"
+#include "concurrent_sequencer.hpp"
+#include "detect.hpp"
 #include "each.hpp"
+#include "executor.hpp"
 #include "filter.hpp"
 #include "map.hpp"
+#include "map_stream.hpp"
+#include "metrics.hpp"
 #include "parallel.hpp"
+#include "parallel_tuple.hpp"
+#include "race.hpp"
+#include "reduce.hpp"
 #include "series.hpp"
 #include "sequencer.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "waterfall.hpp"
 #include "whilst.hpp"
 
 #endif
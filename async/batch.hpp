@@ -0,0 +1,290 @@
+#pragma once
+
+#ifndef ASYNC_BATCH_HPP
+#define ASYNC_BATCH_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "each.hpp"
+#include "map.hpp"
+#include "sequencer.hpp"
+
+namespace async {
+
+/**
+   A run of contiguous items, which it doesn't own.
+ */
+template<typename T>
+class Span {
+public:
+  Span() : data_(nullptr), size_(0) {}
+  Span(T *data, size_t size) : data_(data), size_(size) {}
+  Span(std::vector<T> &vector) : data_(vector.data()), size_(vector.size()) {}
+
+  T *data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  T *begin() const {
+    return data_;
+  }
+
+  T *end() const {
+    return data_ + size_;
+  }
+
+  T &operator[](size_t index) const {
+    return data_[index];
+  }
+
+private:
+  T *data_;
+  size_t size_;
+};
+
+template<typename T>
+using BatchCallback = CallbackFunction<void(ErrorCode error, Span<T> results)>;
+
+template<typename T>
+using MapBatchCallback = CallbackFunction<void(Span<T> items, BatchCallback<T> callback)>;
+
+/**
+   How `map_batch` and `each_batch` split `data` into batches: by count, or by size.
+
+     async::BatchSize<Key>(500)
+     async::BatchSize<std::string>::bytes(64 * 1024,
+         [](const std::string &item) { return item.size(); })
+
+   With a byte budget, items are added to a batch until the next would take it over
+   budget; an item over budget by itself gets a batch of its own.  `items`, if not 0,
+   caps the number of items in a batch too.  A count of 0 puts all the items in one batch.
+ */
+template<typename T>
+class BatchSize {
+public:
+  typedef size_t (*ItemBytes)(const T &item);
+
+  BatchSize(size_t items) : items_(items), bytes_(0), item_bytes_(nullptr) {}
+
+  static BatchSize bytes(size_t bytes, ItemBytes item_bytes, size_t items=0) {
+    BatchSize size(items);
+    size.bytes_ = bytes;
+    size.item_bytes_ = item_bytes;
+    return size;
+  }
+
+  // The end of the batch which starts at `begin`.
+  T *batch_end(T *begin, T *end) const {
+    size_t available = end - begin;
+    size_t count = items_ == 0 ? available : std::min(items_, available);
+    if (!item_bytes_) {
+      return begin + count;
+    }
+
+    T *item = begin;
+    size_t bytes = 0;
+    while (item != begin + count) {
+      size_t item_bytes = item_bytes_(*item);
+      if (item != begin && bytes + item_bytes > bytes_) {
+        break;
+      }
+      bytes += item_bytes;
+      ++item;
+    }
+    return item;
+  }
+
+private:
+  size_t items_;
+  size_t bytes_;
+  ItemBytes item_bytes_;
+};
+
+namespace detail {
+
+// Walks `data` a batch at a time.  Batch boundaries are found as the sequencer advances,
+// so nothing is allocated up front however many batches there are.
+template<typename T>
+class BatchIterator {
+public:
+  typedef std::forward_iterator_tag iterator_category;
+  typedef Span<T> value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const Span<T> *pointer;
+  typedef Span<T> reference;
+
+  BatchIterator(T *begin, T *data_end, const BatchSize<T> &size)
+    : begin_(begin), end_(begin), data_end_(data_end), size_(size) {
+    if (begin_ != data_end_) {
+      end_ = size_.batch_end(begin_, data_end_);
+    }
+  }
+
+  Span<T> operator*() const {
+    return Span<T>(begin_, end_ - begin_);
+  }
+
+  BatchIterator& operator++() {
+    begin_ = end_;
+    if (begin_ != data_end_) {
+      end_ = size_.batch_end(begin_, data_end_);
+    }
+    return *this;
+  }
+
+  BatchIterator operator++(int) {
+    BatchIterator previous(*this);
+    ++*this;
+    return previous;
+  }
+
+  bool operator==(const BatchIterator &rhs) const {
+    return begin_ == rhs.begin_;
+  }
+
+  bool operator!=(const BatchIterator &rhs) const {
+    return begin_ != rhs.begin_;
+  }
+
+private:
+  T *begin_;
+  T *end_;
+  T *data_end_;
+  BatchSize<T> size_;
+};
+
+// The callback handed to `func` for one batch.  It moves the batch's results into their
+// places in the results vector.  A batch which doesn't return one result per item fails.
+template<typename T, typename CallbackDone>
+class MapBatchTaskCallback {
+public:
+  MapBatchTaskCallback(CallbackDone callback_done, Span<T> slots)
+    : callback_done_(callback_done), slots_(slots) {}
+
+  void operator()(ErrorCode error, Span<T> results) const {
+    if (error == OK && results.size() != slots_.size()) {
+      error = FAIL;
+    }
+    std::move(results.begin(), results.begin() + std::min(results.size(), slots_.size()),
+        slots_.begin());
+    callback_done_(error == OK, error);
+  }
+
+private:
+  CallbackDone callback_done_;
+  Span<T> slots_;
+};
+
+template<typename T, typename Func>
+class MapBatchItemCallback {
+public:
+  static const bool accepts_token =
+      accepts_cancellation_token<Func, Span<T>&, BatchCallback<T>>::value;
+
+  MapBatchItemCallback(Func &&func, T *items, std::vector<T> *results)
+    : func_(std::move(func)), items_(items), results_(results) {}
+
+  template<typename CallbackDone>
+  void operator()(Span<T> &batch, int index, bool is_last_time, CallbackDone callback_done) {
+    Span<T> slots(results_->data() + (batch.data() - items_), batch.size());
+    invoke_item(func_, MapBatchTaskCallback<T, CallbackDone>(callback_done, slots),
+        callback_done, index, batch);
+  }
+
+private:
+  Func func_;
+  T *items_;
+  std::vector<T> *results_;
+};
+
+template<typename T, typename Func>
+class EachBatchItemCallback {
+public:
+  static const bool accepts_token =
+      accepts_cancellation_token<Func, Span<T>&, ErrorCodeCallback>::value;
+
+  explicit EachBatchItemCallback(Func &&func) : func_(std::move(func)) {}
+
+  template<typename CallbackDone>
+  void operator()(Span<T> &batch, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_item(func_, EachTaskCallback<CallbackDone>(callback_done), callback_done, index,
+        batch);
+  }
+
+private:
+  Func func_;
+};
+
+}
+
+// Same as `async::map`, except that `func` is handed a batch of items at a time, as
+// `func(items, callback)`, where `items` is a Span<T>.  `func` invokes
+// `callback(error, results)` with a span of one result per item, in the same order; the
+// results are moved into place, so `results` need only live until `callback` returns.
+// If `results` is the wrong size, the map fails with FAIL.  Each batch's callback is
+// three words wide, so converting it to a BatchCallback<T> allocates once per batch.
+//
+// `batch_size` - how many items, or how many bytes of items, go in a batch; see
+//      BatchSize.
+//
+// `task_limit` - the max number of batches outstanding at once; 0 for no limit.
+//
+// The results handed to `final_callback` are in the order of `data`.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
+void map_batch(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    const BatchSize<T> &batch_size,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  std::vector<T>* results = new std::vector<T>(data.size());
+  T *items = data.data();
+
+  sequencer<Span<T>>
+      (detail::BatchIterator<T>(items, items + data.size(), batch_size),
+          detail::BatchIterator<T>(items + data.size(), items + data.size(), batch_size),
+          task_limit,
+          detail::MapBatchItemCallback<T, Func>(std::move(func), items, results),
+          detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+          token);
+}
+
+// Same as `async::each`, except that `func` is handed a batch of items at a time, as
+// `func(items, callback)`, where `items` is a Span<T>; see `async::map_batch`.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each_batch(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    const BatchSize<T> &batch_size,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  T *items = data.data();
+
+  sequencer<Span<T>>
+      (detail::BatchIterator<T>(items, items + data.size(), batch_size),
+          detail::BatchIterator<T>(items + data.size(), items + data.size(), batch_size),
+          task_limit,
+          detail::EachBatchItemCallback<T, Func>(std::move(func)),
+          typename std::decay<FinalCallback>::type(final_callback),
+          token);
+}
+
+}
+
+#endif
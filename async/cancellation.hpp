@@ -0,0 +1,315 @@
+#pragma once
+
+#ifndef ASYNC_CANCELLATION_HPP
+#define ASYNC_CANCELLATION_HPP
+
+#include <atomic>
+#include <climits>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+namespace async {
+
+namespace detail {
+
+/**
+   The state shared by a CancellationSource and its tokens.  Handlers are registered
+   under a scope: the sequencer gives each item its own scope, and drops the item's
+   handlers as soon as the item completes, so a stop never fires the handler of a task
+   that has already finished.  Thread-safe.
+ */
+class CancellationState {
+public:
+  static const unsigned int kNoScope = UINT_MAX;
+
+  bool is_cancelled() const {
+    return cancelled_.load(std::memory_order_acquire);
+  }
+
+  // The error code passed to `cancel()`, once cancelled.
+  ErrorCode reason() const {
+    return is_cancelled() ? reason_ : OK;
+  }
+
+  // Registers `handler` under `scope`, and returns an id for `remove()`.  If already
+  // cancelled, invokes `handler` immediately instead, and returns 0.
+  unsigned long add(unsigned int scope, std::function<void()> handler) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!cancelled_.load(std::memory_order_relaxed)) {
+        unsigned long id = ++next_id_;
+        handlers_.emplace(scope, Entry { id, std::move(handler) });
+        handler_count_.fetch_add(1, std::memory_order_relaxed);
+        return id;
+      }
+    }
+
+    handler();
+    return 0;
+  }
+
+  // Returns false if the handler had already fired, or is firing on another thread.
+  bool remove(unsigned int scope, unsigned long id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto range = handlers_.equal_range(scope);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second.id == id) {
+        handlers_.erase(it);
+        handler_count_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void remove_scope(unsigned int scope) {
+    if (handler_count_.load(std::memory_order_relaxed) == 0) {
+      // The common case: no task registered anything.
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    handler_count_.fetch_sub(handlers_.erase(scope), std::memory_order_relaxed);
+  }
+
+  void cancel(ErrorCode reason) {
+    std::unordered_multimap<unsigned int, Entry> handlers;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (cancelled_.load(std::memory_order_relaxed)) {
+        return;
+      }
+      reason_ = reason;
+      cancelled_.store(true, std::memory_order_release);
+      handlers.swap(handlers_);
+      handler_count_.store(0, std::memory_order_relaxed);
+    }
+
+    // Outside the lock, since handlers may register or cancel more.
+    for (auto &entry : handlers) {
+      entry.second.handler();
+    }
+  }
+
+private:
+  struct Entry {
+    unsigned long id;
+    std::function<void()> handler;
+  };
+
+  std::mutex mutex_;
+  std::atomic<bool> cancelled_ { false };
+  ErrorCode reason_ = OK;
+  std::atomic<size_t> handler_count_ { 0 };
+  unsigned long next_id_ = 0;
+  std::unordered_multimap<unsigned int, Entry> handlers_;
+};
+
+class ItemCancellation;
+
+}
+
+/**
+   Returned by `CancellationToken::on_cancel()`.  `reset()` unregisters the handler, if it
+   hasn't fired yet, and returns whether it did so.  Merely destroying the registration
+   leaves the handler registered.
+ */
+class CancellationRegistration {
+public:
+  CancellationRegistration() = default;
+
+  CancellationRegistration(std::shared_ptr<detail::CancellationState> state,
+      unsigned int scope, unsigned long id)
+    : state_(std::move(state)), scope_(scope), id_(id) {}
+
+  bool reset() {
+    bool removed = state_ && id_ != 0 && state_->remove(scope_, id_);
+    state_.reset();
+    return removed;
+  }
+
+private:
+  std::shared_ptr<detail::CancellationState> state_;
+  unsigned int scope_ = detail::CancellationState::kNoScope;
+  unsigned long id_ = 0;
+};
+
+/**
+   Lets a task find out that its work is no longer wanted: because some other task
+   failed and stopped the sequence, or because the caller cancelled it from outside.
+   A default-constructed token is never cancelled.
+ */
+class CancellationToken {
+public:
+  CancellationToken() = default;
+
+  bool is_cancelled() const {
+    return state_ && state_->is_cancelled();
+  }
+
+  // Why the token was cancelled: CANCELLED, TIMEOUT, or the error of the task which
+  // stopped the sequence.  OK if not cancelled.
+  ErrorCode reason() const {
+    return state_ ? state_->reason() : OK;
+  }
+
+  // False for a default-constructed token, which will never be cancelled.
+  bool can_be_cancelled() const {
+    return static_cast<bool>(state_);
+  }
+
+  // Invokes `handler` once, when cancellation is requested: for example to close a socket
+  // or cancel a timer.  If cancellation was already requested, invokes it immediately.
+  // Handlers registered through a token handed to a task are dropped once that task
+  // completes.
+  template<typename F>
+  CancellationRegistration on_cancel(F handler) const {
+    if (!state_) {
+      return CancellationRegistration();
+    }
+    return CancellationRegistration(state_, scope_, state_->add(scope_, std::move(handler)));
+  }
+
+private:
+  friend class CancellationSource;
+  friend class detail::ItemCancellation;
+
+  CancellationToken(std::shared_ptr<detail::CancellationState> state, unsigned int scope)
+    : state_(std::move(state)), scope_(scope) {}
+
+  std::shared_ptr<detail::CancellationState> state_;
+  unsigned int scope_ = detail::CancellationState::kNoScope;
+};
+
+/**
+   Requests cancellation of everything holding one of its tokens.
+ */
+class CancellationSource {
+public:
+  CancellationSource() : state_(std::make_shared<detail::CancellationState>()) {}
+
+  CancellationToken token() const {
+    return CancellationToken(state_, detail::CancellationState::kNoScope);
+  }
+
+  bool is_cancelled() const {
+    return state_->is_cancelled();
+  }
+
+  // Fires all registered handlers.  Only the first call has any effect.  Sequences
+  // stopped by the token finish with `reason`.
+  void cancel(ErrorCode reason=CANCELLED) {
+    state_->cancel(reason);
+  }
+
+private:
+  friend class detail::ItemCancellation;
+
+  std::shared_ptr<detail::CancellationState> state_;
+};
+
+namespace detail {
+
+// One item's view of its sequencer's cancellation: hands out the item's token, and drops
+// the item's handlers when it completes.
+class ItemCancellation {
+public:
+  ItemCancellation(const std::shared_ptr<CancellationState> &state, unsigned int scope)
+    : state_(state.get()), scope_(scope) {}
+
+  CancellationToken token(const std::shared_ptr<CancellationState> &state) const {
+    return CancellationToken(state, scope_);
+  }
+
+  void release() const {
+    if (state_) {
+      state_->remove_scope(scope_);
+    }
+  }
+
+private:
+  CancellationState *state_;
+  unsigned int scope_;
+};
+
+// Wraps a task's callback, so that the task's cancellation handlers are dropped as soon
+// as it completes.  The sequencer state outlives the item, so a raw pointer suffices.
+template<typename Callback>
+class CancellationScopedCallback {
+public:
+  CancellationScopedCallback(Callback callback, ItemCancellation cancellation)
+    : callback_(callback), cancellation_(cancellation) {}
+
+  template<typename... Args>
+  void operator()(Args&&... args) const {
+    cancellation_.release();
+    callback_(std::forward<Args>(args)...);
+  }
+
+private:
+  Callback callback_;
+  ItemCancellation cancellation_;
+};
+
+template<typename Func, typename... Args>
+struct accepts_cancellation_token_test {
+  template<typename F>
+  static auto test(int) -> decltype(
+      std::declval<F&>()(std::declval<Args>()..., std::declval<CancellationToken>()),
+      std::true_type());
+
+  template<typename F>
+  static std::false_type test(...);
+
+  typedef decltype(test<Func>(0)) type;
+};
+
+// Whether `Func` can be invoked with `Args...` followed by a CancellationToken.
+template<typename Func, typename... Args>
+struct accepts_cancellation_token : accepts_cancellation_token_test<Func, Args...>::type {};
+
+// Whether a sequencer callback hands cancellation tokens on to its items, which it
+// declares with a `static const bool accepts_token` member.  If so, the sequencer sets up
+// cancellation even when the caller passed no token.
+template<typename Callback, typename Enable=void>
+struct item_accepts_token : std::false_type {};
+
+template<typename Callback>
+struct item_accepts_token<Callback, typename std::enable_if<Callback::accepts_token>::type>
+  : std::true_type {};
+
+template<typename Func, typename Callback, typename CallbackDone, typename... Args>
+void invoke_item_impl(std::false_type accepts_token, Func &func, Callback callback,
+    CallbackDone callback_done, int index, Args&&... args) {
+  func(std::forward<Args>(args)..., callback);
+}
+
+template<typename Func, typename Callback, typename CallbackDone, typename... Args>
+void invoke_item_impl(std::true_type accepts_token, Func &func, Callback callback,
+    CallbackDone callback_done, int index, Args&&... args) {
+  const std::shared_ptr<CancellationState> &state = callback_done.cancellation();
+  ItemCancellation cancellation(state, index);
+  func(std::forward<Args>(args)...,
+      CancellationScopedCallback<Callback>(callback, cancellation),
+      cancellation.token(state));
+}
+
+// Invokes `func(args..., callback)`, or `func(args..., callback, token)` for functions
+// which accept a token.  Only the latter pay for scoping a token to the item.
+template<typename Func, typename Callback, typename CallbackDone, typename... Args>
+void invoke_item(Func &func, Callback callback, CallbackDone callback_done, int index,
+    Args&&... args) {
+  invoke_item_impl(
+      accepts_cancellation_token<Func, Args..., CancellationScopedCallback<Callback>>(),
+      func, callback, callback_done, index, std::forward<Args>(args)...);
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,277 @@
+#pragma once
+
+#ifndef ASYNC_CONCURRENT_SEQUENCER_HPP
+#define ASYNC_CONCURRENT_SEQUENCER_HPP
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#include "sequencer.hpp"
+
+namespace async {
+
+namespace detail {
+
+/**
+   The shared state of one concurrent sequencer run.  Item callbacks may complete on any
+   thread, concurrently.
+
+   Only one thread at a time spawns items: the "drainer".  A completion which frees up a
+   slot registers a drain request; if no other thread is draining, it becomes the drainer
+   and runs the spawn loop, otherwise the current drainer picks up the request before it
+   returns.  So the iterator, and the callback, are only ever touched by one thread at a
+   time, without a lock, and synchronous completions return to the loop rather than
+   recursing into it.
+
+   When the sequence stops, by a failure or by cancellation, the items in flight are
+   cancelled, but the final callback waits until the last of them has reported back:
+   they may be writing into what the final callback reads, such as the results, on other
+   threads.  An item is counted as outstanding before the stop flag is checked for it, and
+   a stop sets the flag before it counts what is outstanding, so one or the other sees
+   that nothing is left.
+
+   The state is reference counted: one reference for the sequence until the final
+   callback has run, one per outstanding item, one for the initial call, and one for the
+   caller's cancellation handler while it is registered.
+ */
+template <typename TIter, typename Callback, typename FinalCallback>
+class ConcurrentSequencerState {
+public:
+  typedef Callback ItemCallback;
+  using CallbackDone = SequencerCallbackDone<ConcurrentSequencerState>;
+
+  ConcurrentSequencerState(TIter items_begin, TIter items_end, unsigned int limit,
+      Callback &&callback, FinalCallback &&final_callback)
+    : item_iter_(items_begin),
+      items_end_(items_end),
+      limit_(limit),
+      callback_(std::move(callback)),
+      final_callback_(std::move(final_callback)) {
+    (*sequencer_state_count())++;
+  }
+
+  ~ConcurrentSequencerState() {
+    (*sequencer_state_count())--;
+  }
+
+  ConcurrentSequencerState(const ConcurrentSequencerState&) = delete;
+  ConcurrentSequencerState& operator=(const ConcurrentSequencerState&) = delete;
+
+  // See SequencerState::enable_cancellation().  The caller's token may be cancelled from
+  // any thread.
+  void enable_cancellation(const CancellationToken &token) {
+    cancellation_ = std::make_shared<CancellationState>();
+
+    if (token.can_be_cancelled()) {
+      refs_.fetch_add(1, std::memory_order_relaxed);
+      external_token_ = token;
+      external_registration_ = token.on_cancel([this]() {
+            abort(external_token_.reason());
+            release();
+          });
+    }
+  }
+
+  const std::shared_ptr<CancellationState> &cancellation() const {
+    return cancellation_;
+  }
+
+  // The callback is otherwise only touched by the drainer, so other threads may only read
+  // what doesn't change once the sequence has started.
+  Callback &callback() {
+    return callback_;
+  }
+
+  void run() {
+    drain();
+    release();
+  }
+
+  void item_done(bool keep_going, ErrorCode error) {
+    if (!keep_going) {
+      stop(error);
+    }
+
+    unsigned int outstanding = outstanding_.fetch_sub(1) - 1;
+
+    if (stop_.load()) {
+      if (outstanding == 0) {
+        // The last item in flight after a stop.
+        finish(stop_error_);
+      }
+    } else if (outstanding == 0 && exhausted_.load()) {
+      // All done.
+      finish(error);
+    } else {
+      // A slot is free.  Spawn the next item, or have the drainer do it.
+      drain();
+    }
+
+    release();
+  }
+
+  // Stops the sequence.  Unlike SequencerState::abort(), the final callback still waits
+  // for the items in flight.
+  void abort(ErrorCode error) {
+    stop(error);
+  }
+
+  bool stopped() const {
+    return stop_.load();
+  }
+
+private:
+  void stop(ErrorCode error) {
+    if (stop_requested_.exchange(true)) {
+      return;
+    }
+    stop_error_ = error;
+    stop_.store(true);
+
+    if (cancellation_) {
+      cancellation_->cancel(error);
+    }
+    if (outstanding_.load() == 0) {
+      finish(error);
+    }
+  }
+
+  void drain() {
+    if (drain_requests_.fetch_add(1) != 0) {
+      // Another thread, or a frame further up this thread's stack, is draining.  It will
+      // see our request before it stops.
+      return;
+    }
+
+    unsigned int requests = 1;
+    for (;;) {
+      spawn_available();
+
+      unsigned int remaining = drain_requests_.fetch_sub(requests) - requests;
+      if (remaining == 0) {
+        return;
+      }
+      requests = remaining;
+    }
+  }
+
+  // Only called by the drainer.
+  void spawn_available() {
+    while (!stop_.load() &&
+        item_iter_ != items_end_ &&
+        (limit_ == 0 || outstanding_.load() < limit_)) {
+      outstanding_.fetch_add(1);
+      if (stop_.load()) {
+        // Stopped since the check: take the item back, and finish if it was the last.
+        if (outstanding_.fetch_sub(1) == 1) {
+          finish(stop_error_);
+        }
+        return;
+      }
+      spawn_one();
+    }
+
+    if (item_iter_ == items_end_ && !exhausted_.load()) {
+      exhausted_.store(true);
+      if (outstanding_.load() == 0 && !stop_.load()) {
+        finish(OK);
+      }
+    }
+  }
+
+  // Only called by the drainer.
+  void spawn_one() {
+    refs_.fetch_add(1, std::memory_order_relaxed);
+
+    // Refer to the item in place; the callback decides whether to copy it.
+    auto &&item = *item_iter_;
+    bool is_last_item = item_iter_ == items_end_;
+    item_iter_++;
+    item_index_++;
+
+    callback_(item, item_index_ - 1, is_last_item, CallbackDone(this));
+  }
+
+  // Both the stop path and the completion path may get here, on different threads.  Only
+  // the first invokes the final callback.
+  void finish(ErrorCode error) {
+    if (!finished_.exchange(true)) {
+      final_callback_(error);
+
+      // If the caller's handler is already firing, it releases its own reference.
+      if (external_registration_.reset()) {
+        release();
+      }
+      release();
+    }
+  }
+
+  void release() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  // Owned by the drainer.
+  TIter item_iter_;
+  TIter items_end_;
+  unsigned int limit_;
+  unsigned int item_index_ = 0;
+  Callback callback_;
+
+  FinalCallback final_callback_;
+  std::atomic<unsigned int> outstanding_ { 0 };
+  std::atomic<unsigned int> drain_requests_ { 0 };
+  std::atomic<unsigned int> refs_ { 2 };
+  std::atomic<bool> stop_requested_ { false };
+  // Written once, by the first stop, before it sets `stop_`.
+  ErrorCode stop_error_ = OK;
+  std::atomic<bool> stop_ { false };
+  std::atomic<bool> exhausted_ { false };
+  std::atomic<bool> finished_ { false };
+  std::shared_ptr<CancellationState> cancellation_;
+  CancellationToken external_token_;
+  CancellationRegistration external_registration_;
+};
+
+}
+
+namespace concurrent {
+
+/**
+   Same as `async::sequencer`, except that `callback_done` may be invoked from any thread,
+   concurrently with other items' `callback_done`.  For example, from tasks completing on
+   an io_service that is run by several threads.
+
+   `callback` is only ever invoked by one thread at a time, but not always the same one.
+   `final_callback` is invoked exactly once, on whichever thread completes the sequence.
+   If an item fails, or `token` is cancelled, no more items are spawned and those in
+   flight are cancelled, but `final_callback` is only invoked once every item spawned has
+   reported back, so items may write into the results until then.
+ */
+template <typename T, typename TIter, typename Callback, typename FinalCallback>
+void sequencer(TIter items_begin, TIter items_end,
+    unsigned int limit,
+    Callback callback,
+    FinalCallback final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  if (items_begin == items_end) {
+    final_callback(token.reason());
+    return;
+  }
+
+  auto state = new detail::ConcurrentSequencerState<TIter, Callback, FinalCallback>(
+      items_begin, items_end, limit, std::move(callback), std::move(final_callback));
+  if (token.can_be_cancelled() || detail::item_accepts_token<Callback>::value) {
+    state->enable_cancellation(token);
+  }
+  state->run();
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,493 @@
+#pragma once
+
+#ifndef ASYNC_COROUTINE_HPP
+#define ASYNC_COROUTINE_HPP
+
+// C++20 coroutine support.  Unlike the rest of the library this needs C++20, so it is not
+// included by async.hpp; include it directly.
+
+#if !defined(__cpp_impl_coroutine)
+#error "async/coroutine.hpp requires C++20 coroutines"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "async.hpp"
+
+namespace async {
+
+namespace detail {
+
+/**
+   Recycles coroutine frames, so that awaiting a task doesn't cost a malloc once the
+   program has warmed up.  Frames are rounded up to a size class and kept on a per-thread
+   free list of that class.  A frame freed on a different thread than the one that
+   allocated it simply moves to that thread's list.  Frames too large for any class go
+   straight to the global allocator.
+ */
+class FramePool {
+public:
+  static void *allocate(std::size_t size) {
+    std::size_t size_class = size_class_of(size);
+    if (size_class >= kClasses) {
+      return ::operator new(size);
+    }
+
+    FreeLists &lists = free_lists();
+    if (Block *block = lists.heads[size_class]) {
+      lists.heads[size_class] = block->next;
+      return block;
+    }
+    return ::operator new((size_class + 1) * kGranularity);
+  }
+
+  static void deallocate(void *p, std::size_t size) {
+    std::size_t size_class = size_class_of(size);
+    if (size_class >= kClasses) {
+      ::operator delete(p);
+      return;
+    }
+
+    FreeLists &lists = free_lists();
+    Block *block = static_cast<Block*>(p);
+    block->next = lists.heads[size_class];
+    lists.heads[size_class] = block;
+  }
+
+private:
+  static constexpr std::size_t kGranularity = 64;
+  static constexpr std::size_t kClasses = 32;  // Frames up to 2KB.
+
+  struct Block {
+    Block *next;
+  };
+
+  struct FreeLists {
+    Block *heads[kClasses] = {};
+
+    ~FreeLists() {
+      for (Block *head : heads) {
+        while (head) {
+          Block *next = head->next;
+          ::operator delete(head);
+          head = next;
+        }
+      }
+    }
+  };
+
+  static std::size_t size_class_of(std::size_t size) {
+    return (size - 1) / kGranularity;
+  }
+
+  static FreeLists &free_lists() {
+    static thread_local FreeLists lists;
+    return lists;
+  }
+};
+
+struct PooledFrame {
+  static void *operator new(std::size_t size) {
+    return FramePool::allocate(size);
+  }
+
+  static void operator delete(void *p, std::size_t size) {
+    FramePool::deallocate(p, size);
+  }
+};
+
+template<typename T>
+class TaskPromise;
+
+}
+
+/**
+   A lazily started coroutine producing a `T`.  It starts when it is first awaited, and
+   resumes its awaiter when it finishes, without going through the awaiter's caller.
+   Frames come from a recycling pool.
+
+   To start a task from code that isn't a coroutine, use `co::start()`.
+ */
+template<typename T=void>
+class task {
+public:
+  using promise_type = detail::TaskPromise<T>;
+
+  explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+  task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  ~task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  task(const task&) = delete;
+  task &operator=(const task&) = delete;
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    handle_.promise().continuation_ = awaiter;
+    return handle_;
+  }
+
+  T await_resume() {
+    return handle_.promise().result();
+  }
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+class TaskPromiseBase : public PooledFrame {
+public:
+  struct FinalAwaiter {
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      std::coroutine_handle<> continuation = handle.promise().continuation_;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() const noexcept {
+    return {};
+  }
+
+  FinalAwaiter final_suspend() const noexcept {
+    return {};
+  }
+
+  void unhandled_exception() {
+    exception_ = std::current_exception();
+  }
+
+  std::coroutine_handle<> continuation_;
+
+protected:
+  void rethrow_if_exception() {
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+  }
+
+private:
+  std::exception_ptr exception_;
+};
+
+template<typename T>
+class TaskPromise : public TaskPromiseBase {
+public:
+  task<T> get_return_object() {
+    return task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+  }
+
+  template<typename U>
+  void return_value(U &&value) {
+    value_.emplace(std::forward<U>(value));
+  }
+
+  T result() {
+    rethrow_if_exception();
+    return std::move(*value_);
+  }
+
+private:
+  std::optional<T> value_;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+  task<void> get_return_object() {
+    return task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+  }
+
+  void return_void() {}
+
+  void result() {
+    rethrow_if_exception();
+  }
+};
+
+// A fire-and-forget coroutine, used by `co::start()`.  It runs as soon as it is created,
+// and frees itself when it finishes.
+struct Detached {
+  struct promise_type : PooledFrame {
+    Detached get_return_object() const noexcept { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
+
+/**
+   Awaits an operation which reports its outcome through a callback.  `start` is invoked
+   with a completion callback when the awaiting coroutine suspends.  If the operation
+   completes synchronously, the coroutine carries on without suspending at all; otherwise
+   the completion callback resumes it, on whichever thread it is invoked.
+ */
+template<typename Result, typename Start>
+class CallbackAwaiter {
+public:
+  explicit CallbackAwaiter(Start start) : start_(std::move(start)) {}
+
+  // The completion callback handed to `start`.  It is one pointer wide.
+  class Completion {
+  public:
+    explicit Completion(CallbackAwaiter *awaiter) : awaiter_(awaiter) {}
+
+    template<typename... Args>
+    void operator()(Args&&... args) const {
+      awaiter_->complete(Result { std::forward<Args>(args)... });
+    }
+
+  private:
+    CallbackAwaiter *awaiter_;
+  };
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+    start_(Completion(this));
+    return state_.exchange(kSuspended) != kCompleted;
+  }
+
+  Result await_resume() {
+    return std::move(*result_);
+  }
+
+  void complete(Result &&result) {
+    result_.emplace(std::move(result));
+    if (state_.exchange(kCompleted) == kSuspended) {
+      handle_.resume();
+    }
+  }
+
+private:
+  enum { kStarting, kSuspended, kCompleted };
+
+  Start start_;
+  std::coroutine_handle<> handle_;
+  std::optional<Result> result_;
+  std::atomic<int> state_ { kStarting };
+};
+
+template<typename Result, typename Start>
+CallbackAwaiter<Result, Start> make_callback_awaiter(Start start) {
+  return CallbackAwaiter<Result, Start>(std::move(start));
+}
+
+template<typename Executor>
+class PostAwaiter {
+public:
+  explicit PostAwaiter(Executor &executor) : executor_(executor) {}
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    executor_.post([handle]() { handle.resume(); });
+  }
+
+  void await_resume() const noexcept {}
+
+private:
+  Executor &executor_;
+};
+
+}
+
+/**
+   Awaitable versions of the combinators.  Each takes the same arguments as its callback
+   version, minus `final_callback`, and produces what `final_callback` would have been
+   given.  For example:
+
+     async::co::Result<std::vector<int>> squares = co_await async::co::map(data, square, 4);
+
+   As with the callback versions, the data and task vectors are used in place, and must
+   outlive the `co_await`.
+ */
+namespace co {
+
+template<typename T>
+struct Result {
+  ErrorCode error;
+  T value;
+};
+
+// Starts `t`, from code that is not a coroutine.  `callback` is invoked with the task's
+// result when it finishes.
+template<typename T, typename Callback>
+void start(task<T> t, Callback callback) {
+  [](task<T> t, Callback callback) -> detail::Detached {
+    callback(co_await t);
+  }(std::move(t), std::move(callback));
+}
+
+template<typename Callback>
+void start(task<void> t, Callback callback) {
+  [](task<void> t, Callback callback) -> detail::Detached {
+    co_await t;
+    callback();
+  }(std::move(t), std::move(callback));
+}
+
+inline void start(task<void> t) {
+  start(std::move(t), []() {});
+}
+
+// Resumes the awaiting coroutine on `executor`: for example, on a thread running an
+// io_service, or on a ThreadPool.
+template<typename Executor>
+detail::PostAwaiter<Executor> post(Executor &executor) {
+  return detail::PostAwaiter<Executor>(executor);
+}
+
+// Awaits a callback-style task: any function taking a TaskCallback<T>, such as the
+// Boost ASIO steps in a TaskVector.
+template<typename T, typename Func>
+auto call(Func func) {
+  return detail::make_callback_awaiter<Result<T>>([func](auto completion) mutable {
+        TaskCallback<T> callback(completion);
+        func(callback);
+      });
+}
+
+template<typename T, typename Func>
+auto map(std::vector<T> &data, Func func, unsigned int task_limit=0) {
+  return detail::make_callback_awaiter<Result<std::vector<T>>>(
+      [&data, func, task_limit](auto completion) mutable {
+        async::map<T>(data, std::move(func),
+            [completion](ErrorCode error, std::vector<T> &results) {
+              completion(error, std::move(results));
+            },
+            task_limit);
+      });
+}
+
+template<typename T, typename Func>
+auto each(std::vector<T> &data, Func func, unsigned int task_limit=0) {
+  return detail::make_callback_awaiter<ErrorCode>([&data, func, task_limit](auto completion) mutable {
+        async::each<T>(data, std::move(func), completion, task_limit);
+      });
+}
+
+template<typename T, typename Test>
+auto filter(std::vector<T> &data, Test test) {
+  return detail::make_callback_awaiter<std::vector<T>>([&data, test](auto completion) mutable {
+        async::filter<T>(data, std::move(test), [completion](std::vector<T> &results) {
+              completion(std::move(results));
+            });
+      });
+}
+
+template<typename T, typename Test>
+auto reject(std::vector<T> &data, Test test) {
+  return detail::make_callback_awaiter<std::vector<T>>([&data, test](auto completion) mutable {
+        async::reject<T>(data, std::move(test), [completion](std::vector<T> &results) {
+              completion(std::move(results));
+            });
+      });
+}
+
+template<typename T, typename TTask=Task<T>>
+auto parallel_limit(std::vector<TTask> &tasks, unsigned int limit) {
+  return detail::make_callback_awaiter<Result<std::vector<T>>>([&tasks, limit](auto completion) {
+        async::parallel_limit<T>(tasks, limit,
+            [completion](ErrorCode error, std::vector<T> &results) {
+              completion(error, std::move(results));
+            });
+      });
+}
+
+template<typename T, typename TTask=Task<T>>
+auto parallel(std::vector<TTask> &tasks) {
+  return co::parallel_limit<T>(tasks, 0);
+}
+
+template<typename T, typename TTask=Task<T>>
+auto series(std::vector<TTask> &tasks) {
+  return co::parallel_limit<T>(tasks, 1);
+}
+
+template<typename Test, typename Func>
+auto whilst(Test test, Func func) {
+  return detail::make_callback_awaiter<ErrorCode>([test, func](auto completion) {
+        async::whilst(test, func, completion);
+      });
+}
+
+template<typename Func, typename Test>
+auto doWhilst(Func func, Test test) {
+  return detail::make_callback_awaiter<ErrorCode>([func, test](auto completion) {
+        async::doWhilst(func, test, completion);
+      });
+}
+
+template<typename Test, typename Func>
+auto until(Test test, Func func) {
+  return detail::make_callback_awaiter<ErrorCode>([test, func](auto completion) {
+        async::until(test, func, completion);
+      });
+}
+
+template<typename Func, typename Test>
+auto doUntil(Func func, Test test) {
+  return detail::make_callback_awaiter<ErrorCode>([func, test](auto completion) {
+        async::doUntil(func, test, completion);
+      });
+}
+
+template<typename Func>
+auto forever(Func func) {
+  return detail::make_callback_awaiter<ErrorCode>([func](auto completion) {
+        async::forever(func, completion);
+      });
+}
+
+template<typename Func>
+auto ntimes(int times, Func func) {
+  return detail::make_callback_awaiter<ErrorCode>([times, func](auto completion) {
+        async::ntimes(times, func, completion);
+      });
+}
+
+}
+
+}
+
+#endif
@@ -3,26 +3,378 @@
 #ifndef ASYNC_DEBUG_HPP
 #define ASYNC_DEBUG_HPP
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+// Log levels, for ASYNC_LOG_LEVEL.
+#define ASYNC_LOG_NONE 0
+#define ASYNC_LOG_ERROR 1
+#define ASYNC_LOG_WARN 2
+#define ASYNC_LOG_INFO 3
+#define ASYNC_LOG_DEBUG 4
+
+// The most verbose level compiled in.  Define it before including async.hpp:
+//
+//   #define ASYNC_LOG_LEVEL ASYNC_LOG_INFO
+//
+// By default nothing is logged.
+#ifndef ASYNC_LOG_LEVEL
+#define ASYNC_LOG_LEVEL ASYNC_LOG_NONE
+#endif
+
+/**
+   Logs `format` at `level`, if ASYNC_LOG_LEVEL includes it.  Each `{}` in `format` is
+   replaced by the next argument:
+
+     ASYNC_LOG(ASYNC_LOG_INFO, "step {} failed: {}", step, error);
+
+   Above ASYNC_LOG_LEVEL, this is dead code: the arguments aren't evaluated, and nothing
+   is left in the binary.  Otherwise it copies the format's address, a timestamp and up
+   to four arguments into async::logger()'s ring buffer, and the logger's thread writes
+   them out later.  Arguments may be integers, floating point numbers, pointers,
+   `ErrorCode`s, or strings which outlive the logger, such as literals.  `format` must be
+   a literal too.
+ */
+#define ASYNC_LOG(level, ...) \
+  do { \
+    if ((level) != ASYNC_LOG_NONE && (level) <= ASYNC_LOG_LEVEL) { \
+      ::async::logger().record((level), __VA_ARGS__); \
+    } \
+  } while (0)
+
+// Logs "> name" at ASYNC_LOG_DEBUG, and "< name" when the enclosing scope ends.
+#if ASYNC_LOG_LEVEL >= ASYNC_LOG_DEBUG
+#define ASYNC_DEBUG_SCOPE(name) ::async::DebugScope async_debug_scope_(name)
+#else
+#define ASYNC_DEBUG_SCOPE(name) do {} while (0)
+#endif
 
 namespace async {
 
-class DebugScope {
+namespace detail {
+
+// One argument of a log record, with its type.
+struct LogArg {
+  enum Type : uint8_t { SIGNED, UNSIGNED, DOUBLE, POINTER, STRING };
+
+  template<typename T, typename std::enable_if<
+      std::is_integral<T>::value && std::is_signed<T>::value, int>::type = 0>
+  LogArg(T value) : type(SIGNED) {
+    this->value.i = value;
+  }
+
+  template<typename T, typename std::enable_if<
+      std::is_integral<T>::value && std::is_unsigned<T>::value, int>::type = 0>
+  LogArg(T value) : type(UNSIGNED) {
+    this->value.u = value;
+  }
+
+  // Enums, such as ErrorCode, are logged as their values.
+  template<typename T, typename std::enable_if<std::is_enum<T>::value, int>::type = 0>
+  LogArg(T value) : type(SIGNED) {
+    this->value.i = static_cast<int64_t>(value);
+  }
+
+  LogArg(double value) : type(DOUBLE) {
+    this->value.d = value;
+  }
+
+  LogArg(const char *value) : type(STRING) {
+    this->value.s = value;
+  }
+
+  LogArg(const void *value) : type(POINTER) {
+    this->value.p = value;
+  }
+
+  LogArg() : type(SIGNED) {
+    value.i = 0;
+  }
+
+  union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    const void *p;
+    const char *s;
+  } value;
+  Type type;
+};
+
+struct LogRecord {
+  static const unsigned kMaxArgs = 4;
+
+  uint64_t nanoseconds;
+  const char *format;
+  LogArg args[kMaxArgs];
+  uint32_t thread;
+  uint8_t level;
+  uint8_t arg_count;
+};
+
+/**
+   A bounded queue of records, for any number of writers and one reader, after Dmitry
+   Vyukov's.  Each slot has a sequence number: a writer claims the slot at the write
+   position by advancing the position, when the slot's sequence says the reader is done
+   with it, then publishes the record by bumping the sequence.  So writers never block
+   each other or wait on the reader; if the queue is full, the record is dropped.
+ */
+class LogRing {
 public:
-  DebugScope(std::string msg) : msg_(msg) {
-    std::cout << "> " << msg_ << std::endl;
-  };
+  // `capacity` must be a power of two.
+  explicit LogRing(size_t capacity)
+    : slots_(new Slot[capacity]), mask_(capacity - 1) {
+    for (size_t i = 0; i < capacity; i++) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
 
-  ~DebugScope() {
-    std::cout << "< " << msg_ << std::endl;
+  bool push(const LogRecord &record) {
+    size_t position = write_position_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &slot = slots_[position & mask_];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+      if (lag == 0) {
+        if (write_position_.compare_exchange_weak(position, position + 1,
+                std::memory_order_relaxed)) {
+          slot.record = record;
+          slot.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (lag < 0) {
+        return false;
+      } else {
+        position = write_position_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Only one thread at a time may pop.
+  bool pop(LogRecord &record) {
+    Slot &slot = slots_[read_position_ & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != read_position_ + 1) {
+      return false;
+    }
+    record = slot.record;
+    slot.sequence.store(read_position_ + mask_ + 1, std::memory_order_release);
+    read_position_++;
+    return true;
+  }
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    LogRecord record;
   };
 
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+  std::atomic<size_t> write_position_ { 0 };
+  size_t read_position_ = 0;
+};
+
+}
+
+class Logger;
+inline Logger &logger();
+
+/**
+   Writes out the records of ASYNC_LOG.  Recording a record takes no lock and formats
+   nothing: the record goes into a ring buffer, and a thread of the logger's own wakes
+   every few milliseconds to format what is there and write it to `output()`.  A record
+   made while the ring is full is dropped, and counted in `dropped()`.
+
+   The logger, and its thread, are created by the first record, so a program which logs
+   nothing never starts them.  Records still in the ring are written when the program
+   exits, or by `flush()`.
+ */
+class Logger {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  static const size_t kCapacity = 1 << 14;
+
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  ~Logger() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+    flush();
+  }
+
+  template<typename... Args>
+  void record(int level, const char *format, Args... args) {
+    static_assert(sizeof...(Args) <= detail::LogRecord::kMaxArgs,
+        "ASYNC_LOG takes at most four arguments");
+
+    detail::LogRecord record;
+    record.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start_).count();
+    record.format = format;
+    record.thread = thread_id();
+    record.level = level;
+    record.arg_count = sizeof...(Args);
+    set_args(record.args, args...);
+
+    if (!ring_.push(record)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Writes out every record made before the call.
+  void flush() {
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    detail::LogRecord record;
+    bool wrote = false;
+    while (ring_.pop(record)) {
+      write(*output_, record);
+      wrote = true;
+    }
+    if (wrote) {
+      output_->flush();
+    }
+  }
+
+  std::ostream &output() const {
+    return *output_;
+  }
+
+  // `output` must outlive the logger, or the next call.  std::clog, by default.
+  void set_output(std::ostream &output) {
+    flush();
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    output_ = &output;
+  }
+
+  // The records dropped because the ring was full.
+  unsigned long dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
 private:
-  std::string msg_;
+  friend Logger &logger();
+
+  Logger() : ring_(kCapacity), start_(Clock::now()), output_(&std::clog) {
+    thread_ = std::thread([this]() {
+          std::unique_lock<std::mutex> lock(wake_mutex_);
+          while (!stopping_) {
+            wake_.wait_for(lock, std::chrono::milliseconds(5));
+            lock.unlock();
+            flush();
+            lock.lock();
+          }
+        });
+  }
+
+  static uint32_t thread_id() {
+    static std::atomic<uint32_t> next_id { 1 };
+    static thread_local uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+    return id;
+  }
+
+  static void set_args(detail::LogArg *args) {}
+
+  template<typename Arg, typename... Args>
+  static void set_args(detail::LogArg *args, Arg arg, Args... rest) {
+    *args = detail::LogArg(arg);
+    set_args(args + 1, rest...);
+  }
+
+  // Writes "I +1.234567 3: message", with the level's initial, the seconds since the
+  // logger started, and the thread.
+  static void write(std::ostream &out, const detail::LogRecord &record) {
+    static const char levels[] = "?EWID";
+    char prefix[48];
+    snprintf(prefix, sizeof(prefix), "%c +%.6f %u: ",
+        levels[record.level < sizeof(levels) - 1 ? record.level : 0],
+        record.nanoseconds / 1e9, record.thread);
+    out << prefix;
+
+    unsigned arg = 0;
+    for (const char *c = record.format; *c; c++) {
+      if (c[0] == '{' && c[1] == '}' && arg < record.arg_count) {
+        write_arg(out, record.args[arg++]);
+        c++;
+      } else {
+        out << *c;
+      }
+    }
+    out << '\n';
+  }
+
+  static void write_arg(std::ostream &out, const detail::LogArg &arg) {
+    switch (arg.type) {
+      case detail::LogArg::SIGNED:
+        out << arg.value.i;
+        break;
+      case detail::LogArg::UNSIGNED:
+        out << arg.value.u;
+        break;
+      case detail::LogArg::DOUBLE:
+        out << arg.value.d;
+        break;
+      case detail::LogArg::POINTER:
+        out << arg.value.p;
+        break;
+      case detail::LogArg::STRING:
+        out << (arg.value.s ? arg.value.s : "(null)");
+        break;
+    }
+  }
+
+  detail::LogRing ring_;
+  Clock::time_point start_;
+  std::atomic<unsigned long> dropped_ { 0 };
+
+  std::mutex drain_mutex_;
+  std::ostream *output_;
+
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::thread thread_;
 };
 
+// The logger, which every ASYNC_LOG records into.
+inline Logger &logger() {
+  static Logger logger;
+  return logger;
 }
 
-#endif
+/**
+   Logs "> name" when constructed and "< name" when destroyed, at ASYNC_LOG_DEBUG.  Use
+   it through ASYNC_DEBUG_SCOPE, which compiles to nothing below that level.  `name`
+   must outlive the logger.
+ */
+class DebugScope {
+public:
+  explicit DebugScope(const char *name) : name_(name) {
+    logger().record(ASYNC_LOG_DEBUG, "> {}", name_);
+  }
+
+  ~DebugScope() {
+    logger().record(ASYNC_LOG_DEBUG, "< {}", name_);
+  }
+
+private:
+  const char *name_;
+};
 
+}
 
+#endif
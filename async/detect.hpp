@@ -0,0 +1,209 @@
+#pragma once
+
+#ifndef ASYNC_DETECT_HPP
+#define ASYNC_DETECT_HPP
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <type_traits>
+
+#include "sequencer.hpp"
+
+namespace async {
+
+/**
+   `some`, `every` and `detect` test items as `filter` does, but finish as soon as the
+   answer is known: `some` at the first item to pass, `every` at the first to fail, and
+   `detect` at the first to pass, in the order the tests complete.  No more tests are
+   started after that.  Tests still in flight are left to finish; those which accept a
+   CancellationToken see it cancelled, with reason STOP.
+ */
+
+template<typename T>
+using DetectCallback = CallbackFunction<void(T *item)>;
+
+namespace detail {
+
+// The callback handed to `test` for one item, which stops the sequence when the test's
+// verdict is `decisive`.  It is a single pointer wide, so it fits in the small-object
+// buffer of BoolCallback.
+template<typename CallbackDone, bool decisive>
+class DecideTaskCallback {
+public:
+  explicit DecideTaskCallback(CallbackDone callback_done) : callback_done_(callback_done) {}
+
+  void operator()(bool truth) const {
+    if (truth == decisive) {
+      callback_done_(false, STOP);
+    } else {
+      callback_done_(true, OK);
+    }
+  }
+
+private:
+  CallbackDone callback_done_;
+};
+
+template<typename T, typename Test, bool decisive>
+class DecideItemCallback {
+public:
+  static const bool accepts_token = accepts_cancellation_token<Test, T&, BoolCallback>::value;
+
+  explicit DecideItemCallback(Test &&test) : test_(std::move(test)) {}
+
+  template<typename CallbackDone>
+  void operator()(T &item, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_item(test_, DecideTaskCallback<CallbackDone, decisive>(callback_done),
+        callback_done, index, item);
+  }
+
+private:
+  Test test_;
+};
+
+// Turns the sequence's error into the answer: `decisive` if a test stopped the sequence,
+// its opposite if every test ran, and false if the sequence was cancelled.
+template<typename FinalCallback, bool decisive>
+class DecideFinalCallback {
+public:
+  explicit DecideFinalCallback(const FinalCallback &final_callback)
+    : final_callback_(final_callback) {}
+
+  void operator()(ErrorCode error) {
+    final_callback_(error == STOP ? decisive : error == OK && !decisive);
+  }
+
+private:
+  typename std::decay<FinalCallback>::type final_callback_;
+};
+
+// The value of `found` until an item passes.
+const size_t kDetectNotFound = size_t(-1);
+
+// The callback handed to `test` for one item, in `detect`.  Two words wide, like
+// FilterTaskCallback.
+template<typename CallbackDone>
+class DetectTaskCallback {
+public:
+  DetectTaskCallback(const CallbackDone &callback_done, unsigned int index)
+    : callback_done_(callback_done), index_(index) {}
+
+  void operator()(bool truth) const {
+    size_t *found = callback_done_.callback().found();
+    if (truth && *found == kDetectNotFound) {
+      *found = index_;
+      callback_done_(false, STOP);
+    } else {
+      callback_done_(true, OK);
+    }
+  }
+
+private:
+  CallbackDone callback_done_;
+  unsigned int index_;
+};
+
+// Records the index of the first item to pass, in `found`.
+template<typename T, typename Test>
+class DetectItemCallback {
+public:
+  DetectItemCallback(Test &&test, size_t *found) : test_(std::move(test)), found_(found) {}
+
+  template<typename CallbackDone>
+  void operator()(T &item, int index, bool is_last_time, CallbackDone callback_done) {
+    test_(item, DetectTaskCallback<CallbackDone>(callback_done, index));
+  }
+
+  size_t *found() const {
+    return found_;
+  }
+
+private:
+  Test test_;
+  size_t *found_;
+};
+
+// Owns the index of the item found, which tests still in flight may look at after the
+// sequence has finished.
+template<typename T, typename FinalCallback>
+class DetectFinalCallback {
+public:
+  DetectFinalCallback(std::vector<T> &data, const FinalCallback &final_callback,
+      size_t *found)
+    : data_(data), final_callback_(final_callback), found_(found) {}
+
+  void operator()(ErrorCode error) {
+    final_callback_(error == STOP ? &data_[*found_] : nullptr);
+  }
+
+private:
+  std::vector<T> &data_;
+  typename std::decay<FinalCallback>::type final_callback_;
+  std::unique_ptr<size_t> found_;
+};
+
+}
+
+// Invokes `final_callback(true)` as soon as `test` passes an item, or
+// `final_callback(false)` once it has failed them all.  `test` is invoked as
+// `test(item, callback)`, or `test(item, callback, token)` if it accepts a
+// CancellationToken, and invokes `callback(bool)`.
+//
+// `task_limit` - the max number of tests outstanding at once; 0 for no limit.
+template <typename T, typename Test, typename FinalCallback=BoolCallback>
+void some(std::vector<T> &data,
+    Test test,
+    const FinalCallback &final_callback,
+    unsigned int task_limit=0) {
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::DecideItemCallback<T, Test, true>(std::move(test)),
+          detail::DecideFinalCallback<FinalCallback, true>(final_callback));
+}
+
+// The same as `async::some`.
+template <typename T, typename Test, typename FinalCallback=BoolCallback>
+void any(std::vector<T> &data,
+    Test test,
+    const FinalCallback &final_callback,
+    unsigned int task_limit=0) {
+
+  some<T>(data, std::move(test), final_callback, task_limit);
+}
+
+// Invokes `final_callback(false)` as soon as `test` fails an item, or
+// `final_callback(true)` once it has passed them all; see `async::some`.
+template <typename T, typename Test, typename FinalCallback=BoolCallback>
+void every(std::vector<T> &data,
+    Test test,
+    const FinalCallback &final_callback,
+    unsigned int task_limit=0) {
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::DecideItemCallback<T, Test, false>(std::move(test)),
+          detail::DecideFinalCallback<FinalCallback, false>(final_callback));
+}
+
+// Invokes `final_callback(item)`, with a pointer into `data`, as soon as `test` passes
+// an item, or `final_callback(nullptr)` once it has failed them all.  `test` is invoked
+// as `test(item, callback)`.  If several tests are in flight, the first to pass wins,
+// which need not be the first in `data`.
+template <typename T, typename Test, typename FinalCallback=DetectCallback<T>>
+void detect(std::vector<T> &data,
+    Test test,
+    const FinalCallback &final_callback,
+    unsigned int task_limit=0) {
+
+  size_t *found = new size_t(detail::kDetectNotFound);
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::DetectItemCallback<T, Test>(std::move(test), found),
+          detail::DetectFinalCallback<T, FinalCallback>(data, final_callback, found));
+}
+
+}
+
+#endif
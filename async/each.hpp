@@ -3,35 +3,130 @@
 #ifndef ASYNC_EACH_HPP
 #define ASYNC_EACH_HPP
 
+#include <type_traits>
+
+#include "concurrent_sequencer.hpp"
+#include "executor.hpp"
 #include "sequencer.hpp"
 
 namespace async {
 
+namespace detail {
+
+// The callback handed to `func` for one item.  It is a single pointer wide, so it fits
+// in the small-object buffer of ErrorCodeCallback.
+template<typename CallbackDone>
+class EachTaskCallback {
+public:
+  explicit EachTaskCallback(CallbackDone callback_done) : callback_done_(callback_done) {}
+
+  void operator()(ErrorCode error) const {
+    callback_done_(error == OK, error);
+  }
+
+private:
+  CallbackDone callback_done_;
+};
+
+// `Item` is `T&`, or `T&&` when the sequence owns `data`; see MapItemCallback.
+template<typename T, typename Func, typename Item=T&>
+class EachItemCallback {
+public:
+  static const bool accepts_token =
+      accepts_cancellation_token<Func, Item, ErrorCodeCallback>::value;
+
+  explicit EachItemCallback(Func &&func) : func_(std::move(func)) {}
+
+  template<typename CallbackDone>
+  void operator()(T &object, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_item(func_, EachTaskCallback<CallbackDone>(callback_done), callback_done, index,
+        static_cast<Item>(object));
+  }
+
+private:
+  Func func_;
+};
+
+}
+
 // `data`, `func`, and `final_callback` are passed by reference.  It is the
 // responsibility of the caller to ensure that their lifetime exceeds the lifetime of the
 // series call.
-template<typename T>
+//
+// `func` and `final_callback` may be any callable.  `func` is invoked as
+// `func(item, callback)`, or `func(item, callback, token)` if it accepts a
+// CancellationToken (see `async::map`); nothing is heap-allocated per item.
+// Items are handed to `func` by reference.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
 void each(std::vector<T> &data,
-    std::function<void(T, ErrorCodeCallback)> func,
-    const ErrorCodeCallback &final_callback=noop_error_code_final_callback,
-    unsigned int task_limit=0) {
+    Func func,
+    const FinalCallback &final_callback=noop_error_code_final_callback,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
 
-  auto callback = [func](T object, int index, bool is_last_time,
-      std::function<void(bool, ErrorCode)> callback_done) {
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::EachItemCallback<T, Func>(std::move(func)),
+          typename std::decay<FinalCallback>::type(final_callback),
+          token);
+}
+
+// Same as `async::each`, except that the sequence takes `data` over, and each item is
+// handed to `func` as an rvalue, which `func` may move from.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each(std::vector<T> &&data,
+    Func func,
+    const FinalCallback &final_callback=noop_error_code_final_callback,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  typedef typename std::decay<FinalCallback>::type EachFinalCallback;
+  std::vector<T>* items = new std::vector<T>(std::move(data));
+
+  sequencer<T>
+      (items->begin(), items->end(), task_limit,
+          detail::EachItemCallback<T, Func, T&&>(std::move(func)),
+          detail::OwnedItemsFinalCallback<T, EachFinalCallback>(
+              EachFinalCallback(final_callback), items),
+          token);
+}
 
-    auto task_callback = [callback_done, index](ErrorCode error) {
-      callback_done(error == OK, error);
-    };
+namespace concurrent {
 
-    func(object, task_callback);
-  };
+// Same as `async::each`, except that `func` may complete items on any thread,
+// concurrently.  `final_callback` is invoked on whichever thread completes the last item.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback=noop_error_code_final_callback,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  concurrent::sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::EachItemCallback<T, Func>(std::move(func)),
+          typename std::decay<FinalCallback>::type(final_callback),
+          token);
+}
+
+}
 
-  auto wrapped_final_callback = [final_callback](ErrorCode error) {
-    final_callback(error);
-  };
+// Same as `async::each`, except that `func` is posted onto `executor` for each item.
+// `func` may be invoked on several threads at once; `final_callback` is invoked on
+// whichever thread completes the last item.
+template<typename T, typename Executor, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each(Executor &executor,
+    std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback=noop_error_code_final_callback,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
 
   sequencer<T>
-      (data.begin(), data.end(), task_limit, callback, wrapped_final_callback);
+      (executor, data.begin(), data.end(), task_limit,
+          detail::EachItemCallback<T, Func>(std::move(func)),
+          typename std::decay<FinalCallback>::type(final_callback),
+          token);
 }
 
 }
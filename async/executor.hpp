@@ -0,0 +1,98 @@
+#pragma once
+
+#ifndef ASYNC_EXECUTOR_HPP
+#define ASYNC_EXECUTOR_HPP
+
+#include <utility>
+
+#include "concurrent_sequencer.hpp"
+
+namespace async {
+
+/**
+   An Executor decides where work runs.  It is any object with a member
+
+     template <typename F> void post(F f);
+
+   which arranges for `f()` to be invoked once, at some point, possibly on another thread.
+   `boost::asio::io_service` is an Executor, as are `async::InlineExecutor` and
+   `async::ThreadPool`.
+
+   The overloads of `sequencer`, `map`, `each` and `parallel_limit` which take an executor
+   as their first argument post each item's callback onto it, rather than invoking it on
+   the caller's stack.  Since items may then run and complete on several threads at once,
+   they are sequenced by the `concurrent` sequencer, and the user's functions must be safe
+   to invoke concurrently.  After a failure, the final callback waits for the items already
+   posted, as it does there.
+ */
+
+/**
+   Runs work immediately, on the caller's stack.
+ */
+class InlineExecutor {
+public:
+  template <typename F>
+  void post(F f) {
+    f();
+  }
+};
+
+namespace detail {
+
+// Wraps a sequencer callback, so that it's invoked on an executor rather than directly.
+// The item is referred to in place, so it must stay alive until the final callback, which
+// `data` and `tasks` vectors already must.  The concurrent sequencer holds the final
+// callback until every item posted has reported back, so that is long enough.  Items which
+// reach the front of the executor after the sequence has stopped aren't worth running, and
+// report back CANCELLED instead.
+template <typename Executor, typename Callback>
+class ExecutorItemCallback {
+public:
+  static const bool accepts_token = item_accepts_token<Callback>::value;
+
+  ExecutorItemCallback(Executor &executor, Callback &&callback)
+    : executor_(&executor), callback_(std::move(callback)) {}
+
+  template <typename TItem, typename CallbackDone>
+  void operator()(TItem &item, int index, bool is_last_item, CallbackDone callback_done) {
+    Callback *callback = &callback_;
+    TItem *item_ptr = &item;
+    executor_->post([callback, item_ptr, index, is_last_item, callback_done]() {
+          if (callback_done.stopped()) {
+            callback_done(false, CANCELLED);
+            return;
+          }
+          (*callback)(*item_ptr, index, is_last_item, callback_done);
+        });
+  }
+
+private:
+  Executor *executor_;
+  Callback callback_;
+};
+
+}
+
+/**
+   Same as `async::sequencer`, except that each item's `callback` is posted onto
+   `executor`.  `callback` may run on several threads at once, and `callback_done` and
+   `final_callback` may be invoked on any thread.
+ */
+template <typename T, typename Executor, typename TIter, typename Callback, typename FinalCallback>
+void sequencer(Executor &executor,
+    TIter items_begin, TIter items_end,
+    unsigned int limit,
+    Callback callback,
+    FinalCallback final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  concurrent::sequencer<T>
+      (items_begin, items_end, limit,
+          detail::ExecutorItemCallback<Executor, Callback>(executor, std::move(callback)),
+          std::move(final_callback),
+          token);
+}
+
+}
+
+#endif
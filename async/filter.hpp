@@ -3,6 +3,11 @@
 #ifndef ASYNC_FILTER_HPP
 #define ASYNC_FILTER_HPP
 
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
 #include "forever_iterator.hpp"
 #include "sequencer.hpp"
 
@@ -11,53 +16,299 @@ namespace async {
 template<typename T>
 void noop_filter_final_callback(std::vector<T> &results) {};
 
-template <typename T>
-void filter(std::vector<T> &data,
-    const std::function<void(T, BoolCallback)> &test,
-    const std::function<void(std::vector<T> &results)> &final_callback=noop_filter_final_callback,
-    bool invert=false) {
-
-  std::vector<bool>* keep = new std::vector<bool>(data.size());
-
-  auto wrapped_callback = [invert, keep, test](T item, int index, bool is_last_time,
-      std::function<void(bool, ErrorCode)> callback_done) {
-    BoolCallback task_callback = [callback_done, &index, invert, &item, keep](bool truth) {
-      if (invert) {
-        (*keep)[index] = !truth;
-      } else {
-        (*keep)[index] = truth;
-      }
+template<typename T>
+using FilterCompletionCallback = CallbackFunction<void(std::vector<T> &results)>;
 
-      callback_done(true, OK);
-    };
+namespace detail {
 
-    test(item, task_callback);
-  };
+/**
+   One bit per item, set for the items which pass the test.  Counting the items kept is a
+   popcount per word, so the results can be sized before any is added, and runs of
+   rejected items are skipped a word at a time.
+ */
+class FilterSelection {
+public:
+  explicit FilterSelection(size_t size)
+    : words_(new uint64_t[(size + kWordBits - 1) / kWordBits]()), size_(size) {}
 
-  auto wrapped_final_callback = [&data, final_callback, keep](ErrorCode error) {
-    std::vector<T> results;
+  uint64_t *words() const {
+    return words_.get();
+  }
+
+  static void set(uint64_t *words, size_t index) {
+    words[index / kWordBits] |= uint64_t(1) << (index % kWordBits);
+  }
+
+  // The number of items kept: those whose bit is set, or clear if `invert`.
+  size_t count(bool invert) const {
+    size_t count = 0;
+    for (size_t i = 0; i < word_count(); i++) {
+      count += std::bitset<kWordBits>(word(i, invert)).count();
+    }
+    return count;
+  }
 
-    for (int i = 0; i < keep->size(); i++) {
-      if ((*keep)[i]) {
-        results.push_back(data[i]);
+  // Invokes `func(index)` for each item kept, in order.
+  template<typename Func>
+  void for_each(bool invert, Func func) const {
+    for (size_t i = 0; i < word_count(); i++) {
+      uint64_t bits = word(i, invert);
+      for (size_t index = i * kWordBits; bits != 0; bits >>= 1, index++) {
+        if (bits & 1) {
+          func(index);
+        }
       }
     }
+  }
+
+private:
+  static const size_t kWordBits = 64;
+
+  size_t word_count() const {
+    return (size_ + kWordBits - 1) / kWordBits;
+  }
+
+  // Word `i`, inverted if need be, without the bits past the last item.
+  uint64_t word(size_t i, bool invert) const {
+    uint64_t bits = invert ? ~words_[i] : words_[i];
+    size_t tail = size_ - i * kWordBits;
+    if (tail < kWordBits) {
+      bits &= (uint64_t(1) << tail) - 1;
+    }
+    return bits;
+  }
+
+  std::unique_ptr<uint64_t[]> words_;
+  size_t size_;
+};
+
+// The callback handed to `test` for one item: the item's own `callback_done`, and its
+// index.  The selection is found through the sequencer's state, so it is two words wide
+// and fits in the small-object buffer of BoolCallback.
+template<typename CallbackDone>
+class FilterTaskCallback {
+public:
+  FilterTaskCallback(const CallbackDone &callback_done, unsigned int index)
+    : callback_done_(callback_done), index_(index) {}
+
+  void operator()(bool truth) const {
+    if (truth) {
+      FilterSelection::set(callback_done_.callback().selected(), index_);
+    }
+    callback_done_(true, OK);
+  }
+
+private:
+  CallbackDone callback_done_;
+  unsigned int index_;
+};
+
+// Runs `test` on each item, and records its verdict in the item's bit.
+template<typename T, typename Test>
+class FilterItemCallback {
+public:
+  FilterItemCallback(Test &&test, uint64_t *selected)
+    : test_(std::move(test)), selected_(selected) {}
+
+  template<typename CallbackDone>
+  void operator()(T &item, int index, bool is_last_time, CallbackDone callback_done) {
+    test_(item, FilterTaskCallback<CallbackDone>(callback_done, index));
+  }
 
-    final_callback(results);
+  uint64_t *selected() const {
+    return selected_;
+  }
+
+private:
+  Test test_;
+  uint64_t *selected_;
+};
+
+// Owns the selection.  It is freed along with the sequencer state, once the last item
+// has reported back, since items still in flight after a stop may yet write to it.
+// `Item` is `T&` if the items kept are copied out of `data`, or `T&&` if they are moved,
+// when the sequence owns `data`.
+template<typename T, typename FinalCallback, typename Item=T&>
+class FilterFinalCallback {
+public:
+  FilterFinalCallback(std::vector<T> &data, const FinalCallback &final_callback,
+      FilterSelection &&selection, bool invert)
+    : data_(data),
+      final_callback_(final_callback),
+      selection_(std::move(selection)),
+      invert_(invert) {}
+
+  void operator()(ErrorCode error) {
+    std::vector<T> results;
+    results.reserve(selection_.count(invert_));
+    selection_.for_each(invert_, [this, &results](size_t index) {
+          results.push_back(static_cast<Item>(data_[index]));
+        });
 
-    delete keep;
-  };
+    final_callback_(results);
+  }
+
+private:
+  std::vector<T> &data_;
+  typename std::decay<FinalCallback>::type final_callback_;
+  FilterSelection selection_;
+  bool invert_;
+};
+
+// Compacts `data` itself, moving each item kept down over those dropped, then erasing the
+// tail, and hands `data` to `final_callback`.
+template<typename T, typename FinalCallback>
+class FilterInPlaceFinalCallback {
+public:
+  FilterInPlaceFinalCallback(std::vector<T> &data, const FinalCallback &final_callback,
+      FilterSelection &&selection, bool invert)
+    : data_(data),
+      final_callback_(final_callback),
+      selection_(std::move(selection)),
+      invert_(invert) {}
+
+  void operator()(ErrorCode error) {
+    size_t kept = 0;
+    selection_.for_each(invert_, [this, &kept](size_t index) {
+          if (index != kept) {
+            data_[kept] = std::move(data_[index]);
+          }
+          kept++;
+        });
+    data_.erase(data_.begin() + kept, data_.end());
+
+    final_callback_(data_);
+  }
+
+private:
+  std::vector<T> &data_;
+  typename std::decay<FinalCallback>::type final_callback_;
+  FilterSelection selection_;
+  bool invert_;
+};
+
+// Runs `test` over `data`, recording verdicts in `selected`, which `final_callback` owns.
+template<typename T, typename Test, typename FinalCallback>
+void run_filter(std::vector<T> &data, Test &&test, unsigned int task_limit, uint64_t *selected,
+    FinalCallback &&final_callback) {
 
   sequencer<T>
-      (data.begin(), data.end(), 0, wrapped_callback, wrapped_final_callback);
+      (data.begin(), data.end(), task_limit,
+          FilterItemCallback<T, Test>(std::move(test), selected),
+          std::move(final_callback));
+}
+
+template<typename T, typename Test, typename FinalCallback>
+void filter_copy(std::vector<T> &data, Test &&test, const FinalCallback &final_callback,
+    unsigned int task_limit, bool invert) {
+
+  FilterSelection selection(data.size());
+  uint64_t *selected = selection.words();
+  run_filter(data, std::move(test), task_limit, selected,
+      FilterFinalCallback<T, FinalCallback>(data, final_callback, std::move(selection), invert));
+}
+
+template<typename T, typename Test, typename FinalCallback>
+void filter_move(std::vector<T> &&data, Test &&test, const FinalCallback &final_callback,
+    unsigned int task_limit, bool invert) {
+
+  typedef FilterFinalCallback<T, FinalCallback, T&&> MoveFinalCallback;
+  std::vector<T>* items = new std::vector<T>(std::move(data));
+  FilterSelection selection(items->size());
+  uint64_t *selected = selection.words();
+  run_filter(*items, std::move(test), task_limit, selected,
+      OwnedItemsFinalCallback<T, MoveFinalCallback>(
+          MoveFinalCallback(*items, final_callback, std::move(selection), invert), items));
+}
+
+template<typename T, typename Test, typename FinalCallback>
+void filter_in_place(std::vector<T> &data, Test &&test, const FinalCallback &final_callback,
+    unsigned int task_limit, bool invert) {
+
+  FilterSelection selection(data.size());
+  uint64_t *selected = selection.words();
+  run_filter(data, std::move(test), task_limit, selected,
+      FilterInPlaceFinalCallback<T, FinalCallback>(
+          data, final_callback, std::move(selection), invert));
+}
+
+}
+
+// `test` and `final_callback` may be any callable.  `test` is invoked as
+// `test(item, callback)`, with the item by reference; nothing is heap-allocated per item.
+// The items kept are copied into the results, since `data` is left as it was.
+//
+// `task_limit` - the max number of tests outstanding at once; 0 for no limit.
+template <typename T, typename Test, typename FinalCallback=FilterCompletionCallback<T>>
+void filter(std::vector<T> &data,
+    Test test,
+    const FinalCallback &final_callback=noop_filter_final_callback<T>,
+    unsigned int task_limit=0) {
+
+  detail::filter_copy(data, std::move(test), final_callback, task_limit, false);
+}
+
+// The old form of `async::filter`, whose fourth argument was `invert`: `true` makes it
+// `async::reject`.  Only a `bool` binds here, so a limit is never taken for `invert`, nor
+// `invert` for a limit.  Prefer `async::reject`.
+template <typename T, typename Test, typename FinalCallback, typename Bool,
+    typename = typename std::enable_if<std::is_same<Bool, bool>::value>::type>
+void filter(std::vector<T> &data,
+    Test test,
+    const FinalCallback &final_callback,
+    Bool invert) {
+
+  detail::filter_copy(data, std::move(test), final_callback, 0, invert);
+}
+
+// Same as `async::filter`, except that the sequence takes `data` over, so the items kept
+// are moved into the results rather than copied.
+template <typename T, typename Test, typename FinalCallback=FilterCompletionCallback<T>>
+void filter(std::vector<T> &&data,
+    Test test,
+    const FinalCallback &final_callback=noop_filter_final_callback<T>,
+    unsigned int task_limit=0) {
+
+  detail::filter_move(std::move(data), std::move(test), final_callback, task_limit, false);
 }
 
-template <typename T>
+// Same as `async::filter`, except that the items rejected are erased from `data` itself,
+// and `final_callback` is handed `data`.  Nothing is copied, and no second vector is
+// built.  `data` must not be touched until `final_callback` has been invoked.
+template <typename T, typename Test, typename FinalCallback=FilterCompletionCallback<T>>
+void filter_in_place(std::vector<T> &data,
+    Test test,
+    const FinalCallback &final_callback=noop_filter_final_callback<T>,
+    unsigned int task_limit=0) {
+
+  detail::filter_in_place(data, std::move(test), final_callback, task_limit, false);
+}
+
+template <typename T, typename Test, typename FinalCallback=FilterCompletionCallback<T>>
 void reject(std::vector<T> &data,
-    const std::function<void(T, BoolCallback)> &test,
-    const std::function<void(std::vector<T> &results)> &final_callback=noop_filter_final_callback) {
+    Test test,
+    const FinalCallback &final_callback=noop_filter_final_callback<T>,
+    unsigned int task_limit=0) {
+
+  detail::filter_copy(data, std::move(test), final_callback, task_limit, true);
+}
+
+template <typename T, typename Test, typename FinalCallback=FilterCompletionCallback<T>>
+void reject(std::vector<T> &&data,
+    Test test,
+    const FinalCallback &final_callback=noop_filter_final_callback<T>,
+    unsigned int task_limit=0) {
+
+  detail::filter_move(std::move(data), std::move(test), final_callback, task_limit, true);
+}
+
+template <typename T, typename Test, typename FinalCallback=FilterCompletionCallback<T>>
+void reject_in_place(std::vector<T> &data,
+    Test test,
+    const FinalCallback &final_callback=noop_filter_final_callback<T>,
+    unsigned int task_limit=0) {
 
-  filter(data, test, final_callback, true);
+  detail::filter_in_place(data, std::move(test), final_callback, task_limit, true);
 }
 
 }
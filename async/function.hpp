@@ -0,0 +1,354 @@
+#pragma once
+
+#ifndef ASYNC_FUNCTION_HPP
+#define ASYNC_FUNCTION_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// The default inline buffer of async::function, in bytes.  Callables up to this size
+// are stored in place; larger ones are allocated.
+#ifndef ASYNC_FUNCTION_INLINE_SIZE
+#define ASYNC_FUNCTION_INLINE_SIZE (6 * sizeof(void*))
+#endif
+
+namespace async {
+
+template<typename Signature, size_t InlineSize=ASYNC_FUNCTION_INLINE_SIZE>
+class function;
+
+namespace detail {
+
+// Whether `F` can be invoked with `Args...`, returning something convertible to `R`.
+template<typename F, typename R, typename... Args>
+struct callable_as_test {
+  template<typename G>
+  static auto test(int) -> decltype(
+      std::declval<G&>()(std::declval<Args>()...), std::true_type());
+
+  template<typename G>
+  static std::false_type test(...);
+
+  template<typename G>
+  static auto returns(int) -> typename std::is_convertible<
+      decltype(std::declval<G&>()(std::declval<Args>()...)), R>::type;
+
+  template<typename G>
+  static std::false_type returns(...);
+
+  typedef typename std::conditional<std::is_void<R>::value,
+      decltype(test<F>(0)), decltype(returns<F>(0))>::type type;
+};
+
+template<typename F, typename R, typename... Args>
+struct callable_as : callable_as_test<F, R, Args...>::type {};
+
+// What a function does with the callable it holds, for one type of callable.
+template<typename R, typename... Args>
+struct FunctionOps {
+  R (*invoke)(void *storage, Args&&... args);
+  // Moves the callable from one storage to another, and destroys the original.
+  void (*move)(void *to, void *from);
+  // Null if the callable can't be copied.
+  void (*copy)(void *to, const void *from);
+  void (*destroy)(void *storage);
+};
+
+// A callable which fits is kept in the function's buffer.
+template<typename F, typename R, typename... Args>
+struct InlineFunctionOps {
+  static F &get(void *storage) {
+    return *static_cast<F*>(storage);
+  }
+
+  static R invoke(void *storage, Args&&... args) {
+    return get(storage)(std::forward<Args>(args)...);
+  }
+
+  static void move(void *to, void *from) {
+    new (to) F(std::move(get(from)));
+    get(from).~F();
+  }
+
+  static void copy(void *to, const void *from) {
+    new (to) F(*static_cast<const F*>(from));
+  }
+
+  static void destroy(void *storage) {
+    get(storage).~F();
+  }
+
+  static const FunctionOps<R, Args...> *ops() {
+    static const FunctionOps<R, Args...> ops = {
+      &invoke, &move, copy_if(std::is_copy_constructible<F>()), &destroy
+    };
+    return &ops;
+  }
+
+  static void (*copy_if(std::true_type))(void*, const void*) {
+    return &copy;
+  }
+
+  static void (*copy_if(std::false_type))(void*, const void*) {
+    return nullptr;
+  }
+};
+
+// Any other is allocated, and the buffer holds a pointer to it.
+template<typename F, typename R, typename... Args>
+struct HeapFunctionOps {
+  static F *&get(void *storage) {
+    return *static_cast<F**>(storage);
+  }
+
+  static R invoke(void *storage, Args&&... args) {
+    return (*get(storage))(std::forward<Args>(args)...);
+  }
+
+  static void move(void *to, void *from) {
+    new (to) F*(get(from));
+  }
+
+  static void copy(void *to, const void *from) {
+    new (to) F*(new F(**static_cast<F* const*>(from)));
+  }
+
+  static void destroy(void *storage) {
+    delete get(storage);
+  }
+
+  static const FunctionOps<R, Args...> *ops() {
+    static const FunctionOps<R, Args...> ops = {
+      &invoke, &move, copy_if(std::is_copy_constructible<F>()), &destroy
+    };
+    return &ops;
+  }
+
+  static void (*copy_if(std::true_type))(void*, const void*) {
+    return &copy;
+  }
+
+  static void (*copy_if(std::false_type))(void*, const void*) {
+    return nullptr;
+  }
+};
+
+// Null function pointers and empty function wrappers make an empty function, as they
+// do a std::function.
+template<typename F>
+bool is_null_callable(const F &f) {
+  return false;
+}
+
+template<typename F>
+bool is_null_callable(F *f) {
+  return f == nullptr;
+}
+
+template<typename C, typename M>
+bool is_null_callable(M C::*f) {
+  return f == nullptr;
+}
+
+template<typename Signature>
+bool is_null_callable(const std::function<Signature> &f) {
+  return !f;
+}
+
+template<typename Signature, size_t InlineSize>
+bool is_null_callable(const function<Signature, InlineSize> &f) {
+  return !f;
+}
+
+}
+
+/**
+   A drop-in for std::function, which keeps callables of up to `InlineSize` bytes in
+   place, and which may hold callables which can only be moved, such as a lambda which
+   captures a std::unique_ptr or a socket.
+
+   std::function keeps only very small callables in place: two pointers, in libstdc++
+   and libc++.  A task callback wrapped for cancellation, or for Metrics, or a lambda
+   which captures a callback and a value, is larger, and allocates each time it is made.
+   With the default buffer of six pointers, they don't.
+
+   Copying a function copies its callable, so copying one which holds a move-only
+   callable aborts the program; move it instead.  Calling an empty function is an error
+   too.  It is otherwise used as a std::function is:
+
+     async::function<void(async::ErrorCode)> callback = ReadInto { std::move(buffer) };
+     async::function<void(), 64> handler = ...;
+
+   Define ASYNC_USE_ASYNC_FUNCTION to make the library's callback types, TaskCallback<T>,
+   Task<T>, ErrorCodeCallback and the rest, async::functions; see async.hpp.
+ */
+template<typename R, typename... Args, size_t InlineSize>
+class function<R(Args...), InlineSize> {
+  static_assert(InlineSize >= sizeof(void*), "the inline buffer must hold a pointer");
+
+  typedef typename std::aligned_storage<InlineSize,
+      std::alignment_of<std::max_align_t>::value>::type Storage;
+
+  typedef detail::FunctionOps<R, Args...> Ops;
+
+public:
+  typedef R result_type;
+
+  function() : ops_(nullptr) {}
+
+  function(std::nullptr_t) : ops_(nullptr) {}
+
+  template<typename F, typename = typename std::enable_if<
+      !std::is_same<typename std::decay<F>::type, function>::value &&
+      detail::callable_as<typename std::decay<F>::type, R, Args...>::value>::type>
+  function(F &&f) : ops_(nullptr) {
+    typedef typename std::decay<F>::type Callable;
+    if (detail::is_null_callable(f)) {
+      return;
+    }
+    assign<Callable>(std::forward<F>(f),
+        std::integral_constant<bool, fits_inline<Callable>::value>());
+  }
+
+  function(const function &other) : ops_(nullptr) {
+    copy_from(other);
+  }
+
+  function(function &&other) : ops_(nullptr) {
+    move_from(other);
+  }
+
+  ~function() {
+    reset();
+  }
+
+  function& operator=(const function &other) {
+    if (this != &other) {
+      function copy(other);
+      reset();
+      move_from(copy);
+    }
+    return *this;
+  }
+
+  function& operator=(function &&other) {
+    if (this != &other) {
+      reset();
+      move_from(other);
+    }
+    return *this;
+  }
+
+  function& operator=(std::nullptr_t) {
+    reset();
+    return *this;
+  }
+
+  template<typename F, typename = typename std::enable_if<
+      !std::is_same<typename std::decay<F>::type, function>::value &&
+      detail::callable_as<typename std::decay<F>::type, R, Args...>::value>::type>
+  function& operator=(F &&f) {
+    function replacement(std::forward<F>(f));
+    reset();
+    move_from(replacement);
+    return *this;
+  }
+
+  R operator()(Args... args) const {
+    assert(ops_ && "async::function: called while empty");
+    return ops_->invoke(storage(), std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const {
+    return ops_ != nullptr;
+  }
+
+  void swap(function &other) {
+    function temp(std::move(other));
+    other = std::move(*this);
+    *this = std::move(temp);
+  }
+
+  // Whether callables of type `F` are kept in place, without allocating.
+  template<typename F>
+  struct fits_inline : std::integral_constant<bool,
+      sizeof(F) <= InlineSize &&
+      std::alignment_of<F>::value <= std::alignment_of<Storage>::value &&
+      std::is_nothrow_move_constructible<F>::value> {};
+
+private:
+  template<typename Callable, typename F>
+  void assign(F &&f, std::true_type fits) {
+    new (storage()) Callable(std::forward<F>(f));
+    ops_ = detail::InlineFunctionOps<Callable, R, Args...>::ops();
+  }
+
+  template<typename Callable, typename F>
+  void assign(F &&f, std::false_type fits) {
+    new (storage()) Callable*(new Callable(std::forward<F>(f)));
+    ops_ = detail::HeapFunctionOps<Callable, R, Args...>::ops();
+  }
+
+  void copy_from(const function &other) {
+    if (!other.ops_) {
+      return;
+    }
+    if (!other.ops_->copy) {
+      // A move-only callable: there's no copy to make, and no sound function to return.
+      std::abort();
+    }
+    other.ops_->copy(storage(), other.storage());
+    ops_ = other.ops_;
+  }
+
+  void move_from(function &other) {
+    if (other.ops_) {
+      other.ops_->move(storage(), other.storage());
+      ops_ = other.ops_;
+      other.ops_ = nullptr;
+    }
+  }
+
+  void reset() {
+    if (ops_) {
+      ops_->destroy(storage());
+      ops_ = nullptr;
+    }
+  }
+
+  void *storage() const {
+    return const_cast<Storage*>(&storage_);
+  }
+
+  Storage storage_;
+  const Ops *ops_;
+};
+
+template<typename Signature, size_t InlineSize>
+bool operator==(const function<Signature, InlineSize> &f, std::nullptr_t) {
+  return !f;
+}
+
+template<typename Signature, size_t InlineSize>
+bool operator==(std::nullptr_t, const function<Signature, InlineSize> &f) {
+  return !f;
+}
+
+template<typename Signature, size_t InlineSize>
+bool operator!=(const function<Signature, InlineSize> &f, std::nullptr_t) {
+  return static_cast<bool>(f);
+}
+
+template<typename Signature, size_t InlineSize>
+bool operator!=(std::nullptr_t, const function<Signature, InlineSize> &f) {
+  return static_cast<bool>(f);
+}
+
+}
+
+#endif
@@ -0,0 +1,328 @@
+#pragma once
+
+#ifndef ASYNC_HEDGE_HPP
+#define ASYNC_HEDGE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "async.hpp"
+#include "timing_wheel.hpp"
+
+namespace async {
+
+namespace detail {
+template<typename T, typename TTask, typename Callback>
+class HedgeState;
+}
+
+/**
+   When `async::hedge` sends a second copy of a task, and how many it may send.
+
+     async::Hedging hedging(wheel, std::chrono::milliseconds(20));  // after 20ms
+     async::Hedging hedging(wheel, 0.95, std::chrono::milliseconds(20));  // after the p95
+
+   With a fixed delay, a task which hasn't finished after `delay` gets a second copy.
+   With a percentile, the delay is that percentile of the latencies of the last 128
+   copies to succeed, recomputed every 16, and `initial_delay` until there are 16.
+
+   `max_ratio` caps the hedges at that fraction of the tasks started, so that when a
+   dependency slows down for everyone, hedging doesn't double the load on it.
+
+   One Hedging is meant to be kept for the life of a dependency, and shared by every task
+   which calls it, so that its latencies and budget cover them all.  It is not
+   thread-safe: invoke its tasks from the thread running the wheel's io_service.
+ */
+class Hedging {
+public:
+  typedef TimingWheel::Clock Clock;
+  typedef Clock::duration Duration;
+
+  Hedging(TimingWheel &wheel, Duration delay, double max_ratio=0.1)
+    : wheel_(&wheel), percentile_(0), delay_(delay), max_ratio_(max_ratio) {}
+
+  Hedging(TimingWheel &wheel, double percentile, Duration initial_delay,
+      double max_ratio=0.1)
+    : wheel_(&wheel), percentile_(percentile), delay_(initial_delay), max_ratio_(max_ratio) {
+    samples_.reserve(kSamples);
+    sorted_.reserve(kSamples);
+  }
+
+  Hedging(const Hedging&) = delete;
+  Hedging& operator=(const Hedging&) = delete;
+
+  // How long a task may run before it is hedged.
+  Duration delay() const {
+    return delay_;
+  }
+
+  // The tasks started.
+  unsigned long requests() const {
+    return requests_;
+  }
+
+  // The second copies sent.
+  unsigned long hedges_launched() const {
+    return hedges_launched_;
+  }
+
+  // The second copies which finished first.
+  unsigned long hedges_won() const {
+    return hedges_won_;
+  }
+
+private:
+  template<typename T, typename TTask, typename Callback>
+  friend class detail::HedgeState;
+
+  static const size_t kSamples = 128;
+  static const size_t kRecomputeEvery = 16;
+
+  TimingWheel &wheel() const {
+    return *wheel_;
+  }
+
+  void request_started() {
+    requests_++;
+  }
+
+  // Counts a hedge, if the budget has room for it.
+  bool take_hedge() {
+    if (hedges_launched_ + 1 > max_ratio_ * requests_) {
+      return false;
+    }
+    hedges_launched_++;
+    return true;
+  }
+
+  void hedge_won() {
+    hedges_won_++;
+  }
+
+  void record(Duration latency) {
+    if (percentile_ == 0) {
+      return;
+    }
+
+    if (samples_.size() < kSamples) {
+      samples_.push_back(latency);
+    } else {
+      samples_[next_sample_ % kSamples] = latency;
+    }
+    if (++next_sample_ % kRecomputeEvery == 0) {
+      sorted_.assign(samples_.begin(), samples_.end());
+      size_t index = std::min(size_t(percentile_ * sorted_.size()), sorted_.size() - 1);
+      std::nth_element(sorted_.begin(), sorted_.begin() + index, sorted_.end());
+      delay_ = sorted_[index];
+    }
+  }
+
+  TimingWheel *wheel_;
+  double percentile_;
+  Duration delay_;
+  double max_ratio_;
+  unsigned long requests_ = 0;
+  unsigned long hedges_launched_ = 0;
+  unsigned long hedges_won_ = 0;
+  std::vector<Duration> samples_;
+  std::vector<Duration> sorted_;
+  size_t next_sample_ = 0;
+};
+
+namespace detail {
+
+// The callback handed to one copy of a hedged task: the state, and which copy this is.
+// Two words wide, so it fits in the small-object buffer of TaskCallback<T>.
+template<typename T, typename TTask, typename Callback>
+class HedgeCopyCallback {
+public:
+  HedgeCopyCallback(HedgeState<T, TTask, Callback> *state, int copy)
+    : state_(state), copy_(copy) {}
+
+  void operator()(ErrorCode error, T result) const {
+    state_->copy_done(copy_, error, std::move(result));
+  }
+
+private:
+  HedgeState<T, TTask, Callback> *state_;
+  int copy_;
+};
+
+/**
+   One invocation of a hedged task.  It starts the primary copy, and arms a timer for the
+   hedge.  The first copy to succeed wins, and its result is handed to `callback`; if
+   every copy sent fails, the last failure is.  Tasks which accept a CancellationToken
+   get a token per copy, and the loser's is cancelled as soon as the winner reports back;
+   other tasks' losers are ignored.  The state deletes itself once every copy sent has
+   reported back.
+ */
+template<typename T, typename TTask, typename Callback>
+class HedgeState {
+public:
+  typedef accepts_cancellation_token<TTask, TaskCallback<T>&> task_accepts_token;
+
+  HedgeState(Hedging *hedging, const std::shared_ptr<TTask> &task, Callback &&callback,
+      const CancellationToken &token)
+    : hedging_(hedging), task_(task), callback_(std::move(callback)), token_(token) {}
+
+  void start() {
+    // Hold the state until we return, in case the primary finishes synchronously.
+    holds_++;
+    hedging_->request_started();
+    launch(0);
+    if (!done_) {
+      timer_ = hedging_->wheel().schedule(hedging_->delay(), [this]() {
+            timer_armed_ = false;
+            if (!done_ && !token_.is_cancelled() && hedging_->take_hedge()) {
+              launch(1);
+            }
+          });
+      timer_armed_ = true;
+      registration_ = token_.on_cancel([this]() {
+            // A copy may report back from its own cancel handler, before the loop ends.
+            holds_++;
+            disarm();
+            cancel_copies();
+            holds_--;
+            release_if_idle();
+          });
+    }
+    holds_--;
+    release_if_idle();
+  }
+
+  void copy_done(int copy, ErrorCode error, T result) {
+    in_flight_--;
+    if (error == OK) {
+      hedging_->record(Hedging::Clock::now() - started_[copy]);
+    }
+
+    // A failure is reported only once no other copy might yet succeed.
+    if (!done_ && (error == OK || in_flight_ == 0)) {
+      done_ = true;
+      disarm();
+      registration_.reset();
+      // The loser may report back from its cancel handler, while we still need the state.
+      holds_++;
+      if (error == OK) {
+        if (copy == 1) {
+          hedging_->hedge_won();
+        }
+        cancel_copies(copy);
+      }
+      callback_(error, std::move(result));
+      holds_--;
+    }
+
+    release_if_idle();
+  }
+
+private:
+  void launch(int copy) {
+    in_flight_++;
+    started_[copy] = Hedging::Clock::now();
+    TaskCallback<T> callback(HedgeCopyCallback<T, TTask, Callback>(this, copy));
+    invoke(task_accepts_token(), copy, callback);
+  }
+
+  void invoke(std::false_type accepts_token, int copy, TaskCallback<T> &callback) {
+    (*task_)(callback);
+  }
+
+  void invoke(std::true_type accepts_token, int copy, TaskCallback<T> &callback) {
+    sources_[copy].reset(new CancellationSource());
+    (*task_)(callback, sources_[copy]->token());
+  }
+
+  void disarm() {
+    if (timer_armed_) {
+      hedging_->wheel().cancel(timer_);
+      timer_armed_ = false;
+    }
+  }
+
+  // Cancels the tokens of the copies sent, but for the winner's, if any.
+  void cancel_copies(int winner=-1) {
+    for (int copy = 0; copy < 2; copy++) {
+      if (copy != winner && sources_[copy]) {
+        sources_[copy]->cancel(CANCELLED);
+      }
+    }
+  }
+
+  void release_if_idle() {
+    if (done_ && in_flight_ == 0 && holds_ == 0) {
+      delete this;
+    }
+  }
+
+  Hedging *hedging_;
+  std::shared_ptr<TTask> task_;
+  Callback callback_;
+  CancellationToken token_;
+  CancellationRegistration registration_;
+  TimerHandle timer_;
+  bool timer_armed_ = false;
+  bool done_ = false;
+  // While non-zero, the state is in use further up the stack, and isn't deleted.
+  unsigned int holds_ = 0;
+  unsigned int in_flight_ = 0;
+  Hedging::Clock::time_point started_[2];
+  std::unique_ptr<CancellationSource> sources_[2];
+};
+
+// A task which hedges another.  Its copies share the task.
+template<typename T, typename TTask>
+class HedgeTask {
+public:
+  HedgeTask(Hedging &hedging, TTask &&task)
+    : hedging_(&hedging), task_(std::make_shared<TTask>(std::move(task))) {}
+
+  template<typename Callback>
+  void operator()(Callback &&callback) const {
+    start(std::forward<Callback>(callback), CancellationToken());
+  }
+
+  template<typename Callback>
+  void operator()(Callback &&callback, CancellationToken token) const {
+    start(std::forward<Callback>(callback), token);
+  }
+
+private:
+  template<typename Callback>
+  void start(Callback &&callback, const CancellationToken &token) const {
+    typedef typename std::decay<Callback>::type StoredCallback;
+    auto state = new HedgeState<T, TTask, StoredCallback>(
+        hedging_, task_, StoredCallback(std::forward<Callback>(callback)), token);
+    state->start();
+  }
+
+  Hedging *hedging_;
+  std::shared_ptr<TTask> task_;
+};
+
+}
+
+// Wraps `task`, so that if it hasn't finished after `hedging`'s delay, a second copy is
+// started, and whichever succeeds first wins.  For trimming the tail latency of fan-outs
+// through `parallel`, where the slowest of many calls sets the pace.  Only hedge tasks
+// which are safe to run twice.
+//
+// `task` may be a Task<T>, a CancellableTask<T>, or any callable invoked as
+// `task(callback)` or `task(callback, token)`.  The wrapper may be stored as a Task<T>
+// or a CancellableTask<T>; given a token, its cancellation stops the hedge being sent
+// and is passed on to the copies in flight.  Each invocation allocates its own state.
+template<typename T, typename TTask>
+detail::HedgeTask<T, typename std::decay<TTask>::type> hedge(Hedging &hedging,
+    TTask &&task) {
+  return detail::HedgeTask<T, typename std::decay<TTask>::type>(hedging,
+      typename std::decay<TTask>::type(std::forward<TTask>(task)));
+}
+
+}
+
+#endif
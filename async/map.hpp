@@ -3,47 +3,175 @@
 #ifndef ASYNC_MAP_HPP
 #define ASYNC_MAP_HPP
 
+#include <memory>
+#include <type_traits>
+
+#include "concurrent_sequencer.hpp"
+#include "executor.hpp"
 #include "sequencer.hpp"
 
 namespace async {
 
 template<typename T>
-using MapCallback = std::function<void(T, TaskCallback<T>)>;
+using MapCallback = CallbackFunction<void(T, TaskCallback<T>)>;
 
-// TODO: Make versions that take reference and also another with by-value callbacks, to
-// support lambda decls inline in function calls.
-// Note that by-value capture of a vec needs to be retained for async calls.
-// TODO: Fix comment below once ref vs by-val is resolved.
+namespace detail {
 
-// `data and `final_callback` are passed by reference.  It is the
-// responsibility of the caller to ensure that their lifetime exceeds the lifetime of the
-// series call.
-template<typename T>
+// The callback handed to `func` for one item.  It writes the result straight into the
+// item's slot in the results vector.  It is two pointers wide, so it fits in the
+// small-object buffer of TaskCallback<T>.
+template<typename T, typename CallbackDone>
+class MapTaskCallback {
+public:
+  MapTaskCallback(CallbackDone callback_done, T *slot)
+    : callback_done_(callback_done), slot_(slot) {}
+
+  void operator()(ErrorCode error, T result) const {
+    *slot_ = std::move(result);
+    callback_done_(error == OK, error);
+  }
+
+private:
+  CallbackDone callback_done_;
+  T *slot_;
+};
+
+// `Item` is how each item is handed to `func`: as `T&`, or as `T&&` when the sequence owns
+// `data`, so that `func` can move it.
+template<typename T, typename Func, typename Item=T&>
+class MapItemCallback {
+public:
+  static const bool accepts_token =
+      accepts_cancellation_token<Func, Item, TaskCallback<T>>::value;
+
+  MapItemCallback(Func &&func, std::vector<T> *results)
+    : func_(std::move(func)), results_(results) {}
+
+  template<typename CallbackDone>
+  void operator()(T &object, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_item(func_, MapTaskCallback<T, CallbackDone>(callback_done, &(*results_)[index]),
+        callback_done, index, static_cast<Item>(object));
+  }
+
+private:
+  Func func_;
+  std::vector<T> *results_;
+};
+
+// Owns the results.  They are freed along with the sequencer state, once the last item
+// has reported back, since items still in flight after a stop may yet write to them.
+template<typename T, typename FinalCallback>
+class MapFinalCallback {
+public:
+  MapFinalCallback(const FinalCallback &final_callback, std::vector<T> *results)
+    : final_callback_(final_callback), results_(results) {}
+
+  void operator()(ErrorCode error) {
+    final_callback_(error, *results_);
+  }
+
+private:
+  typename std::decay<FinalCallback>::type final_callback_;
+  std::unique_ptr<std::vector<T>> results_;
+};
+
+}
+
+// `data` is passed by reference.  It is the responsibility of the caller to ensure that
+// it outlives the call, until `final_callback` has been invoked; pass it with std::move
+// to hand it over instead.  `final_callback` is copied.
+//
+// `func` and `final_callback` may be any callable.  `func` is invoked as
+// `func(item, task_callback)`; if it accepts the callback generically (rather than as a
+// TaskCallback<T>) no per-item std::function is created.  Either way, nothing is
+// heap-allocated per item.
+//
+// Items are handed to `func` by reference, so `func` may take `const T&` to avoid copying
+// them.  Results passed as `task_callback(OK, std::move(result))` are moved, not copied,
+// into the results vector, and `final_callback` may move them out again, so move-only
+// types such as std::unique_ptr work.
+//
+// If `func` also accepts a CancellationToken, as `func(item, task_callback, token)`, the
+// token is cancelled when another item fails, or when `token` is cancelled; see
+// cancellation.hpp.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
+void map(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  std::vector<T>* results = new std::vector<T>(data.size());
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::MapItemCallback<T, Func>(std::move(func), results),
+          detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+          token);
+}
+
+// Same as `async::map`, except that the sequence takes `data` over, and each item is
+// handed to `func` as an rvalue, so `func` may take `T` or `T&&` and move from it.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
+void map(std::vector<T> &&data,
+    Func func,
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  std::vector<T>* items = new std::vector<T>(std::move(data));
+  std::vector<T>* results = new std::vector<T>(items->size());
+
+  typedef detail::MapFinalCallback<T, FinalCallback> MapFinalCallback;
+  sequencer<T>
+      (items->begin(), items->end(), task_limit,
+          detail::MapItemCallback<T, Func, T&&>(std::move(func), results),
+          detail::OwnedItemsFinalCallback<T, MapFinalCallback>(
+              MapFinalCallback(final_callback, results), items),
+          token);
+}
+
+namespace concurrent {
+
+// Same as `async::map`, except that `func` may complete items on any thread, concurrently.
+// `final_callback` is invoked on whichever thread completes the last item.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
 void map(std::vector<T> &data,
-    MapCallback<T> func,
-    const TaskCompletionCallback<T> &final_callback=noop_task_final_callback<T>,
-    unsigned int task_limit=0) {
+    Func func,
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
 
   std::vector<T>* results = new std::vector<T>(data.size());
 
-  auto callback = [results, func](T object, int index, bool is_last_time,
-      std::function<void(bool, ErrorCode)> callback_done) {
+  concurrent::sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::MapItemCallback<T, Func>(std::move(func), results),
+          detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+          token);
+}
 
-    TaskCallback<T> task_callback = [callback_done, results, index](ErrorCode error, T result) {
-      (*results)[index] = result;
-      callback_done(error == OK, error);
-    };
+}
 
-    func(object, task_callback);
-  };
+// Same as `async::map`, except that `func` is posted onto `executor` for each item, so
+// CPU-heavy functions can run on a thread pool.  `func` may be invoked on several threads
+// at once; `final_callback` is invoked on whichever thread completes the last item.
+template<typename T, typename Executor, typename Func,
+    typename FinalCallback=TaskCompletionCallback<T>>
+void map(Executor &executor,
+    std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
 
-  auto wrapped_final_callback = [results, final_callback](ErrorCode error) {
-    final_callback(error, *results);
-    delete results;
-  };
+  std::vector<T>* results = new std::vector<T>(data.size());
 
   sequencer<T>
-      (data.begin(), data.end(), task_limit, callback, wrapped_final_callback);
+      (executor, data.begin(), data.end(), task_limit,
+          detail::MapItemCallback<T, Func>(std::move(func), results),
+          detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+          token);
 }
 
 }
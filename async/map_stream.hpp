@@ -0,0 +1,171 @@
+#pragma once
+
+#ifndef ASYNC_MAP_STREAM_HPP
+#define ASYNC_MAP_STREAM_HPP
+
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "sequencer.hpp"
+
+namespace async {
+
+namespace detail {
+
+// The callback handed to `func` for one item.  The stream is found through the
+// sequencer's state, so it is two words wide, and fits in the small-object buffer of
+// TaskCallback<T>.
+template<typename T, typename CallbackDone>
+class MapStreamTaskCallback {
+public:
+  MapStreamTaskCallback(CallbackDone callback_done, unsigned int index)
+    : callback_done_(callback_done), index_(index) {}
+
+  void operator()(ErrorCode error, T result) const {
+    callback_done_.callback().item_done(index_, error, std::move(result), callback_done_);
+  }
+
+private:
+  CallbackDone callback_done_;
+  unsigned int index_;
+};
+
+/**
+   Hands each result to `on_result` as it arrives.
+
+   Unordered, a result is emitted as soon as its item completes, and nothing is kept.
+
+   Ordered, a result which arrives before its predecessors waits in a ring buffer of
+   `window` slots.  The item doesn't report back to the sequencer until its result has
+   been emitted, so the items in flight and the results waiting together never exceed
+   the sequencer's limit, which is at most `window`: every waiting result has a slot, and
+   the sequencer stops spawning while the oldest result is outstanding.
+
+   All items' `callback_done` refer to the same sequencer state, so a completion which
+   emits its successors' waiting results reports back for them too.  That holds for the
+   plain sequencer's `callback_done`, which carries nothing of its item's own, so
+   map_stream only runs on the plain sequencer: it has no Metrics, Trace, Timeouts or
+   executor forms, whose `callback_done` would each need to report back for themselves.
+ */
+template<typename T, typename Func, typename OnResult>
+class MapStreamItemCallback {
+public:
+  static const bool accepts_token =
+      accepts_cancellation_token<Func, T&, TaskCallback<T>>::value;
+
+  MapStreamItemCallback(Func &&func, OnResult &&on_result, unsigned int window)
+    : func_(std::move(func)),
+      on_result_(std::move(on_result)),
+      window_(window),
+      slots_(window),
+      ready_(window, 0) {}
+
+  template<typename CallbackDone>
+  void operator()(T &object, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_item(func_,
+        MapStreamTaskCallback<T, CallbackDone>(callback_done, index),
+        callback_done, index, object);
+  }
+
+  template<typename CallbackDone>
+  void item_done(unsigned int index, ErrorCode error, T &&result, CallbackDone callback_done) {
+    const std::shared_ptr<CancellationState> &cancellation = callback_done.cancellation();
+    if (error != OK || stopped_ || (cancellation && cancellation->is_cancelled())) {
+      fail(error, callback_done);
+      return;
+    }
+
+    if (window_ == 0) {
+      on_result_(index, std::move(result));
+      callback_done(true, OK);
+      return;
+    }
+
+    unsigned int slot = index % window_;
+    slots_[slot] = std::move(result);
+    ready_[slot] = 1;
+
+    unsigned int emitted = 0;
+    for (;;) {
+      slot = next_index_ % window_;
+      if (!ready_[slot]) {
+        break;
+      }
+      ready_[slot] = 0;
+      on_result_(next_index_, std::move(slots_[slot]));
+      next_index_++;
+      emitted++;
+    }
+
+    // Report back only once done with our members: the last report may finish the
+    // sequence and release the state which owns them.
+    for (; emitted > 0; emitted--) {
+      callback_done(true, OK);
+    }
+  }
+
+private:
+  template<typename CallbackDone>
+  void fail(ErrorCode error, CallbackDone callback_done) {
+    // Waiting results will never be emitted; release their items too.
+    unsigned int waiting = 0;
+    if (!stopped_) {
+      stopped_ = true;
+      for (unsigned int i = 0; i < window_; i++) {
+        waiting += ready_[i];
+        ready_[i] = 0;
+      }
+    }
+
+    callback_done(false, error);
+    for (; waiting > 0; waiting--) {
+      callback_done(false, error);
+    }
+  }
+
+  Func func_;
+  OnResult on_result_;
+  unsigned int window_;
+  std::vector<T> slots_;
+  std::vector<unsigned char> ready_;
+  unsigned int next_index_ = 0;
+  bool stopped_ = false;
+};
+
+}
+
+// Same as `async::map`, except that results are not collected.  Instead, each is handed to
+// `on_result(index, value)` as it becomes available, and `final_callback(error)` is invoked
+// at the end.  So memory use doesn't grow with the size of `data`.
+//
+// `window` - if 0, results are emitted in the order that items complete.  Otherwise,
+//      they are emitted in the order of `data`: a result which arrives early waits until
+//      those before it have been emitted.  At most `window` items are in flight or
+//      waiting at once, so `window` also caps `task_limit`.
+//
+// Once an item fails, or the sequence is cancelled, no more results are emitted.
+template<typename T, typename Func, typename OnResult, typename FinalCallback=ErrorCodeCallback>
+void map_stream(std::vector<T> &data,
+    Func func,
+    OnResult on_result,
+    const FinalCallback &final_callback=noop_error_code_final_callback,
+    unsigned int task_limit=0,
+    unsigned int window=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  if (window != 0 && (task_limit == 0 || task_limit > window)) {
+    task_limit = window;
+  }
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::MapStreamItemCallback<T, Func, OnResult>(
+              std::move(func), std::move(on_result), window),
+          typename std::decay<FinalCallback>::type(final_callback),
+          token);
+}
+
+}
+
+#endif
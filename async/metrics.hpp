@@ -0,0 +1,426 @@
+#pragma once
+
+#ifndef ASYNC_METRICS_HPP
+#define ASYNC_METRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+#include "each.hpp"
+#include "map.hpp"
+#include "parallel.hpp"
+#include "sequencer.hpp"
+
+namespace async {
+
+namespace detail {
+class MetricsObserver;
+}
+
+/**
+   Latencies, counted into buckets in the manner of an HDR histogram: one per nanosecond
+   below 64ns, and 32 per doubling above that, so a latency read back is within 1/32
+   (about 3%) of those recorded into its bucket, at any scale.  Recording is two relaxed
+   atomic adds, so any number of threads may record at once, and read while they do.
+ */
+class LatencyHistogram {
+public:
+  typedef std::chrono::steady_clock::duration Duration;
+
+  LatencyHistogram() {
+    for (size_t i = 0; i < kBuckets; i++) {
+      counts_[i] = 0;
+    }
+  }
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  void record(Duration latency) {
+    long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        latency).count();
+    uint64_t value = nanoseconds < 0 ? 0 : uint64_t(nanoseconds);
+
+    counts_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max &&
+        !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+  }
+
+  unsigned long count() const {
+    return count_.load(std::memory_order_relaxed);
+  }
+
+  // To within the buckets' precision, as each latency is taken as its bucket's middle.
+  Duration mean() const {
+    double sum = 0;
+    uint64_t count = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+      uint64_t in_bucket = counts_[i].load(std::memory_order_relaxed);
+      sum += in_bucket * (lowest_in(i) + highest_in(i)) / 2.0;
+      count += in_bucket;
+    }
+    return count == 0 ? Duration::zero() : to_duration(uint64_t(sum / count));
+  }
+
+  Duration max() const {
+    return to_duration(max_.load(std::memory_order_relaxed));
+  }
+
+  // The latency which `fraction` of those recorded were within: 0.99 for the p99.
+  Duration percentile(double fraction) const {
+    uint64_t count = count_.load(std::memory_order_relaxed);
+    if (count == 0) {
+      return Duration::zero();
+    }
+
+    uint64_t rank = std::max(uint64_t(std::ceil(fraction * count)), uint64_t(1));
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        return to_duration(std::min(highest_in(i), max));
+      }
+    }
+    return to_duration(max);
+  }
+
+private:
+  static const unsigned int kSubBucketBits = 6;
+  static const uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits;
+  static const uint64_t kHalf = kSubBuckets / 2;
+  static const size_t kBuckets = (64 - kSubBucketBits + 1) * kHalf + kHalf;
+
+  // Below kSubBuckets, a bucket per value.  Above, a value whose top bit is bit `b`
+  // goes in one of kHalf buckets, by its kSubBucketBits bits from `b` down.
+  static size_t bucket(uint64_t value) {
+    if (value < kSubBuckets) {
+      return size_t(value);
+    }
+    unsigned int shift = 63 - __builtin_clzll(value) - kSubBucketBits + 1;
+    return size_t(shift * kHalf + (value >> shift));
+  }
+
+  static uint64_t lowest_in(size_t bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket;
+    }
+    unsigned int shift = unsigned(bucket / kHalf - 1);
+    return (bucket - shift * kHalf) << shift;
+  }
+
+  static uint64_t highest_in(size_t bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket;
+    }
+    unsigned int shift = unsigned(bucket / kHalf - 1);
+    return ((bucket - shift * kHalf + 1) << shift) - 1;
+  }
+
+  static Duration to_duration(uint64_t nanoseconds) {
+    return std::chrono::duration_cast<Duration>(std::chrono::nanoseconds(nanoseconds));
+  }
+
+  std::atomic<uint64_t> counts_[kBuckets];
+  std::atomic<uint64_t> count_ { 0 };
+  std::atomic<uint64_t> max_ { 0 };
+};
+
+/**
+   What the sequences started from one call site did: how many items they ran, how many
+   failed, how many were queued and in flight, and how long each item took.  Passed to
+   `map`, `each`, `parallel_limit` or `sequencer` after the usual arguments, as Timeouts
+   are:
+
+     async::map<int>(data, func, final_callback, 8, async::metrics("fetch_users"));
+
+   One Metrics is meant to be kept for the life of the process, and shared by every
+   sequence started from its call site; `async::metrics(name)` looks one up by name,
+   creating it the first time.  Every count is atomic, so a Metrics may be shared by
+   sequences on different threads, and read from any thread while they run.
+
+   Sequences started without one aren't watched: their hooks compile away.  Given one,
+   each item's `callback_done` carries the time it was spawned, so it is two words rather
+   than one, and the clock is read as each item is spawned and reports back.
+ */
+class Metrics {
+public:
+  typedef LatencyHistogram::Duration Duration;
+
+  explicit Metrics(const std::string &name) : name_(name) {}
+
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  const std::string &name() const {
+    return name_;
+  }
+
+  // The sequences started.
+  unsigned long sequences() const {
+    return sequences_.load(std::memory_order_relaxed);
+  }
+
+  // The sequences stopped early: by an item, by a failure, or by their token.
+  unsigned long sequences_stopped() const {
+    return sequences_stopped_.load(std::memory_order_relaxed);
+  }
+
+  // The items spawned.
+  unsigned long items() const {
+    return spawned_.load(std::memory_order_relaxed);
+  }
+
+  // The items which reported an error, but for STOP and CANCELLED.
+  unsigned long failures() const {
+    return failures_.load(std::memory_order_relaxed);
+  }
+
+  // The items handed to sequences which haven't yet been spawned.  Only counted for
+  // sequences over vectors, or other random-access iterators.
+  long queued() const {
+    long spawned = long(spawned_.load(std::memory_order_relaxed));
+    return std::max(accepted_.load(std::memory_order_relaxed) - spawned, 0l);
+  }
+
+  // The items spawned which haven't yet reported back.
+  long in_flight() const {
+    long done = long(latency_.count());
+    return std::max(long(spawned_.load(std::memory_order_relaxed)) - done, 0l);
+  }
+
+  long max_in_flight() const {
+    return max_in_flight_.load(std::memory_order_relaxed);
+  }
+
+  // From each item's spawn to its report.
+  const LatencyHistogram &latency() const {
+    return latency_;
+  }
+
+private:
+  friend class detail::MetricsObserver;
+
+  // The gauges are worked out from the counts when read, so that an item costs three
+  // atomic adds: one as it is spawned, and two into the histogram as it reports back.
+  // Sequences of unknown length add their items to `accepted_` as they go.
+
+  void sequence_started(size_t items) {
+    sequences_.fetch_add(1, std::memory_order_relaxed);
+    accepted_.fetch_add(long(items), std::memory_order_relaxed);
+  }
+
+  void item_spawned(bool was_queued) {
+    if (!was_queued) {
+      accepted_.fetch_add(1, std::memory_order_relaxed);
+    }
+    long spawned = long(spawned_.fetch_add(1, std::memory_order_relaxed)) + 1;
+    long in_flight = spawned - long(latency_.count());
+    long max = max_in_flight_.load(std::memory_order_relaxed);
+    while (in_flight > max &&
+        !max_in_flight_.compare_exchange_weak(max, in_flight, std::memory_order_relaxed)) {}
+  }
+
+  void item_done(ErrorCode error, Duration latency) {
+    if (error != OK && error != STOP && error != CANCELLED) {
+      failures_.fetch_add(1, std::memory_order_relaxed);
+    }
+    latency_.record(latency);
+  }
+
+  void sequence_finished(bool stopped, size_t unspawned) {
+    if (stopped) {
+      sequences_stopped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (unspawned > 0) {
+      accepted_.fetch_sub(long(unspawned), std::memory_order_relaxed);
+    }
+  }
+
+  std::string name_;
+  std::atomic<unsigned long> sequences_ { 0 };
+  std::atomic<unsigned long> sequences_stopped_ { 0 };
+  std::atomic<unsigned long> spawned_ { 0 };
+  std::atomic<unsigned long> failures_ { 0 };
+  std::atomic<long> accepted_ { 0 };
+  std::atomic<long> max_in_flight_ { 0 };
+  LatencyHistogram latency_;
+};
+
+/**
+   Metrics by name, for exporting.  Metrics are never removed, so a reference to one
+   stays good for the life of the registry.
+ */
+class MetricsRegistry {
+public:
+  // The Metrics called `name`, created the first time it is asked for.
+  Metrics &get(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Metrics> &metrics = metrics_[name];
+    if (!metrics) {
+      metrics.reset(new Metrics(name));
+    }
+    return *metrics;
+  }
+
+  // Invokes `func(metrics)` for each, in order of name.  The registry is locked
+  // meanwhile, so `func` mustn't call `get`.
+  template<typename Func>
+  void for_each(Func func) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &entry : metrics_) {
+      func(static_cast<const Metrics&>(*entry.second));
+    }
+  }
+
+private:
+  mutable std::mutex mutex_;
+  std::map<std::string, std::unique_ptr<Metrics>> metrics_;
+};
+
+// The registry which `async::metrics` looks in.
+inline MetricsRegistry &metrics_registry() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+inline Metrics &metrics(const std::string &name) {
+  return metrics_registry().get(name);
+}
+
+namespace detail {
+
+// Feeds one sequence's events to its Metrics.
+class MetricsObserver {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Stamp {
+    Clock::time_point spawned;
+  };
+
+  MetricsObserver(Metrics &metrics, size_t items) : metrics_(&metrics), unspawned_(items) {
+    metrics_->sequence_started(items);
+  }
+
+  Stamp item_spawned(unsigned int index, unsigned int outstanding) {
+    metrics_->item_spawned(unspawned_ > 0);
+    if (unspawned_ > 0) {
+      unspawned_--;
+    }
+    return Stamp { Clock::now() };
+  }
+
+  void item_done(const Stamp &stamp, ErrorCode error) {
+    metrics_->item_done(error, Clock::now() - stamp.spawned);
+  }
+
+  void stopped(ErrorCode error) {
+    stopped_ = true;
+  }
+
+  void finished(ErrorCode error) {
+    metrics_->sequence_finished(stopped_, unspawned_);
+    unspawned_ = 0;
+  }
+
+private:
+  Metrics *metrics_;
+  size_t unspawned_;
+  bool stopped_ = false;
+};
+
+template<typename TIter>
+size_t count_items(TIter items_begin, TIter items_end, std::random_access_iterator_tag) {
+  return size_t(items_end - items_begin);
+}
+
+template<typename TIter, typename Category>
+size_t count_items(TIter items_begin, TIter items_end, Category) {
+  return 0;
+}
+
+}
+
+// Same as `async::sequencer`, recording into `metrics`.
+template <typename T, typename TIter, typename Callback, typename FinalCallback>
+void sequencer(TIter items_begin, TIter items_end,
+    unsigned int limit,
+    Callback callback,
+    FinalCallback final_callback,
+    Metrics &metrics,
+    const CancellationToken &token=CancellationToken()) {
+
+  size_t items = detail::count_items(items_begin, items_end,
+      typename std::iterator_traits<TIter>::iterator_category());
+  detail::run_sequencer(items_begin, items_end, detail::FixedLimit(limit),
+      std::move(callback), std::move(final_callback), token,
+      detail::MetricsObserver(metrics, items));
+}
+
+// Same as `async::map`, recording into `metrics`.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
+void map(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    unsigned int task_limit,
+    Metrics &metrics,
+    const CancellationToken &token=CancellationToken()) {
+
+  std::vector<T>* results = new std::vector<T>(data.size());
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::MapItemCallback<T, Func>(std::move(func), results),
+          detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+          metrics, token);
+}
+
+// Same as `async::each`, recording into `metrics`.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    unsigned int task_limit,
+    Metrics &metrics,
+    const CancellationToken &token=CancellationToken()) {
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::EachItemCallback<T, Func>(std::move(func)),
+          typename std::decay<FinalCallback>::type(final_callback),
+          metrics, token);
+}
+
+// Same as `async::parallel_limit`, recording into `metrics`.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(std::vector<TTask> &tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback,
+    Metrics &metrics,
+    const CancellationToken &token=CancellationToken()) {
+
+  auto results = new detail::ResultSlots<T>(tasks.size());
+
+  sequencer<TTask>
+      (tasks.begin(), tasks.end(), limit,
+          detail::ParallelSlotItemCallback<T, TTask>(results),
+          detail::ParallelFinalCallback<detail::ResultSlots<T>, FinalCallback>(
+              final_callback, results),
+          metrics, token);
+}
+
+}
+
+#endif
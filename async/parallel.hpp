@@ -3,10 +3,24 @@
 #ifndef ASYNC_PARALLEL_HPP
 #define ASYNC_PARALLEL_HPP
 
+#include <memory>
+#include <type_traits>
+
+#include "concurrent_sequencer.hpp"
+#include "executor.hpp"
+#include "result_slots.hpp"
 #include "sequencer.hpp"
 
 namespace async {
 
+// The order of the results handed to `final_callback` by `parallel_limit` and `parallel`.
+typedef enum {
+  // `results[i]` is the result of `tasks[i]`.
+  TASK_ORDER,
+  // Results are appended as tasks complete.
+  COMPLETION_ORDER
+} ResultOrder;
+
 /**
    Run a sequence of tasks, in parallel, up to 'limit' at a time.  Each task is a
    std::function, which must accept a callback function which itself accepts an error code
@@ -14,7 +28,9 @@ namespace async {
    the callback when it finishes.  If the callback is given some error_code that is not
    async::OK, then iteration stops and no more tasks are invoked.  When all tasks complete
    successfully or some task passes an error to its callback, then the `final_callback`
-   will be called with the last error code and a vector of all return values.
+   will be called with the last error code and a vector of all return values, in the
+   order of `tasks`.  If a task failed, the vector holds the results of the leading tasks
+   which completed, including the failed one if it was among them.
 
    It is the responsibility of the caller that the `tasks` vector and `final_callback`
    passed to this function are not destroyed until `final_callback` is invoked.
@@ -26,48 +42,262 @@ namespace async {
      fetch or a deadline timer is started, the callback won't be invoked till some time
      in the future.  `series` handles that case correctly, and works if the callback is
      called immediately or deferred.
-  2. `series` minimizes how much stack it uses.  Except for deferred callbacks, we
-     don't invoke the next task from the previous task's callback -- otherwise the
-     stack would grow on every task invocation.
+  2. `series` minimizes how much stack it uses.  We never invoke the next task from
+     the previous task's callback -- otherwise the stack would grow on every task
+     invocation.  A deferred callback re-enters the sequencer's loop, so any number of
+     immediate callbacks after it still run at constant stack depth.
  */
 
+namespace detail {
+
+// The callback handed to one task, for COMPLETION_ORDER.  It is two pointers wide, so it
+// fits in the small-object buffer of TaskCallback<T>.
+template<typename T, typename CallbackDone>
+class ParallelTaskCallback {
+public:
+  ParallelTaskCallback(CallbackDone callback_done, std::vector<T> *results)
+    : callback_done_(callback_done), results_(results) {}
+
+  void operator()(ErrorCode error, T result) const {
+    results_->push_back(std::move(result));
+    callback_done_(error == OK, error);
+  }
+
+private:
+  CallbackDone callback_done_;
+  std::vector<T> *results_;
+};
+
+// A Task<T> or CancellableTask<T> must be handed an lvalue TaskCallback<T>.  Any other
+// task type is handed the callback object directly, and a token too if it accepts one.
+template<typename T, typename Callback, typename CallbackDone>
+void invoke_task(Task<T> &task, Callback callback, CallbackDone callback_done, int index) {
+  TaskCallback<T> task_callback(callback);
+  task(task_callback);
+}
+
+template<typename T, typename Callback, typename CallbackDone>
+void invoke_task(CancellableTask<T> &task, Callback callback, CallbackDone callback_done,
+    int index) {
+  const std::shared_ptr<CancellationState> &state = callback_done.cancellation();
+  ItemCancellation cancellation(state, index);
+  TaskCallback<T> task_callback(CancellationScopedCallback<Callback>(callback, cancellation));
+  task(task_callback, cancellation.token(state));
+}
+
+#ifdef ASYNC_USE_ASYNC_FUNCTION
+// Tasks which are std::functions, as Task<T> is unless ASYNC_USE_ASYNC_FUNCTION is defined.
+template<typename T, typename Callback, typename CallbackDone>
+void invoke_task(std::function<void(TaskCallback<T>&)> &task, Callback callback,
+    CallbackDone callback_done, int index) {
+  TaskCallback<T> task_callback(callback);
+  task(task_callback);
+}
+
+template<typename T, typename Callback, typename CallbackDone>
+void invoke_task(std::function<void(TaskCallback<T>&, CancellationToken)> &task,
+    Callback callback, CallbackDone callback_done, int index) {
+  const std::shared_ptr<CancellationState> &state = callback_done.cancellation();
+  ItemCancellation cancellation(state, index);
+  TaskCallback<T> task_callback(CancellationScopedCallback<Callback>(callback, cancellation));
+  task(task_callback, cancellation.token(state));
+}
+#endif
+
+template<typename TTask, typename Callback, typename CallbackDone>
+void invoke_task(TTask &task, Callback callback, CallbackDone callback_done, int index) {
+  invoke_item(task, callback, callback_done, index);
+}
+
+template<typename T, typename TTask>
+struct task_accepts_token : accepts_cancellation_token<TTask, TaskCallback<T>&> {};
+
+template<typename T, typename TTask>
+class ParallelItemCallback {
+public:
+  static const bool accepts_token = task_accepts_token<T, TTask>::value;
+
+  explicit ParallelItemCallback(std::vector<T> *results) : results_(results) {}
+
+  template<typename CallbackDone>
+  void operator()(TTask &task, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_task(task, ParallelTaskCallback<T, CallbackDone>(callback_done, results_),
+        callback_done, index);
+  }
+
+private:
+  std::vector<T> *results_;
+};
+
+// For TASK_ORDER: writes each result into the task's own slot, which also means that
+// tasks completing at the same time on different threads don't race.
+template<typename T, typename CallbackDone>
+class ParallelSlotTaskCallback {
+public:
+  ParallelSlotTaskCallback(CallbackDone callback_done, ResultSlot<T> *slot)
+    : callback_done_(callback_done), slot_(slot) {}
+
+  void operator()(ErrorCode error, T result) const {
+    slot_->set(std::move(result));
+    callback_done_(error == OK, error);
+  }
+
+private:
+  CallbackDone callback_done_;
+  ResultSlot<T> *slot_;
+};
+
+template<typename T, typename TTask>
+class ParallelSlotItemCallback {
+public:
+  static const bool accepts_token = task_accepts_token<T, TTask>::value;
+
+  explicit ParallelSlotItemCallback(ResultSlots<T> *results) : results_(results) {}
+
+  template<typename CallbackDone>
+  void operator()(TTask &task, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_task(task,
+        ParallelSlotTaskCallback<T, CallbackDone>(callback_done, results_->slot(index)),
+        callback_done, index);
+  }
+
+private:
+  ResultSlots<T> *results_;
+};
+
+// Owns the results: a std::vector for COMPLETION_ORDER, or ResultSlots for TASK_ORDER.
+// They are freed along with the sequencer state, once the last item has reported back,
+// since items still in flight after a stop may yet write to them.
+template<typename Results, typename FinalCallback>
+class ParallelFinalCallback {
+public:
+  ParallelFinalCallback(const FinalCallback &final_callback, Results *results)
+    : final_callback_(final_callback), results_(results) {}
+
+  void operator()(ErrorCode error) {
+    final_callback_(error, result_values(*results_));
+  }
+
+private:
+  typename std::decay<FinalCallback>::type final_callback_;
+  std::unique_ptr<Results> results_;
+};
+
+}
+
 // `tasks` and `final_callback` are passed by reference.  It is the responsibility of the
 // caller to ensure that their lifetime exceeds the lifetime of the parallel call.
-template<typename T>
-void parallel_limit(std::vector<Task<T>> &tasks,
+//
+// `tasks` may hold Task<T> or any other callable type accepting a task callback, and
+// `final_callback` may be any callable; nothing is heap-allocated per task.
+//
+// Tasks which also accept a CancellationToken, such as CancellableTask<T>, are handed one
+// which is cancelled when another task fails, or when `token` is cancelled.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(std::vector<TTask> &tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    const CancellationToken &token=CancellationToken()) {
+
+  auto results = new detail::ResultSlots<T>(tasks.size());
+
+  sequencer<TTask>
+      (tasks.begin(), tasks.end(), limit,
+          detail::ParallelSlotItemCallback<T, TTask>(results),
+          detail::ParallelFinalCallback<detail::ResultSlots<T>, FinalCallback>(
+              final_callback, results),
+          token);
+}
+
+// Same as above, but with COMPLETION_ORDER, the results are appended as tasks complete,
+// rather than placed at their tasks' indices.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(std::vector<TTask> &tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback,
+    ResultOrder order,
+    const CancellationToken &token=CancellationToken()) {
+
+  if (order == TASK_ORDER) {
+    parallel_limit<T>(tasks, limit, final_callback, token);
+    return;
+  }
+
+  auto results = new std::vector<T>();
+  results->reserve(tasks.size());
+
+  sequencer<TTask>
+      (tasks.begin(), tasks.end(), limit,
+          detail::ParallelItemCallback<T, TTask>(results),
+          detail::ParallelFinalCallback<std::vector<T>, FinalCallback>(
+              final_callback, results),
+          token);
+}
+
+namespace concurrent {
+
+// Same as `async::parallel_limit`, except that tasks may complete on any thread,
+// concurrently.  Results are always in the order of `tasks`.  `final_callback` is invoked
+// on whichever thread completes the last task.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(std::vector<TTask> &tasks,
     unsigned int limit,
-    const TaskCompletionCallback<T> &final_callback=noop_task_final_callback<T>) {
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    const CancellationToken &token=CancellationToken()) {
 
-  std::vector<T>* results = new std::vector<T>();
+  auto results = new detail::ResultSlots<T>(tasks.size());
 
-  auto callback = [results](Task<T> task, int index, bool is_last_time,
-      std::function<void(bool, ErrorCode)> callback_done) {
+  concurrent::sequencer<TTask>
+      (tasks.begin(), tasks.end(), limit,
+          detail::ParallelSlotItemCallback<T, TTask>(results),
+          detail::ParallelFinalCallback<detail::ResultSlots<T>, FinalCallback>(
+              final_callback, results),
+          token);
+}
 
-    TaskCallback<T> task_callback = [callback_done, results, index](ErrorCode error, T result) {
-      results->push_back(result);
-      callback_done(error == OK, error);
-    };
-    task(task_callback);
-  };
+}
+
+// Same as `async::parallel_limit`, except that each task is posted onto `executor`.  Tasks
+// may run on several threads at once, so as in `concurrent::parallel_limit`, results are
+// always in the order of `tasks`.  `final_callback` is invoked on whichever thread
+// completes the last task.
+template<typename T, typename Executor, typename TTask=Task<T>,
+    typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(Executor &executor,
+    std::vector<TTask> &tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    const CancellationToken &token=CancellationToken()) {
 
-  auto wrapped_final_callback = [results, final_callback](ErrorCode error) {
-    final_callback(error, *results);
-    delete results;
-  };
+  auto results = new detail::ResultSlots<T>(tasks.size());
 
-  sequencer<Task<T>>
-      (tasks.begin(), tasks.end(), limit, callback, wrapped_final_callback);
+  sequencer<TTask>
+      (executor, tasks.begin(), tasks.end(), limit,
+          detail::ParallelSlotItemCallback<T, TTask>(results),
+          detail::ParallelFinalCallback<detail::ResultSlots<T>, FinalCallback>(
+              final_callback, results),
+          token);
 }
 
 /**
    Runs tasks in parallel, with no limit on number of concurrent tasks.
 */
 
-template<typename T>
-void parallel(std::vector<Task<T>> &tasks,
-    const TaskCompletionCallback<T> &final_callback=noop_task_final_callback<T>) {
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel(std::vector<TTask> &tasks,
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    const CancellationToken &token=CancellationToken()) {
+
+  parallel_limit<T>(tasks, 0, final_callback, token);
+}
+
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel(std::vector<TTask> &tasks,
+    const FinalCallback &final_callback,
+    ResultOrder order,
+    const CancellationToken &token=CancellationToken()) {
 
-  parallel_limit(tasks, 0, final_callback);
+  parallel_limit<T>(tasks, 0, final_callback, order, token);
 }
 
 }
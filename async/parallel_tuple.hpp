@@ -0,0 +1,284 @@
+#pragma once
+
+#ifndef ASYNC_PARALLEL_TUPLE_HPP
+#define ASYNC_PARALLEL_TUPLE_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "parallel.hpp"
+#include "result_slots.hpp"
+#include "sequencer.hpp"
+
+namespace async {
+
+namespace detail {
+
+// std::index_sequence, which C++11 lacks.
+template<size_t... I>
+struct IndexSequence {};
+
+template<size_t N, size_t... I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+
+template<size_t... I>
+struct MakeIndexSequence<0, I...> {
+  typedef IndexSequence<I...> type;
+};
+
+// The R of a TaskCallback<R>.
+template<typename Callback>
+struct callback_result;
+
+template<typename R>
+struct callback_result<std::function<void(ErrorCode, R)>> {
+  typedef R type;
+};
+
+template<typename R, size_t InlineSize>
+struct callback_result<function<void(ErrorCode, R), InlineSize>> {
+  typedef R type;
+};
+
+/**
+   The result type of a task: the R of the TaskCallback<R> it accepts, as its first
+   parameter.  Task<R>, CancellableTask<R>, functions, and lambdas which name their
+   callback's type all say what they return; a function object with a templated
+   `operator()` can't, so can't be used in a tuple of tasks.
+ */
+template<typename TTask>
+struct task_result : task_result<decltype(&TTask::operator())> {};
+
+template<typename Callback, typename... Args>
+struct task_result<void (*)(Callback, Args...)>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename C, typename Callback, typename... Args>
+struct task_result<void (C::*)(Callback, Args...)>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename C, typename Callback, typename... Args>
+struct task_result<void (C::*)(Callback, Args...) const>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename... Values>
+struct any_of : std::false_type {};
+
+template<typename Value, typename... Values>
+struct any_of<Value, Values...>
+  : std::integral_constant<bool, Value::value || any_of<Values...>::value> {};
+
+// Counts from 0, so that the sequencer's items are the indices of the tasks in a tuple.
+class TaskIndexIterator {
+public:
+  typedef std::forward_iterator_tag iterator_category;
+  typedef unsigned int value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const unsigned int *pointer;
+  typedef unsigned int reference;
+
+  explicit TaskIndexIterator(unsigned int index) : index_(index) {}
+
+  unsigned int operator*() const {
+    return index_;
+  }
+
+  TaskIndexIterator& operator++() {
+    index_++;
+    return *this;
+  }
+
+  TaskIndexIterator operator++(int) {
+    TaskIndexIterator previous(*this);
+    index_++;
+    return previous;
+  }
+
+  bool operator==(const TaskIndexIterator &rhs) const {
+    return index_ == rhs.index_;
+  }
+
+  bool operator!=(const TaskIndexIterator &rhs) const {
+    return index_ != rhs.index_;
+  }
+
+private:
+  unsigned int index_;
+};
+
+/**
+   The tasks of a tuple, and a ResultSlot for each one's result, allocated together.  A
+   task is spawned through a table of functions, one per index, so each is invoked
+   directly, with a callback of its own result type, and nothing is type-erased but the
+   TaskCallback<R> each task asks for.
+ */
+template<typename... Tasks>
+class TupleTasks {
+public:
+  typedef std::tuple<typename task_result<Tasks>::type...> Results;
+
+  static const bool accepts_token =
+      any_of<task_accepts_token<typename task_result<Tasks>::type, Tasks>...>::value;
+
+  static_assert(sizeof...(Tasks) > 0, "a tuple of tasks can't be empty");
+
+  explicit TupleTasks(std::tuple<Tasks...> &&tasks) : tasks_(std::move(tasks)) {}
+
+  template<typename CallbackDone>
+  void spawn(unsigned int index, CallbackDone callback_done) {
+    spawn(index, callback_done, typename MakeIndexSequence<sizeof...(Tasks)>::type());
+  }
+
+  // Moves the results out.  Tasks which didn't complete have value-initialized results.
+  Results results() {
+    return results(typename MakeIndexSequence<sizeof...(Tasks)>::type());
+  }
+
+private:
+  template<size_t I>
+  using Result = typename std::tuple_element<I, Results>::type;
+
+  template<typename CallbackDone, size_t... I>
+  void spawn(unsigned int index, CallbackDone callback_done, IndexSequence<I...>) {
+    typedef void (TupleTasks::*Spawn)(CallbackDone);
+    static const Spawn spawns[] = { &TupleTasks::spawn_task<I, CallbackDone>... };
+    (this->*spawns[index])(callback_done);
+  }
+
+  template<size_t I, typename CallbackDone>
+  void spawn_task(CallbackDone callback_done) {
+    typedef typename std::tuple_element<I, std::tuple<Tasks...>>::type TTask;
+    invoke_tuple_task<Result<I>>(task_accepts_token<Result<I>, TTask>(),
+        std::get<I>(tasks_),
+        ParallelSlotTaskCallback<Result<I>, CallbackDone>(callback_done,
+            &std::get<I>(slots_)),
+        callback_done, I);
+  }
+
+  // Every task here names its callback's type, and may take it by reference, so it is
+  // handed an lvalue TaskCallback<R>, as a Task<R> is.
+  template<typename R, typename TTask, typename Callback, typename CallbackDone>
+  static void invoke_tuple_task(std::false_type accepts_token, TTask &task,
+      Callback callback, CallbackDone callback_done, int index) {
+    TaskCallback<R> task_callback(callback);
+    task(task_callback);
+  }
+
+  template<typename R, typename TTask, typename Callback, typename CallbackDone>
+  static void invoke_tuple_task(std::true_type accepts_token, TTask &task,
+      Callback callback, CallbackDone callback_done, int index) {
+    const std::shared_ptr<CancellationState> &state = callback_done.cancellation();
+    ItemCancellation cancellation(state, index);
+    TaskCallback<R> task_callback(CancellationScopedCallback<Callback>(callback, cancellation));
+    task(task_callback, cancellation.token(state));
+  }
+
+  template<size_t... I>
+  Results results(IndexSequence<I...>) {
+    return Results(take(std::get<I>(slots_))...);
+  }
+
+  template<typename R>
+  static R take(ResultSlot<R> &slot) {
+    return slot.ready() ? std::move(slot.get()) : R();
+  }
+
+  std::tuple<Tasks...> tasks_;
+  std::tuple<ResultSlot<typename task_result<Tasks>::type>...> slots_;
+};
+
+template<typename TupleTasks>
+class TupleItemCallback {
+public:
+  static const bool accepts_token = TupleTasks::accepts_token;
+
+  explicit TupleItemCallback(TupleTasks *tasks) : tasks_(tasks) {}
+
+  template<typename CallbackDone>
+  void operator()(unsigned int task, int index, bool is_last_time,
+      CallbackDone callback_done) {
+    tasks_->spawn(task, callback_done);
+  }
+
+private:
+  TupleTasks *tasks_;
+};
+
+// Owns the tasks and their results, until the last task has reported back.
+template<typename TupleTasks, typename FinalCallback>
+class TupleFinalCallback {
+public:
+  TupleFinalCallback(const FinalCallback &final_callback, TupleTasks *tasks)
+    : final_callback_(final_callback), tasks_(tasks) {}
+
+  void operator()(ErrorCode error) {
+    typename TupleTasks::Results results = tasks_->results();
+    final_callback_(error, results);
+  }
+
+private:
+  typename std::decay<FinalCallback>::type final_callback_;
+  std::unique_ptr<TupleTasks> tasks_;
+};
+
+}
+
+/**
+   Same as `async::parallel_limit`, but for tasks of different result types:
+
+     async::parallel_limit(std::make_tuple(fetch_user, fetch_orders), 2,
+         [](async::ErrorCode error, std::tuple<User, std::vector<Order>> &results) {
+           ...
+         });
+
+   Each task accepts a TaskCallback<R> for its own R, as Task<R> does, and
+   `final_callback(error, results)` is handed a tuple of their results, in the order of
+   the tasks.  If a task failed, the results of the tasks which didn't complete are
+   value-initialized.
+
+   The tasks are moved into the state of the call, along with their results, in a single
+   allocation, so they needn't outlive it.  Tasks aren't wrapped in std::function, and
+   each is invoked directly.  Tasks which also accept a CancellationToken are handed one,
+   as in the vector form.
+ */
+template<typename... Tasks, typename FinalCallback>
+void parallel_limit(std::tuple<Tasks...> tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  typedef detail::TupleTasks<Tasks...> TupleTasks;
+  auto state = new TupleTasks(std::move(tasks));
+
+  detail::run_sequencer(detail::TaskIndexIterator(0),
+      detail::TaskIndexIterator(sizeof...(Tasks)), detail::FixedLimit(limit),
+      detail::TupleItemCallback<TupleTasks>(state),
+      detail::TupleFinalCallback<TupleTasks, FinalCallback>(final_callback, state),
+      token);
+}
+
+// Runs a tuple of tasks in parallel, with no limit.
+template<typename... Tasks, typename FinalCallback>
+void parallel(std::tuple<Tasks...> tasks,
+    const FinalCallback &final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  parallel_limit(std::move(tasks), 0, final_callback, token);
+}
+
+// Runs a tuple of tasks one at a time.
+template<typename... Tasks, typename FinalCallback>
+void series(std::tuple<Tasks...> tasks,
+    const FinalCallback &final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  parallel_limit(std::move(tasks), 1, final_callback, token);
+}
+
+}
+
+#endif
@@ -0,0 +1,216 @@
+#pragma once
+
+#ifndef ASYNC_RACE_HPP
+#define ASYNC_RACE_HPP
+
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "parallel.hpp"
+#include "result_slots.hpp"
+#include "sequencer.hpp"
+
+namespace async {
+
+namespace detail {
+
+// The first task's error and result.
+template<typename T>
+struct RaceOutcome {
+  ErrorCode error = OK;
+  ResultSlot<T> result;
+};
+
+// The callback handed to one task in a race.  Whichever task reports back first stops
+// the sequence.  Two pointers wide, so it fits in the small-object buffer of
+// TaskCallback<T>.
+template<typename T, typename CallbackDone>
+class RaceTaskCallback {
+public:
+  RaceTaskCallback(CallbackDone callback_done, RaceOutcome<T> *outcome)
+    : callback_done_(callback_done), outcome_(outcome) {}
+
+  void operator()(ErrorCode error, T result) const {
+    if (!outcome_->result.ready()) {
+      outcome_->error = error;
+      outcome_->result.set(std::move(result));
+    }
+    callback_done_(false, STOP);
+  }
+
+private:
+  CallbackDone callback_done_;
+  RaceOutcome<T> *outcome_;
+};
+
+template<typename T, typename TTask>
+class RaceItemCallback {
+public:
+  static const bool accepts_token = task_accepts_token<T, TTask>::value;
+
+  explicit RaceItemCallback(RaceOutcome<T> *outcome) : outcome_(outcome) {}
+
+  template<typename CallbackDone>
+  void operator()(TTask &task, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_task(task, RaceTaskCallback<T, CallbackDone>(callback_done, outcome_),
+        callback_done, index);
+  }
+
+private:
+  RaceOutcome<T> *outcome_;
+};
+
+// Owns the outcome, which tasks still in flight may look at after the race is decided.
+template<typename T, typename FinalCallback>
+class RaceFinalCallback {
+public:
+  RaceFinalCallback(const FinalCallback &final_callback, RaceOutcome<T> *outcome)
+    : final_callback_(final_callback), outcome_(outcome) {}
+
+  void operator()(ErrorCode error) {
+    if (outcome_->result.ready()) {
+      final_callback_(outcome_->error, std::move(outcome_->result.get()));
+    } else {
+      final_callback_(error, T());
+    }
+  }
+
+private:
+  typename std::decay<FinalCallback>::type final_callback_;
+  std::unique_ptr<RaceOutcome<T>> outcome_;
+};
+
+// The results of the tasks which succeeded, and the count of those which failed.
+template<typename T>
+struct QuorumOutcome {
+  QuorumOutcome(size_t needed, size_t failures_allowed)
+    : needed(needed), failures_allowed(failures_allowed) {
+    results.reserve(needed);
+  }
+
+  size_t needed;
+  size_t failures_allowed;
+  size_t failures = 0;
+  bool decided = false;
+  std::vector<T> results;
+};
+
+// The callback handed to one task in a quorum.  The task which makes up the quorum stops
+// the sequence with STOP; the task which makes it unreachable stops it with its error.
+template<typename T, typename CallbackDone>
+class QuorumTaskCallback {
+public:
+  QuorumTaskCallback(CallbackDone callback_done, QuorumOutcome<T> *outcome)
+    : callback_done_(callback_done), outcome_(outcome) {}
+
+  void operator()(ErrorCode error, T result) const {
+    if (outcome_->decided) {
+      // The results have been handed over; leave them be.
+      callback_done_(true, OK);
+    } else if (error == OK) {
+      outcome_->results.push_back(std::move(result));
+      outcome_->decided = outcome_->results.size() == outcome_->needed;
+      callback_done_(!outcome_->decided, outcome_->decided ? STOP : OK);
+    } else {
+      outcome_->decided = ++outcome_->failures > outcome_->failures_allowed;
+      callback_done_(!outcome_->decided, outcome_->decided ? error : OK);
+    }
+  }
+
+private:
+  CallbackDone callback_done_;
+  QuorumOutcome<T> *outcome_;
+};
+
+template<typename T, typename TTask>
+class QuorumItemCallback {
+public:
+  static const bool accepts_token = task_accepts_token<T, TTask>::value;
+
+  explicit QuorumItemCallback(QuorumOutcome<T> *outcome) : outcome_(outcome) {}
+
+  template<typename CallbackDone>
+  void operator()(TTask &task, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_task(task, QuorumTaskCallback<T, CallbackDone>(callback_done, outcome_),
+        callback_done, index);
+  }
+
+private:
+  QuorumOutcome<T> *outcome_;
+};
+
+template<typename T, typename FinalCallback>
+class QuorumFinalCallback {
+public:
+  QuorumFinalCallback(const FinalCallback &final_callback, QuorumOutcome<T> *outcome)
+    : final_callback_(final_callback), outcome_(outcome) {}
+
+  void operator()(ErrorCode error) {
+    outcome_->decided = true;
+    final_callback_(error == STOP ? OK : error, outcome_->results);
+  }
+
+private:
+  typename std::decay<FinalCallback>::type final_callback_;
+  std::unique_ptr<QuorumOutcome<T>> outcome_;
+};
+
+}
+
+// Runs `tasks` in parallel, and invokes `final_callback(error, result)` with the error
+// and result of whichever task reports back first, successful or not.  No more tasks are
+// started after that.  Tasks still in flight are left to finish; those which accept a
+// CancellationToken see it cancelled, with reason STOP.  If `token` is cancelled before
+// any task reports back, or `tasks` is empty, the result is a default-constructed T.
+//
+// `tasks` may hold Task<T> or any other callable type accepting a task callback, as in
+// `async::parallel`.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCallback<T>>
+void race(std::vector<TTask> &tasks,
+    const FinalCallback &final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  auto outcome = new detail::RaceOutcome<T>();
+
+  sequencer<TTask>
+      (tasks.begin(), tasks.end(), 0,
+          detail::RaceItemCallback<T, TTask>(outcome),
+          detail::RaceFinalCallback<T, FinalCallback>(final_callback, outcome),
+          token);
+}
+
+// Runs `tasks` in parallel, up to `limit` at a time, until `needed` of them succeed.
+// `final_callback(OK, results)` is then invoked straight away, with their results in
+// the order they completed, and no more tasks are started; the rest are treated as in
+// `async::race`.  Once so many tasks have failed that `needed` can't be reached,
+// `final_callback` is invoked with the last failure's error, and the results so far.
+//
+// `limit` - the max number of tasks outstanding at once; 0 for no limit.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void quorum(size_t needed,
+    std::vector<TTask> &tasks,
+    const FinalCallback &final_callback,
+    unsigned int limit=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  // Decided before any task runs.
+  if (needed == 0 || needed > tasks.size()) {
+    typename std::decay<FinalCallback>::type callback(final_callback);
+    std::vector<T> results;
+    callback(needed == 0 ? token.reason() : FAIL, results);
+    return;
+  }
+
+  auto outcome = new detail::QuorumOutcome<T>(needed, tasks.size() - needed);
+
+  sequencer<TTask>
+      (tasks.begin(), tasks.end(), limit,
+          detail::QuorumItemCallback<T, TTask>(outcome),
+          detail::QuorumFinalCallback<T, FinalCallback>(final_callback, outcome),
+          token);
+}
+
+}
+
+#endif
@@ -0,0 +1,229 @@
+#pragma once
+
+#ifndef ASYNC_RATE_LIMIT_HPP
+#define ASYNC_RATE_LIMIT_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <type_traits>
+
+#include "async.hpp"
+#include "timing_wheel.hpp"
+
+namespace async {
+
+namespace detail {
+template<typename Limit>
+class RateLimitPolicy;
+}
+
+/**
+   A limit on the rate at which `map`, `each`, `parallel_limit` and `sequencer` spawn
+   tasks, passed after their task limit:
+
+     async::RateLimit quota(wheel, 100, 10);  // 100 a second, in bursts of up to 10
+     async::map<int>(data, func, final_callback, 8, quota);
+
+   It is a token bucket: each task spawned takes a token, and tokens are added back at
+   `rate` a second, up to `burst`.  The bucket starts full.  When it is empty, the
+   sequence waits on `wheel` until the next token is due, rather than polling, and
+   carries on from there.  The task limit still caps the tasks in flight; 0 means no
+   limit but the rate.
+
+   One RateLimit is meant to be kept for the life of a quota, and shared by every
+   sequence which counts against it.  Sequences waiting on an empty bucket each wake when
+   the next token is due, and whichever wakes first takes it, so it is shared out in no
+   particular order.  `burst` should be at least `rate` times the wheel's tick, or the
+   wheel's resolution, rather than the rate, sets the pace.
+
+   Like the wheel, it is not thread-safe, so there are no `concurrent` or executor
+   variants.  Since it needs asio, it is not included by async.hpp.
+ */
+class RateLimit {
+public:
+  typedef TimingWheel::Clock Clock;
+
+  RateLimit(TimingWheel &wheel, double rate, unsigned int burst=1)
+    : wheel_(&wheel),
+      rate_(rate),
+      burst_(std::max(burst, 1u)),
+      tokens_(burst_),
+      last_refill_(Clock::now()) {}
+
+  RateLimit(const RateLimit&) = delete;
+  RateLimit& operator=(const RateLimit&) = delete;
+
+  // Tasks a second.
+  double rate() const {
+    return rate_;
+  }
+
+  unsigned int burst() const {
+    return burst_;
+  }
+
+  // The tokens in the bucket now, which may be a fraction.
+  double tokens() {
+    refill();
+    return tokens_;
+  }
+
+private:
+  template<typename Limit>
+  friend class detail::RateLimitPolicy;
+
+  // Takes a token, if there is one.
+  bool take() {
+    refill();
+    if (tokens_ < 1) {
+      return false;
+    }
+    tokens_ -= 1;
+    return true;
+  }
+
+  // How long until the next token is due.
+  Clock::duration wait() const {
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>((1 - tokens_) / rate_));
+  }
+
+  void refill() {
+    Clock::time_point now = Clock::now();
+    tokens_ = std::min(tokens_ +
+        rate_ * std::chrono::duration<double>(now - last_refill_).count(), double(burst_));
+    last_refill_ = now;
+  }
+
+  TimingWheel *wheel_;
+  double rate_;
+  unsigned int burst_;
+  double tokens_;
+  Clock::time_point last_refill_;
+};
+
+namespace detail {
+
+// Wraps a sequence's limit policy, to hold each spawn until the rate limit has a token
+// for it.  While the bucket is empty, one timer is kept waiting, to resume the sequence
+// when the next token is due.  It is cancelled if the sequence is released first.
+template<typename Limit>
+class RateLimitPolicy {
+public:
+  RateLimitPolicy(Limit limit, RateLimit &rate_limit)
+    : limit_(limit), rate_limit_(&rate_limit) {}
+
+  ~RateLimitPolicy() {
+    if (waiting_) {
+      rate_limit_->wheel_->cancel(timer_);
+    }
+  }
+
+  bool allows(unsigned int outstanding) const {
+    return limit_.allows(outstanding);
+  }
+
+  template <typename State>
+  bool ready(State *state) {
+    if (waiting_ || !limit_.ready(state)) {
+      return false;
+    }
+    if (rate_limit_->take()) {
+      return true;
+    }
+
+    waiting_ = true;
+    timer_ = rate_limit_->wheel_->schedule(rate_limit_->wait(), [this, state]() {
+          waiting_ = false;
+          state->resume();
+        });
+    return false;
+  }
+
+  void item_spawned() {
+    limit_.item_spawned();
+  }
+
+  void item_done(ErrorCode error) {
+    limit_.item_done(error);
+  }
+
+private:
+  Limit limit_;
+  RateLimit *rate_limit_;
+  TimerHandle timer_;
+  bool waiting_ = false;
+};
+
+}
+
+// Same as `async::sequencer`, with a rate limit.
+template <typename T, typename TIter, typename Callback, typename FinalCallback>
+void sequencer(TIter items_begin, TIter items_end,
+    unsigned int limit,
+    Callback callback,
+    FinalCallback final_callback,
+    RateLimit &rate_limit,
+    const CancellationToken &token=CancellationToken()) {
+
+  detail::run_sequencer(items_begin, items_end,
+      detail::RateLimitPolicy<detail::FixedLimit>(detail::FixedLimit(limit), rate_limit),
+      std::move(callback), std::move(final_callback), token);
+}
+
+// Same as `async::map`, with a rate limit.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
+void map(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    unsigned int task_limit,
+    RateLimit &rate_limit,
+    const CancellationToken &token=CancellationToken()) {
+
+  std::vector<T>* results = new std::vector<T>(data.size());
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::MapItemCallback<T, Func>(std::move(func), results),
+          detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+          rate_limit, token);
+}
+
+// Same as `async::each`, with a rate limit.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    unsigned int task_limit,
+    RateLimit &rate_limit,
+    const CancellationToken &token=CancellationToken()) {
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::EachItemCallback<T, Func>(std::move(func)),
+          typename std::decay<FinalCallback>::type(final_callback),
+          rate_limit, token);
+}
+
+// Same as `async::parallel_limit`, with a rate limit.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(std::vector<TTask> &tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback,
+    RateLimit &rate_limit,
+    const CancellationToken &token=CancellationToken()) {
+
+  auto results = new detail::ResultSlots<T>(tasks.size());
+
+  sequencer<TTask>
+      (tasks.begin(), tasks.end(), limit,
+          detail::ParallelSlotItemCallback<T, TTask>(results),
+          detail::ParallelFinalCallback<detail::ResultSlots<T>, FinalCallback>(
+              final_callback, results),
+          rate_limit, token);
+}
+
+}
+
+#endif
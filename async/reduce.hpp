@@ -0,0 +1,290 @@
+#pragma once
+
+#ifndef ASYNC_REDUCE_HPP
+#define ASYNC_REDUCE_HPP
+
+#include <climits>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "sequencer.hpp"
+
+namespace async {
+
+namespace detail {
+
+// The callback handed to `func` for one item, in `reduce`.  It is two pointers wide, so it
+// fits in the small-object buffer of TaskCallback<Memo>.
+template<typename Memo, typename CallbackDone>
+class ReduceTaskCallback {
+public:
+  ReduceTaskCallback(CallbackDone callback_done, Memo *memo)
+    : callback_done_(callback_done), memo_(memo) {}
+
+  void operator()(ErrorCode error, Memo memo) const {
+    *memo_ = std::move(memo);
+    callback_done_(error == OK, error);
+  }
+
+private:
+  CallbackDone callback_done_;
+  Memo *memo_;
+};
+
+// Hands the memo to `func` as an rvalue, since it is about to be replaced.
+template<typename T, typename Memo, typename Func>
+class ReduceItemCallback {
+public:
+  static const bool accepts_token =
+      accepts_cancellation_token<Func, Memo&&, T&, TaskCallback<Memo>>::value;
+
+  ReduceItemCallback(Func &&func, Memo *memo) : func_(std::move(func)), memo_(memo) {}
+
+  template<typename CallbackDone>
+  void operator()(T &item, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_item(func_, ReduceTaskCallback<Memo, CallbackDone>(callback_done, memo_),
+        callback_done, index, std::move(*memo_), item);
+  }
+
+private:
+  Func func_;
+  Memo *memo_;
+};
+
+template<typename Memo, typename FinalCallback>
+class ReduceFinalCallback {
+public:
+  ReduceFinalCallback(const FinalCallback &final_callback, Memo *memo)
+    : final_callback_(final_callback), memo_(memo) {}
+
+  void operator()(ErrorCode error) {
+    final_callback_(error, std::move(*memo_));
+  }
+
+private:
+  typename std::decay<FinalCallback>::type final_callback_;
+  std::unique_ptr<Memo> memo_;
+};
+
+/**
+   Folds items' values together as they finish, in any order, by merging each value into
+   the runs of finished neighbours either side of it.  `combine` is applied left to right,
+   so it need only be associative, not commutative.
+
+   Each item has a pair of indices: if it is at one end of a run, the index of the other
+   end, and if it starts a run, where the run's value is kept.  So finding the neighbours
+   is constant time, and values are only kept per run: at most one more than the number
+   of items in flight, when items are spawned in order.  Their storage is recycled, so
+   once the number of runs peaks, nothing more is allocated.
+ */
+template<typename R, typename Combine>
+class ReduceTree {
+public:
+  ReduceTree(size_t size, R &&init, Combine &&combine)
+    : ends_(new Ends[size]), size_(size), init_(std::move(init)),
+      combine_(std::move(combine)) {
+    for (size_t i = 0; i < size; i++) {
+      ends_[i].other = kPending;
+    }
+  }
+
+  void add(unsigned int index, R &&value) {
+    bool has_left = index > 0 && ends_[index - 1].other != kPending;
+    bool has_right = index + 1 < size_ && ends_[index + 1].other != kPending;
+    unsigned int first = has_left ? ends_[index - 1].other : index;
+    unsigned int last = has_right ? ends_[index + 1].other : index;
+
+    if (has_left) {
+      // Extend the run to the left, combining in place.  When items finish in order,
+      // this is all there is to do.
+      R &left = values_[ends_[first].value];
+      left = combine_(std::move(left), std::move(value));
+      if (has_right) {
+        left = combine_(std::move(left), take(ends_[index + 1].value));
+      }
+    } else if (has_right) {
+      unsigned int slot = ends_[index + 1].value;
+      values_[slot] = combine_(std::move(value), std::move(values_[slot]));
+      ends_[first].value = slot;
+    } else {
+      ends_[first].value = store(std::move(value));
+    }
+
+    ends_[first].other = last;
+    ends_[last].other = first;
+    finished_++;
+  }
+
+  bool complete() const {
+    return finished_ == size_;
+  }
+
+  // The initial value combined with every item's, once complete.
+  R result() {
+    if (size_ == 0) {
+      return std::move(init_);
+    }
+    return combine_(std::move(init_), take(ends_[0].value));
+  }
+
+  R &init() {
+    return init_;
+  }
+
+private:
+  static const unsigned int kPending = UINT_MAX;
+
+  struct Ends {
+    unsigned int other;
+    unsigned int value;
+  };
+
+  unsigned int store(R &&value) {
+    if (free_.empty()) {
+      values_.push_back(std::move(value));
+      return values_.size() - 1;
+    }
+    unsigned int slot = free_.back();
+    free_.pop_back();
+    values_[slot] = std::move(value);
+    return slot;
+  }
+
+  R take(unsigned int slot) {
+    free_.push_back(slot);
+    return std::move(values_[slot]);
+  }
+
+  std::unique_ptr<Ends[]> ends_;
+  size_t size_;
+  size_t finished_ = 0;
+  R init_;
+  Combine combine_;
+  std::vector<R> values_;
+  std::vector<unsigned int> free_;
+};
+
+// The callback handed to `func` for one item, in `reduce_tree`.  Two words wide, like
+// FilterTaskCallback.
+template<typename R, typename CallbackDone>
+class ReduceTreeTaskCallback {
+public:
+  ReduceTreeTaskCallback(const CallbackDone &callback_done, unsigned int index)
+    : callback_done_(callback_done), index_(index) {}
+
+  void operator()(ErrorCode error, R value) const {
+    if (error == OK) {
+      callback_done_.callback().tree()->add(index_, std::move(value));
+    }
+    callback_done_(error == OK, error);
+  }
+
+private:
+  CallbackDone callback_done_;
+  unsigned int index_;
+};
+
+template<typename T, typename R, typename Func, typename Combine>
+class ReduceTreeItemCallback {
+public:
+  static const bool accepts_token = accepts_cancellation_token<Func, T&, TaskCallback<R>>::value;
+
+  ReduceTreeItemCallback(Func &&func, ReduceTree<R, Combine> *tree)
+    : func_(std::move(func)), tree_(tree) {}
+
+  template<typename CallbackDone>
+  void operator()(T &item, int index, bool is_last_time, CallbackDone callback_done) {
+    invoke_item(func_, ReduceTreeTaskCallback<R, CallbackDone>(callback_done, index),
+        callback_done, index, item);
+  }
+
+  ReduceTree<R, Combine> *tree() const {
+    return tree_;
+  }
+
+private:
+  Func func_;
+  ReduceTree<R, Combine> *tree_;
+};
+
+// Owns the tree.  If the reduction failed or was cancelled, `final_callback` is handed
+// the initial value.
+template<typename R, typename Combine, typename FinalCallback>
+class ReduceTreeFinalCallback {
+public:
+  ReduceTreeFinalCallback(const FinalCallback &final_callback, ReduceTree<R, Combine> *tree)
+    : final_callback_(final_callback), tree_(tree) {}
+
+  void operator()(ErrorCode error) {
+    if (error == OK && tree_->complete()) {
+      final_callback_(OK, tree_->result());
+    } else {
+      final_callback_(error, std::move(tree_->init()));
+    }
+  }
+
+private:
+  typename std::decay<FinalCallback>::type final_callback_;
+  std::unique_ptr<ReduceTree<R, Combine>> tree_;
+};
+
+}
+
+// Folds `data` into `memo`, one item at a time, in order.  `func` is invoked as
+// `func(memo, item, callback)`, with the memo as an rvalue, and invokes
+// `callback(error, memo)` with the new memo.  `final_callback(error, memo)` is handed the
+// last memo.  As in `async::map`, `func` may accept a CancellationToken too.
+template<typename T, typename Memo, typename Func, typename FinalCallback=TaskCallback<Memo>>
+void reduce(std::vector<T> &data,
+    Memo memo,
+    Func func,
+    const FinalCallback &final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  Memo *state = new Memo(std::move(memo));
+
+  sequencer<T>
+      (data.begin(), data.end(), 1,
+          detail::ReduceItemCallback<T, Memo, Func>(std::move(func), state),
+          detail::ReduceFinalCallback<Memo, FinalCallback>(final_callback, state),
+          token);
+}
+
+// Maps each item to a value, as `async::map` does, and folds the values together with
+// `combine` as they arrive, rather than collecting them first.  `func` is invoked as
+// `func(item, callback)`, and `combine` as `combine(a, b)`, returning a new R.  Values
+// are combined as soon as their neighbours in `data` have finished, so the work of
+// combining overlaps with the items still in flight, and only a value per run of
+// finished items is kept.  `combine` must be associative; the result is
+// `init + data[0] + data[1] + ...`, however the items finish.
+//
+// `final_callback(error, result)` is handed the result, or `init` if an item failed or
+// `token` was cancelled.
+//
+// `task_limit` - the max number of items outstanding at once; 0 for no limit.
+template<typename T, typename R, typename Func, typename Combine,
+    typename FinalCallback=TaskCallback<R>>
+void reduce_tree(std::vector<T> &data,
+    R init,
+    Func func,
+    Combine combine,
+    const FinalCallback &final_callback,
+    unsigned int task_limit=0,
+    const CancellationToken &token=CancellationToken()) {
+
+  auto tree = new detail::ReduceTree<R, Combine>(data.size(), std::move(init),
+      std::move(combine));
+
+  sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::ReduceTreeItemCallback<T, R, Func, Combine>(std::move(func), tree),
+          detail::ReduceTreeFinalCallback<R, Combine, FinalCallback>(final_callback, tree),
+          token);
+}
+
+}
+
+#endif
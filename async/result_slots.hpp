@@ -0,0 +1,112 @@
+#pragma once
+
+#ifndef ASYNC_RESULT_SLOTS_HPP
+#define ASYNC_RESULT_SLOTS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace async {
+
+namespace detail {
+
+/**
+   Room for one task's result.  The result is constructed in place when the task
+   completes, so `T` needn't be default constructible.  Tasks may complete on different
+   threads; each writes only its own slot.
+ */
+template<typename T>
+class ResultSlot {
+public:
+  ResultSlot() : ready_(false) {}
+
+  ~ResultSlot() {
+    if (ready_.load(std::memory_order_relaxed)) {
+      get().~T();
+    }
+  }
+
+  ResultSlot(const ResultSlot&) = delete;
+  ResultSlot& operator=(const ResultSlot&) = delete;
+
+  void set(T &&value) {
+    if (ready_.load(std::memory_order_relaxed)) {
+      // The task invoked its callback twice.  Keep the last result.
+      get() = std::move(value);
+      return;
+    }
+    new (&storage_) T(std::move(value));
+    ready_.store(true, std::memory_order_release);
+  }
+
+  bool ready() const {
+    return ready_.load(std::memory_order_acquire);
+  }
+
+  T &get() {
+    return *reinterpret_cast<T*>(&storage_);
+  }
+
+private:
+  typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage_;
+  std::atomic<bool> ready_;
+};
+
+/**
+   One ResultSlot per task, allocated together, so that each result lands at its task's
+   index whatever order the tasks complete in.
+ */
+template<typename T>
+class ResultSlots {
+public:
+  explicit ResultSlots(size_t size) : slots_(new ResultSlot<T>[size]), size_(size) {}
+
+  ResultSlot<T> *slot(size_t index) {
+    return &slots_[index];
+  }
+
+  // Moves the results into a vector, in task order.  If the tasks didn't all complete,
+  // only the results of the leading tasks which did are included, so that `values()[i]`
+  // is always the result of task `i`.
+  std::vector<T> &values() {
+    if (!collected_) {
+      collected_ = true;
+      size_t count = 0;
+      while (count < size_ && slots_[count].ready()) {
+        count++;
+      }
+      values_.reserve(count);
+      for (size_t i = 0; i < count; i++) {
+        values_.push_back(std::move(slots_[i].get()));
+      }
+    }
+    return values_;
+  }
+
+private:
+  std::unique_ptr<ResultSlot<T>[]> slots_;
+  size_t size_;
+  bool collected_ = false;
+  std::vector<T> values_;
+};
+
+template<typename T>
+std::vector<T> &result_values(std::vector<T> &results) {
+  return results;
+}
+
+template<typename T>
+std::vector<T> &result_values(ResultSlots<T> &results) {
+  return results.values();
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,292 @@
+#pragma once
+
+#ifndef ASYNC_RETRY_HPP
+#define ASYNC_RETRY_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <utility>
+
+#include "async.hpp"
+#include "timing_wheel.hpp"
+
+namespace async {
+
+inline bool retry_transient_errors(ErrorCode error) {
+  return error == FAIL || error == TIMEOUT;
+}
+
+/**
+   How `async::retry` retries a task: up to `max_attempts` attempts in all, waiting on
+   `wheel` between them.  The first wait is `initial_backoff`, and each one after that is
+   `multiplier` times longer, up to `max_backoff`.  Each wait is then shortened by a
+   random fraction of up to `jitter`, so that tasks which failed together don't all retry
+   together; the default of 1 waits anywhere from none of the backoff to all of it.
+
+     async::RetryPolicy policy(wheel, 5, std::chrono::milliseconds(50));
+     policy.set_budget(std::chrono::seconds(2));
+
+   `budget`, if not zero, caps the time from the first attempt: a retry which couldn't
+   start before it runs out isn't made.  It doesn't cut short an attempt in flight; that's
+   what Timeouts are for.  Only errors for which `retryable` returns true are retried; by
+   default FAIL and TIMEOUT.
+ */
+class RetryPolicy {
+public:
+  typedef TimingWheel::Clock::duration Duration;
+  typedef std::function<bool(ErrorCode error)> Retryable;
+
+  explicit RetryPolicy(TimingWheel &wheel, unsigned int max_attempts=3,
+      Duration initial_backoff=std::chrono::milliseconds(100))
+    : wheel_(&wheel),
+      max_attempts_(std::max(max_attempts, 1u)),
+      initial_backoff_(initial_backoff),
+      max_backoff_(std::chrono::seconds(10)),
+      multiplier_(2),
+      jitter_(1),
+      budget_(Duration::zero()),
+      retryable_(retry_transient_errors) {}
+
+  RetryPolicy &set_max_backoff(Duration max_backoff) {
+    max_backoff_ = max_backoff;
+    return *this;
+  }
+
+  RetryPolicy &set_multiplier(double multiplier) {
+    multiplier_ = multiplier;
+    return *this;
+  }
+
+  RetryPolicy &set_jitter(double jitter) {
+    jitter_ = std::min(std::max(jitter, 0.0), 1.0);
+    return *this;
+  }
+
+  RetryPolicy &set_budget(Duration budget) {
+    budget_ = budget;
+    return *this;
+  }
+
+  RetryPolicy &set_retryable(Retryable retryable) {
+    retryable_ = std::move(retryable);
+    return *this;
+  }
+
+  TimingWheel &wheel() const {
+    return *wheel_;
+  }
+
+  unsigned int max_attempts() const {
+    return max_attempts_;
+  }
+
+  Duration budget() const {
+    return budget_;
+  }
+
+  bool retryable(ErrorCode error) const {
+    return retryable_(error);
+  }
+
+  // The wait after the `attempt`th attempt fails, counting from 1, jitter and all.
+  Duration backoff(unsigned int attempt) const {
+    double backoff = std::chrono::duration<double>(initial_backoff_).count();
+    double max_backoff = std::chrono::duration<double>(max_backoff_).count();
+    for (unsigned int i = 1; i < attempt && backoff < max_backoff; i++) {
+      backoff *= multiplier_;
+    }
+    backoff = std::min(backoff, max_backoff);
+
+    std::uniform_real_distribution<double> fraction(0, jitter_);
+    backoff *= 1 - fraction(random());
+    return std::chrono::duration_cast<Duration>(std::chrono::duration<double>(backoff));
+  }
+
+private:
+  // Each thread jitters from its own generator, so that copies of a policy don't all
+  // draw the same waits.
+  static std::minstd_rand &random() {
+    static thread_local std::minstd_rand random { std::random_device()() };
+    return random;
+  }
+
+  TimingWheel *wheel_;
+  unsigned int max_attempts_;
+  Duration initial_backoff_;
+  Duration max_backoff_;
+  double multiplier_;
+  double jitter_;
+  Duration budget_;
+  Retryable retryable_;
+};
+
+namespace detail {
+
+template<typename TTask>
+struct RetryShared {
+  RetryPolicy policy;
+  TTask task;
+};
+
+template<typename T, typename TTask, typename Callback>
+class RetryState;
+
+// The callback handed to each attempt.  It is a single pointer, so it fits in the
+// small-object buffer of TaskCallback<T>.
+template<typename T, typename TTask, typename Callback>
+class RetryAttemptCallback {
+public:
+  explicit RetryAttemptCallback(RetryState<T, TTask, Callback> *state) : state_(state) {}
+
+  void operator()(ErrorCode error, T result) const {
+    state_->attempt_done(error, std::move(result));
+  }
+
+private:
+  RetryState<T, TTask, Callback> *state_;
+};
+
+/**
+   One invocation of a retried task, from its first attempt to its last.  It is allocated
+   when the task is invoked, and deletes itself once it has invoked `callback`.
+
+   While it waits to retry, it listens to `token`: if the sequence stops, or the caller
+   cancels, the wait is dropped and `callback` is invoked with the token's reason.  An
+   attempt in flight is left to finish, as the sequencer leaves its items, and then not
+   retried.
+ */
+template<typename T, typename TTask, typename Callback>
+class RetryState {
+public:
+  RetryState(const std::shared_ptr<RetryShared<TTask>> &shared, Callback &&callback,
+      const CancellationToken &token)
+    : shared_(shared),
+      callback_(std::move(callback)),
+      token_(token),
+      start_(TimingWheel::Clock::now()) {}
+
+  void attempt() {
+    attempts_++;
+    TaskCallback<T> callback(RetryAttemptCallback<T, TTask, Callback>(this));
+    invoke(accepts_cancellation_token<TTask, TaskCallback<T>&>(), callback);
+  }
+
+  void attempt_done(ErrorCode error, T result) {
+    const RetryPolicy &policy = shared_->policy;
+    if (error == OK || attempts_ >= policy.max_attempts() || !policy.retryable(error) ||
+        token_.is_cancelled()) {
+      finish(error, std::move(result));
+      return;
+    }
+
+    RetryPolicy::Duration backoff = policy.backoff(attempts_);
+    if (policy.budget() != RetryPolicy::Duration::zero() &&
+        TimingWheel::Clock::now() + backoff - start_ > policy.budget()) {
+      finish(error, std::move(result));
+      return;
+    }
+
+    // Keep the failed result, to report if we're cancelled while waiting.
+    result_.reset(new T(std::move(result)));
+    waiting_ = true;
+    timer_ = policy.wheel().schedule(backoff, [this]() {
+          waiting_ = false;
+          registration_.reset();
+          result_.reset();
+          attempt();
+        });
+    registration_ = token_.on_cancel([this]() {
+          if (waiting_) {
+            waiting_ = false;
+            shared_->policy.wheel().cancel(timer_);
+            finish(token_.reason(), std::move(*result_));
+          }
+        });
+  }
+
+private:
+  void invoke(std::false_type accepts_token, TaskCallback<T> &callback) {
+    shared_->task(callback);
+  }
+
+  void invoke(std::true_type accepts_token, TaskCallback<T> &callback) {
+    shared_->task(callback, token_);
+  }
+
+  void finish(ErrorCode error, T result) {
+    registration_.reset();
+    callback_(error, std::move(result));
+    delete this;
+  }
+
+  std::shared_ptr<RetryShared<TTask>> shared_;
+  Callback callback_;
+  CancellationToken token_;
+  TimingWheel::Clock::time_point start_;
+  unsigned int attempts_ = 0;
+  bool waiting_ = false;
+  TimerHandle timer_;
+  CancellationRegistration registration_;
+  std::unique_ptr<T> result_;
+};
+
+/**
+   A task which retries another.  The task and policy are shared between its copies, so
+   converting it to a Task<T> doesn't copy them, and an invocation still waiting to retry
+   doesn't depend on the copy it was invoked through.
+ */
+template<typename T, typename TTask>
+class RetryTask {
+public:
+  RetryTask(const RetryPolicy &policy, TTask &&task)
+    : shared_(new RetryShared<TTask> { policy, std::move(task) }) {}
+
+  template<typename Callback>
+  void operator()(Callback &&callback) const {
+    start(std::forward<Callback>(callback), CancellationToken());
+  }
+
+  template<typename Callback>
+  void operator()(Callback &&callback, CancellationToken token) const {
+    start(std::forward<Callback>(callback), token);
+  }
+
+private:
+  template<typename Callback>
+  void start(Callback &&callback, const CancellationToken &token) const {
+    typedef typename std::decay<Callback>::type StoredCallback;
+    auto state = new RetryState<T, TTask, StoredCallback>(
+        shared_, StoredCallback(std::forward<Callback>(callback)), token);
+    state->attempt();
+  }
+
+  std::shared_ptr<RetryShared<TTask>> shared_;
+};
+
+}
+
+// Wraps `task`, so that it is attempted again when it fails, as `policy` says.  The
+// wrapper is itself a task: it invokes its callback once, with the first success or the
+// last failure, so in a `parallel_limit` it keeps its slot through every retry, and only
+// a task which has run out of retries stops the sequence.
+//
+// `task` may be a Task<T>, a CancellableTask<T>, or any callable invoked as
+// `task(callback)` or `task(callback, token)`.  The wrapper may be stored as a Task<T>
+// or a CancellableTask<T>; given a token, it stops waiting to retry when the token is
+// cancelled, and hands the token on to `task`.  Each invocation allocates its own
+// state, and attempts after the first wait on the policy's wheel, so invoke it from the
+// thread running the wheel's io_service.
+template<typename T, typename TTask>
+detail::RetryTask<T, typename std::decay<TTask>::type> retry(const RetryPolicy &policy,
+    TTask &&task) {
+  return detail::RetryTask<T, typename std::decay<TTask>::type>(policy,
+      typename std::decay<TTask>::type(std::forward<TTask>(task)));
+}
+
+}
+
+#endif
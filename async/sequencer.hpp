@@ -3,143 +3,409 @@
 #ifndef ASYNC_SEQUENCER_HPP
 #define ASYNC_SEQUENCER_HPP
 
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cancellation.hpp"
+
 namespace async {
 
 // This value can be asserted to equal zero if there's no pending callbacks.  Otherwise,
-// if it's non-zero after all callbacks have executed, we have a memory leak.
-inline int *sequencer_state_count() {
-  static int count = 0;
+// if it's non-zero after all callbacks have executed, we have a memory leak.  Atomic,
+// since concurrent sequencers may be created and released on any thread.
+inline std::atomic<int> *sequencer_state_count() {
+  static std::atomic<int> count { 0 };
   return &count;
 }
 
+namespace detail {
+
 /**
- * `limit` - the max number of items to process asynchronously.  If all items
- *      invoke their completion callbacks synchronously, then `limit` has no
- *      effect and the items proceed serially.  Set `limit` to 0 to indicate
- *      no limit on max number of asynchronous outstanding items.
+   Watches a sequence, for metrics; see metrics.hpp.  It is told as each item is spawned
+   and reports back, and as the sequence stops early and finishes.  `item_spawned`
+   returns a Stamp, which the item's `callback_done` carries back to `item_done`.
+
+   This observer watches nothing.  Its Stamp is empty and its hooks do nothing, so they
+   compile away, and `callback_done` stays a single pointer.
  */
-template <typename T, typename TIter>
-void sequencer(TIter items_begin, TIter items_end,
-    unsigned int limit,
-    std::function<void(T item, int index, bool is_last_item,
-        std::function<void(bool keep_going, ErrorCode error)> callback_done)> callback,
-    std::function<void(ErrorCode error)> final_callback) {
+class NoObserver {
+public:
+  struct Stamp {};
+
+  Stamp item_spawned(unsigned int index, unsigned int outstanding) {
+    return Stamp();
+  }
+
+  void item_done(const Stamp &stamp, ErrorCode error) {}
+
+  void stopped(ErrorCode error) {}
+
+  void finished(ErrorCode error) {}
+};
+
+/**
+   The `callback_done` handed to each item by the sequencer.  It holds a single raw
+   pointer, so it is trivially copyable and fits in the small-object buffer of
+   std::function: converting it to a `std::function<void(bool, ErrorCode)>` does not
+   allocate.
+ */
+template <typename State>
+class SequencerCallbackDone {
+public:
+  explicit SequencerCallbackDone(State *state) : state_(state) {}
+
+  SequencerCallbackDone(State *state, NoObserver::Stamp stamp) : state_(state) {}
+
+  void operator()(bool keep_going, ErrorCode error) const {
+    state_->item_done(keep_going, error);
+  }
+
+  // Finishes the sequence with `error` straight away, although this item is still
+  // outstanding: it must still report back later.
+  void abort(ErrorCode error) const {
+    state_->abort(error);
+  }
+
+  // Null unless the sequence was started with cancellation enabled.
+  const std::shared_ptr<CancellationState> &cancellation() const {
+    return state_->cancellation();
+  }
+
+  // Whether the sequence has stopped, by failure or cancellation, so that no more items
+  // are wanted.
+  bool stopped() const {
+    return state_->stopped();
+  }
+
+  // The sequence's item callback.  An item's task callback may find what the item
+  // callback holds here, rather than carry it, to stay two words wide.
+  typename State::ItemCallback &callback() const {
+    return state_->callback();
+  }
+
+protected:
+  State *state_;
+};
+
+// The `callback_done` of an observed sequence, which carries its item's stamp back.
+template <typename State>
+class ObservedCallbackDone : public SequencerCallbackDone<State> {
+public:
+  ObservedCallbackDone(State *state, const typename State::Stamp &stamp)
+    : SequencerCallbackDone<State>(state), stamp_(stamp) {}
+
+  void operator()(bool keep_going, ErrorCode error) const {
+    this->state_->item_done(keep_going, error, stamp_);
+  }
+
+private:
+  typename State::Stamp stamp_;
+};
+
+/**
+   The limit on a sequence's outstanding items: at most `limit`, or no limit if 0.  A
+   limit policy is told as each item is spawned and reports back, so that an adaptive
+   policy (see adaptive_limit.hpp) can move the limit as it goes.
+
+   Before each spawn which `allows` permits, the policy is also asked if it is `ready`.
+   A policy which says not yet must later call `state->resume()`, to re-enter the main
+   loop; see rate_limit.hpp.
+ */
+class FixedLimit {
+public:
+  explicit FixedLimit(unsigned int limit) : limit_(limit) {}
+
+  bool allows(unsigned int outstanding) const {
+    return limit_ == 0 || outstanding < limit_;
+  }
+
+  template <typename State>
+  bool ready(State *state) {
+    return true;
+  }
+
+  void item_spawned() {}
+
+  void item_done(ErrorCode error) {}
+
+private:
+  unsigned int limit_;
+};
+
+/**
+   The shared state of one sequencer run.  It is allocated once per call to
+   `sequencer()`, and deletes itself once the final callback has been invoked and no
+   item callbacks remain outstanding.  Nothing is allocated per item.
+ */
+template <typename TIter, typename Callback, typename FinalCallback, typename Limit=FixedLimit,
+    typename Observer=NoObserver>
+class SequencerState {
+public:
+  typedef typename Observer::Stamp Stamp;
+  typedef Callback ItemCallback;
+  using CallbackDone = typename std::conditional<std::is_empty<Stamp>::value,
+      SequencerCallbackDone<SequencerState>, ObservedCallbackDone<SequencerState>>::type;
+
+  SequencerState(TIter items_begin, TIter items_end, Limit limit,
+      Callback &&callback, FinalCallback &&final_callback, Observer observer=Observer())
+    : item_iter_(items_begin),
+      items_end_(items_end),
+      limit_(limit),
+      observer_(std::move(observer)),
+      callback_(std::move(callback)),
+      final_callback_(std::move(final_callback)) {
+    (*sequencer_state_count())++;
+  }
+
+  ~SequencerState() {
+    external_registration_.reset();
+    (*sequencer_state_count())--;
+  }
+
+  SequencerState(const SequencerState&) = delete;
+  SequencerState& operator=(const SequencerState&) = delete;
+
+  // Gives items tokens which are cancelled when the sequence stops early, and stops the
+  // sequence when `token` is cancelled.  Called before `run()`; if `token` has already
+  // been cancelled, the final callback is invoked from here.
+  void enable_cancellation(const CancellationToken &token) {
+    cancellation_ = std::make_shared<CancellationState>();
+
+    spawn_depth_++;
+    external_token_ = token;
+    external_registration_ = token.on_cancel([this]() {
+          abort(external_token_.reason());
+        });
+    spawn_depth_--;
+  }
+
+  const std::shared_ptr<CancellationState> &cancellation() const {
+    return cancellation_;
+  }
+
+  Callback &callback() {
+    return callback_;
+  }
+
+  // The main loop.  Spawns items until the limit is reached, the sequence is stopped,
+  // or the items run out.  Entered once from `sequencer()`, and again from each
+  // asynchronous completion which frees up a slot.
+  void run() {
+    in_main_loop_ = true;
+    while (limit_.allows(callbacks_outstanding_) &&
+        !stop_ &&
+        item_iter_ != items_end_ &&
+        limit_.ready(this)) {
+      spawn_one();
+    }
+    in_main_loop_ = false;
+
+    release_if_idle();
+  }
+
+  void item_done(bool keep_going, ErrorCode error, const Stamp &stamp=Stamp()) {
+    callbacks_outstanding_--;
+    limit_.item_done(error);
+    observer_.item_done(stamp, error);
+
+    if (stop_) {
+      // We've already been instructed to stop by some earlier callback.
+      release_if_idle();
+      return;
+    }
+
+    if (!keep_going) {
+      // If callback says to stop, then stop.  But don't ever set this variable back to
+      // false.
+      stop_ = true;
+    }
+
+    if (stop_ || (callbacks_outstanding_ == 0 && item_iter_ == items_end_)) {
+      // All done.
+      finish(error);
+    } else if (limit_.allows(callbacks_outstanding_)) {
+      // We'd spawned as many items as our limit allows.  Since this callback
+      // completed, we can spawn one more.  (With no limit, the main loop has already
+      // spawned every item, unless stopped, or held back by the limit policy.)
+      if (item_iter_ != items_end_) {
+        if (!in_main_loop_) {
+          // We're not inside the main loop, which means we are currently in an
+          // asynchronous callback.  Re-enter the main loop from here, rather than
+          // spawning a single item.  Items which complete synchronously then return to
+          // this loop, which spawns their successors, so the stack stays flat however
+          // many synchronous items follow this asynchronous one.  Otherwise, if we're
+          // inside the main loop, the next item will get spawned once this function
+          // returns.
+          run();
+        }
+      }
+    }
+  }
+
+  // Re-enters the main loop, once a limit policy which wasn't `ready` is.
+  void resume() {
+    if (!in_main_loop_) {
+      run();
+    }
+  }
+
+  // Stops the sequence, and invokes the final callback with `error` without waiting for
+  // the items in flight.  For when the caller's token is cancelled, or an item times out.
+  void abort(ErrorCode error) {
+    if (finished_) {
+      return;
+    }
+    stop_ = true;
+    finish(error);
+  }
+
+  bool stopped() const {
+    return stop_;
+  }
+
+private:
+  void finish(ErrorCode error) {
+    finished_ = true;
+
+    // Cancellation handlers may complete their items synchronously; don't let that
+    // release the state under us.
+    spawn_depth_++;
+    if (stop_ && cancellation_) {
+      // Tell the items still in flight that their results are no longer wanted.
+      cancellation_->cancel(error);
+    }
+    if (stop_) {
+      observer_.stopped(error);
+    }
+    observer_.finished(error);
+    final_callback_(error);
+    spawn_depth_--;
+
+    release_if_idle();
+  }
+
+  void spawn_one() {
+    callbacks_outstanding_++;
+    limit_.item_spawned();
+    Stamp stamp = observer_.item_spawned(item_index_, callbacks_outstanding_);
+
+    // Refer to the item in place; the callback decides whether to copy it.
+    auto &&item = *item_iter_;
+    bool is_last_item = item_iter_ == items_end_;
+    item_iter_++;
+    item_index_++;
+
+    // The callback may complete synchronously, and even finish the whole sequence.
+    // Don't let the state (which owns `callback_`) be released while it is running.
+    spawn_depth_++;
+    callback_(item, item_index_ - 1, is_last_item, CallbackDone(this, stamp));
+    spawn_depth_--;
+
+    release_if_idle();
+  }
+
+  // Once the final callback has run, the state is released when the last outstanding
+  // item reports back, and no loop or callback of ours is still on the stack.
+  void release_if_idle() {
+    if (finished_ && callbacks_outstanding_ == 0 && !in_main_loop_ && spawn_depth_ == 0) {
+      delete this;
+    }
+  }
+
+  TIter item_iter_;
+  TIter items_end_;
+  Limit limit_;
+  Observer observer_;
+  unsigned int item_index_ = 0;
+  unsigned int callbacks_outstanding_ = 0;
+  unsigned int spawn_depth_ = 0;
+  bool stop_ = false;
+  bool finished_ = false;
+  bool in_main_loop_ = false;
+  Callback callback_;
+  FinalCallback final_callback_;
+  std::shared_ptr<CancellationState> cancellation_;
+  CancellationToken external_token_;
+  CancellationRegistration external_registration_;
+};
+
+// Wraps a final callback, to own the `data` vector of a sequence which took it over.  It
+// is freed along with the sequencer state, since items still in flight refer to it.
+template<typename T, typename FinalCallback>
+class OwnedItemsFinalCallback {
+public:
+  OwnedItemsFinalCallback(FinalCallback &&final_callback, std::vector<T> *items)
+    : final_callback_(std::move(final_callback)), items_(items) {}
+
+  template<typename... Args>
+  void operator()(Args&&... args) {
+    final_callback_(std::forward<Args>(args)...);
+  }
+
+private:
+  FinalCallback final_callback_;
+  std::unique_ptr<std::vector<T>> items_;
+};
+
+template <typename TIter, typename Limit, typename Callback, typename FinalCallback,
+    typename Observer=NoObserver>
+void run_sequencer(TIter items_begin, TIter items_end,
+    Limit limit,
+    Callback callback,
+    FinalCallback final_callback,
+    const CancellationToken &token,
+    Observer observer=Observer()) {
 
   // If no items, invoke the final callback immediately with a success code.
   // This is easier than ensuring the complex logic below does the right thing for
   // an empty iterator.
   if (items_begin == items_end) {
-    final_callback(async::OK);
+    observer.finished(token.reason());
+    final_callback(token.reason());
     return;
   }
 
-  struct State {
-    std::shared_ptr<State> keep_alive;
-    TIter item_iter;
-    TIter items_end;
-    unsigned int limit;
-    unsigned int item_index = 0;
-    unsigned int callbacks_outstanding = 0;
-    bool stop = false;
-    bool in_main_loop;
-    std::function<void()> spawn_one;
+  auto state = new SequencerState<TIter, Callback, FinalCallback, Limit, Observer>(
+      items_begin, items_end, limit, std::move(callback), std::move(final_callback),
+      std::move(observer));
+  if (token.can_be_cancelled() || item_accepts_token<Callback>::value) {
+    state->enable_cancellation(token);
+  }
+  state->run();
+}
 
-    State() {
-      (*sequencer_state_count())++;
-    }
+}
 
-    ~State() {
-      (*sequencer_state_count())--;
-    }
-  };
-
-  auto state = std::make_shared<State>();
-
-  state->keep_alive = state;
-  state->item_iter = items_begin;
-  state->items_end = items_end;
-  state->limit = limit;
-
-  state->spawn_one = [callback, final_callback,
-      &items_end, state]() mutable {
-
-    state->callbacks_outstanding++;
-
-    auto item = *state->item_iter;
-    bool is_last_item = state->item_iter == state->items_end;
-    state->item_iter++;
-    state->item_index++;
-
-    callback(item, state->item_index - 1, is_last_item,
-        [final_callback, state] (bool keep_going, ErrorCode error) {
-
-          state->callbacks_outstanding--;
-
-          assert(state->limit == 0 || state->callbacks_outstanding < state->limit);
-
-          if (state->stop) {
-            // We've already been instructed to stop by some earlier callback.
-            return;
-          }
-
-          if (!keep_going) {
-            // If callback says to stop, then stop.  But don't ever set this variable back to
-            // false.
-            state->stop = true;
-          }
-
-          if (state->stop ||
-              (state->callbacks_outstanding == 0 && state->item_iter == state->items_end)) {
-            // All done.
-
-            final_callback(error);
-
-            // Break circular dependency, so state can release.
-            //
-            // The circular dependency is this:
-            //   The singular State object contains the spawn_one std::function /
-            //   lambda.  But that lambda captures `state` by value.  Because
-            //   `state` is a shared_ptr, the capture creates a new shared_ptr,
-            //   thereby incrementing the refcount of `state` by one.
-            //   So even when all variables naturally go out of scope, the `state`
-            //   object will still hold spawn_one, which holds `state`.
-            //
-            // Here we set spawn_one to an empty lambda, which clears the held
-            // shared_ptr to state.
-            //
-            // Note that it is not sufficient to reset the `state` shared_ptr here.
-            // That wouldn't break the circular ref.
-            state->spawn_one = [](){};
-
-            state->keep_alive.reset();
-          } else if (state->limit != 0 && state->callbacks_outstanding == state->limit - 1) {
-            // We'd spawned as many items as our limit allows.  Since this callback
-            // completed, we can spawn one more.
-            if (state->item_iter != state->items_end) {
-              if (!state->in_main_loop) {
-                // We're not inside the main loop, which means we are currently in an
-                // asynchronous callback.  Spawn the next item in the sequence directly
-                // from here.  Otherwise, if we're inside the main loop, the next item
-                // will get spawned once this function returns.
-                state->spawn_one();
-
-                // TODO: For better stack management, this should be a loop and not just a
-                // single spawn, applying the same logic to not spawn internally but from
-                // the parent loop.  This way, if an async callback contains a lot of sync tasks,
-                // we won't blow the stack.
-              }
-            }
-          }
-        });
-  };
+/**
+ * `limit` - the max number of items to process asynchronously.  If all items
+ *      invoke their completion callbacks synchronously, then `limit` has no
+ *      effect and the items proceed serially.  Set `limit` to 0 to indicate
+ *      no limit on max number of asynchronous outstanding items.
+ *
+ * `callback` is invoked as `callback(item, index, is_last_item, callback_done)`, and
+ * `final_callback` as `final_callback(error)`.  Both are taken as template parameters
+ * and stored by value, so lambdas and function objects are called directly rather than
+ * through std::function.  `callback_done` is a small function object which may be
+ * accepted generically, or as a `std::function<void(bool keep_going, ErrorCode error)>`.
+ *
+ * `token` - if cancelled, no more items are spawned, and `final_callback` is invoked
+ *      with the token's reason (usually `CANCELLED`) without waiting for the items in
+ *      flight.  Cancellation is only set up (at the cost of one more allocation) if
+ *      `token` can be cancelled, or if `callback` hands tokens on to its items; see
+ *      cancellation.hpp.
+ */
+template <typename T, typename TIter, typename Callback, typename FinalCallback>
+void sequencer(TIter items_begin, TIter items_end,
+    unsigned int limit,
+    Callback callback,
+    FinalCallback final_callback,
+    const CancellationToken &token=CancellationToken()) {
 
-  state->in_main_loop = true;
-  while ((state->limit == 0 || state->callbacks_outstanding < state->limit) &&
-      !state->stop &&
-      state->item_iter != state->items_end) {
-    state->spawn_one();
-  }
-  state->in_main_loop = false;
+  detail::run_sequencer(items_begin, items_end, detail::FixedLimit(limit),
+      std::move(callback), std::move(final_callback), token);
 }
 
 }
@@ -13,11 +13,12 @@ namespace async {
 
 // `tasks` and `final_callback` are passed by reference.  It is the responsibility of the
 // caller to ensure that their lifetime exceeds the lifetime of the series call.
-template<typename T>
-void series(std::vector<Task<T>> &tasks,
-    const TaskCompletionCallback<T> &final_callback=noop_task_final_callback<T>) {
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void series(std::vector<TTask> &tasks,
+    const FinalCallback &final_callback=noop_task_final_callback<T>,
+    const CancellationToken &token=CancellationToken()) {
 
-  parallel_limit(tasks, 1, final_callback);
+  parallel_limit<T>(tasks, 1, final_callback, token);
 }
 
 }
@@ -0,0 +1,160 @@
+#pragma once
+
+#ifndef ASYNC_THREAD_POOL_HPP
+#define ASYNC_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace async {
+
+/**
+   A work-stealing thread pool.  It is an Executor (see executor.hpp).
+
+   Each worker thread has its own deque of work.  Work posted from a worker goes on the
+   back of that worker's deque, and the worker takes from the back, so related work tends
+   to stay on one thread while its data is still in cache.  Work posted from any other
+   thread is dealt out to the workers in turn.  A worker whose deque is empty steals from
+   the front of the others' deques, and sleeps only when there is no work anywhere.
+
+   The destructor runs all work already posted, then joins the threads.
+ */
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned int thread_count=std::thread::hardware_concurrency()) {
+    if (thread_count == 0) {
+      thread_count = 1;
+    }
+
+    for (unsigned int i = 0; i < thread_count; i++) {
+      workers_.emplace_back(new Worker());
+    }
+    for (unsigned int i = 0; i < thread_count; i++) {
+      threads_.emplace_back([this, i]() { run(i); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  template <typename F>
+  void post(F f) {
+    unsigned int index = current_pool() == this ?
+        current_worker() : next_worker_.fetch_add(1, std::memory_order_relaxed) % size();
+
+    // Counted before it's queued, so that a worker can't take it and decrement the count
+    // first.
+    pending_.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+      workers_[index]->work.emplace_back(std::move(f));
+    }
+
+    if (sleeping_.load() > 0) {
+      // Taking the lock orders this wake-up after a sleeper's last check of `pending_`.
+      { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+      wake_.notify_one();
+    }
+  }
+
+  unsigned int size() const {
+    return workers_.size();
+  }
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> work;
+  };
+
+  static ThreadPool *&current_pool() {
+    static thread_local ThreadPool *pool = nullptr;
+    return pool;
+  }
+
+  static unsigned int &current_worker() {
+    static thread_local unsigned int index = 0;
+    return index;
+  }
+
+  void run(unsigned int index) {
+    current_pool() = this;
+    current_worker() = index;
+
+    std::function<void()> work;
+    for (;;) {
+      if (take(index, work)) {
+        work();
+        work = nullptr;
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      sleeping_.fetch_add(1);
+      wake_.wait(lock, [this]() { return pending_.load() != 0 || stopping_; });
+      sleeping_.fetch_sub(1);
+
+      if (stopping_ && pending_.load() == 0) {
+        return;
+      }
+    }
+  }
+
+  // Pops from the back of our own deque, or else steals from the front of another's.
+  bool take(unsigned int index, std::function<void()> &work) {
+    {
+      Worker &own = *workers_[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.work.empty()) {
+        work = std::move(own.work.back());
+        own.work.pop_back();
+        pending_.fetch_sub(1);
+        return true;
+      }
+    }
+
+    for (unsigned int i = 1; i < size(); i++) {
+      Worker &victim = *workers_[(index + i) % size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.work.empty()) {
+        work = std::move(victim.work.front());
+        victim.work.pop_front();
+        pending_.fetch_sub(1);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic<unsigned int> next_worker_ { 0 };
+  std::atomic<unsigned int> pending_ { 0 };
+  std::atomic<unsigned int> sleeping_ { 0 };
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+};
+
+}
+
+#endif
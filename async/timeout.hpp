@@ -0,0 +1,262 @@
+#pragma once
+
+#ifndef ASYNC_TIMEOUT_HPP
+#define ASYNC_TIMEOUT_HPP
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "async.hpp"
+#include "timing_wheel.hpp"
+
+namespace async {
+
+/**
+   Timeouts for `map`, `each`, `parallel_limit`, `parallel` and `series`, passed after
+   their usual arguments:
+
+     async::map<int>(data, func, final_callback, limit,
+         async::Timeouts(wheel, std::chrono::milliseconds(100), std::chrono::seconds(5)));
+
+   `task_timeout` limits how long each task may take, and `deadline` how long the whole
+   operation may take; zero means no limit.  When either expires, the operation stops, and
+   `final_callback` is invoked with `TIMEOUT` straight away.  As when a task fails, tasks
+   still in flight are not interrupted, but tasks which accept a CancellationToken see it
+   cancelled, with reason `TIMEOUT`.  They must still invoke their callbacks eventually.
+
+   All timers go through `wheel`, so arming and disarming one per task is cheap, and only
+   one asio timer is used however many tasks are in flight.  Since the wheel is not
+   thread-safe, there are no `concurrent` or executor variants.
+ */
+class Timeouts {
+public:
+  typedef TimingWheel::Clock::duration Duration;
+
+  Timeouts(TimingWheel &wheel, Duration task_timeout, Duration deadline=Duration::zero())
+    : wheel_(&wheel), task_timeout_(task_timeout), deadline_(deadline) {}
+
+  TimingWheel &wheel() const {
+    return *wheel_;
+  }
+
+  Duration task_timeout() const {
+    return task_timeout_;
+  }
+
+  Duration deadline() const {
+    return deadline_;
+  }
+
+private:
+  TimingWheel *wheel_;
+  Duration task_timeout_;
+  Duration deadline_;
+};
+
+namespace detail {
+
+// Wraps an item's `callback_done`, to disarm the item's timer when it reports back.
+template<typename CallbackDone>
+class TimedCallbackDone {
+public:
+  TimedCallbackDone(CallbackDone callback_done, TimingWheel *wheel, TimerHandle timer)
+    : callback_done_(callback_done), wheel_(wheel), timer_(timer) {}
+
+  void operator()(bool keep_going, ErrorCode error) const {
+    wheel_->cancel(timer_);
+    callback_done_(keep_going, error);
+  }
+
+  void abort(ErrorCode error) const {
+    callback_done_.abort(error);
+  }
+
+  const std::shared_ptr<CancellationState> &cancellation() const {
+    return callback_done_.cancellation();
+  }
+
+private:
+  CallbackDone callback_done_;
+  TimingWheel *wheel_;
+  TimerHandle timer_;
+};
+
+// Wraps a sequencer callback, arming a timer for each item.  If the item hasn't reported
+// back when the timer fires, the sequence is aborted with TIMEOUT.
+template<typename Callback>
+class TimeoutItemCallback {
+public:
+  static const bool accepts_token = item_accepts_token<Callback>::value;
+
+  TimeoutItemCallback(Callback &&callback, const Timeouts &timeouts)
+    : callback_(std::move(callback)),
+      wheel_(&timeouts.wheel()),
+      timeout_(timeouts.task_timeout()) {}
+
+  template<typename TItem, typename CallbackDone>
+  void operator()(TItem &item, int index, bool is_last_item, CallbackDone callback_done) {
+    if (timeout_ == Timeouts::Duration::zero()) {
+      callback_(item, index, is_last_item, callback_done);
+      return;
+    }
+
+    TimerHandle timer = wheel_->schedule(timeout_, [callback_done]() {
+          callback_done.abort(TIMEOUT);
+        });
+    callback_(item, index, is_last_item,
+        TimedCallbackDone<CallbackDone>(callback_done, wheel_, timer));
+  }
+
+private:
+  Callback callback_;
+  TimingWheel *wheel_;
+  Timeouts::Duration timeout_;
+};
+
+// The deadline for a whole operation.  It hands the sequencer a token which is cancelled
+// with TIMEOUT when the deadline passes, or with the caller's reason when the caller's
+// token is cancelled.
+class Deadline {
+public:
+  Deadline(const Timeouts &timeouts, const CancellationToken &token)
+    : wheel_(&timeouts.wheel()), token_(token) {
+    if (timeouts.deadline() == Timeouts::Duration::zero()) {
+      return;
+    }
+
+    CancellationSource source;
+    token_ = source.token();
+    link_ = token.on_cancel([source, token]() mutable { source.cancel(token.reason()); });
+    timer_ = wheel_->schedule(timeouts.deadline(), [source]() mutable {
+          source.cancel(TIMEOUT);
+        });
+  }
+
+  const CancellationToken &token() const {
+    return token_;
+  }
+
+  void disarm() {
+    wheel_->cancel(timer_);
+    link_.reset();
+  }
+
+private:
+  TimingWheel *wheel_;
+  TimerHandle timer_;
+  CancellationToken token_;
+  CancellationRegistration link_;
+};
+
+// Wraps a final callback, to disarm the deadline once the operation finishes.
+template<typename FinalCallback>
+class DeadlineFinalCallback {
+public:
+  DeadlineFinalCallback(FinalCallback &&final_callback, const Deadline &deadline)
+    : final_callback_(std::move(final_callback)), deadline_(deadline) {}
+
+  template<typename... Args>
+  void operator()(Args&&... args) {
+    deadline_.disarm();
+    final_callback_(std::forward<Args>(args)...);
+  }
+
+private:
+  FinalCallback final_callback_;
+  Deadline deadline_;
+};
+
+template<typename T, typename TIter, typename Callback, typename FinalCallback>
+void timed_sequencer(TIter items_begin, TIter items_end,
+    unsigned int limit,
+    Callback callback,
+    FinalCallback final_callback,
+    const Timeouts &timeouts,
+    const CancellationToken &token) {
+
+  Deadline deadline(timeouts, token);
+  sequencer<T>
+      (items_begin, items_end, limit,
+          TimeoutItemCallback<Callback>(std::move(callback), timeouts),
+          DeadlineFinalCallback<FinalCallback>(std::move(final_callback), deadline),
+          deadline.token());
+}
+
+}
+
+// Same as `async::map`, with timeouts.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
+void map(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    unsigned int task_limit,
+    const Timeouts &timeouts,
+    const CancellationToken &token=CancellationToken()) {
+
+  std::vector<T>* results = new std::vector<T>(data.size());
+
+  detail::timed_sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::MapItemCallback<T, Func>(std::move(func), results),
+          detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+          timeouts, token);
+}
+
+// Same as `async::each`, with timeouts.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    unsigned int task_limit,
+    const Timeouts &timeouts,
+    const CancellationToken &token=CancellationToken()) {
+
+  detail::timed_sequencer<T>
+      (data.begin(), data.end(), task_limit,
+          detail::EachItemCallback<T, Func>(std::move(func)),
+          typename std::decay<FinalCallback>::type(final_callback),
+          timeouts, token);
+}
+
+// Same as `async::parallel_limit`, with timeouts.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(std::vector<TTask> &tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback,
+    const Timeouts &timeouts,
+    const CancellationToken &token=CancellationToken()) {
+
+  auto results = new detail::ResultSlots<T>(tasks.size());
+
+  detail::timed_sequencer<TTask>
+      (tasks.begin(), tasks.end(), limit,
+          detail::ParallelSlotItemCallback<T, TTask>(results),
+          detail::ParallelFinalCallback<detail::ResultSlots<T>, FinalCallback>(
+              final_callback, results),
+          timeouts, token);
+}
+
+// Same as `async::parallel`, with timeouts.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel(std::vector<TTask> &tasks,
+    const FinalCallback &final_callback,
+    const Timeouts &timeouts,
+    const CancellationToken &token=CancellationToken()) {
+
+  parallel_limit<T>(tasks, 0, final_callback, timeouts, token);
+}
+
+// Same as `async::series`, with timeouts.  The task timeout applies to each task in turn.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void series(std::vector<TTask> &tasks,
+    const FinalCallback &final_callback,
+    const Timeouts &timeouts,
+    const CancellationToken &token=CancellationToken()) {
+
+  parallel_limit<T>(tasks, 1, final_callback, timeouts, token);
+}
+
+}
+
+#endif
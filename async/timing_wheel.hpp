@@ -0,0 +1,281 @@
+#pragma once
+
+#ifndef ASYNC_TIMING_WHEEL_HPP
+#define ASYNC_TIMING_WHEEL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace async {
+
+/**
+   Identifies a timer scheduled on a TimingWheel.  A default-constructed handle refers to
+   no timer.  Cancelling a handle whose timer has already fired, or been cancelled, does
+   nothing.
+ */
+class TimerHandle {
+public:
+  TimerHandle() = default;
+
+private:
+  friend class TimingWheel;
+
+  TimerHandle(uint32_t index, uint32_t generation) : index_(index), generation_(generation) {}
+
+  uint32_t index_ = 0;
+  uint32_t generation_ = 0;
+};
+
+/**
+   Many timers, multiplexed onto a single `boost::asio::steady_timer`.
+
+   Timers are kept in a hierarchical timing wheel: four levels of 256 slots, each level's
+   slot spanning 256 slots of the level below.  Scheduling a timer links it into one slot,
+   and cancelling it unlinks it, both in constant time; as time passes, the timers in a
+   coarse slot are redistributed into the finer levels below.  Timer nodes are recycled,
+   so once the wheel has grown to its working size, scheduling does not allocate, as long
+   as the handler fits in std::function's small-object buffer.
+
+   Timers fire with a resolution of one `tick`, never early.  Delays beyond 2^32 ticks are
+   clamped.
+
+   Not thread-safe: schedule and cancel timers from the thread running the io_service.
+   The wheel must outlive the timers scheduled on it.
+ */
+class TimingWheel {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  explicit TimingWheel(boost::asio::io_service &io_service,
+      Clock::duration tick=std::chrono::milliseconds(1))
+    : timer_(io_service), tick_(tick), start_(Clock::now()) {
+    for (auto &head : heads_) {
+      head = kNil;
+    }
+  }
+
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  // Invokes `handler` from the io_service once `delay` has passed.
+  TimerHandle schedule(Clock::duration delay, std::function<void()> handler) {
+    if (size_ == 0) {
+      // The wheel may have been idle for a while; catch up, without stepping through
+      // every tick.
+      current_tick_ = std::max(current_tick_, now_tick());
+    }
+
+    uint32_t index = allocate();
+    Node &node = nodes_[index];
+    node.handler = std::move(handler);
+
+    // Round up, both the delay and the current time, so that a timer never fires early.
+    uint64_t delay_ticks = delay.count() <= 0 ? 0 : (delay + tick_ - Clock::duration(1)) / tick_;
+    node.expiry = std::max(now_tick() + 1 + delay_ticks, current_tick_ + 1);
+
+    link(index);
+    size_++;
+    arm();
+
+    return TimerHandle(index, node.generation);
+  }
+
+  // Returns true if the timer was still pending.
+  bool cancel(TimerHandle handle) {
+    if (handle.generation_ == 0 || handle.index_ >= nodes_.size()) {
+      return false;
+    }
+    Node &node = nodes_[handle.index_];
+    if (node.generation != handle.generation_ || node.slot == kNil) {
+      return false;
+    }
+
+    unlink(handle.index_);
+    release(handle.index_);
+    size_--;
+    return true;
+  }
+
+  // The number of pending timers.
+  size_t size() const {
+    return size_;
+  }
+
+private:
+  static const int kLevels = 4;
+  static const int kSlotBits = 8;
+  static const uint32_t kSlots = 1 << kSlotBits;
+  static const uint32_t kSlotMask = kSlots - 1;
+  static const uint32_t kNil = UINT32_MAX;
+
+  struct Node {
+    std::function<void()> handler;
+    uint64_t expiry = 0;
+    uint32_t prev = kNil;
+    uint32_t next = kNil;
+    // The slot the node is linked into, or kNil if free or firing.
+    uint32_t slot = kNil;
+    // Bumped each time the node is recycled, to invalidate old handles.
+    uint32_t generation = 1;
+  };
+
+  uint64_t now_tick() const {
+    return (Clock::now() - start_) / tick_;
+  }
+
+  uint32_t allocate() {
+    if (free_ != kNil) {
+      uint32_t index = free_;
+      free_ = nodes_[index].next;
+      return index;
+    }
+    nodes_.emplace_back();
+    return nodes_.size() - 1;
+  }
+
+  void release(uint32_t index) {
+    Node &node = nodes_[index];
+    node.handler = nullptr;
+    node.generation++;
+    node.slot = kNil;
+    node.next = free_;
+    free_ = index;
+  }
+
+  // Links a node into the finest level whose range covers its expiry.
+  void link(uint32_t index) {
+    Node &node = nodes_[index];
+    uint64_t delta = node.expiry - current_tick_;
+    if (delta >> (kSlotBits * kLevels)) {
+      node.expiry = current_tick_ + (uint64_t(1) << (kSlotBits * kLevels)) - 1;
+      delta = node.expiry - current_tick_;
+    }
+
+    int level = 0;
+    while (level < kLevels - 1 && (delta >> (kSlotBits * (level + 1))) != 0) {
+      level++;
+    }
+    uint32_t slot = level * kSlots + ((node.expiry >> (kSlotBits * level)) & kSlotMask);
+
+    node.slot = slot;
+    node.prev = kNil;
+    node.next = heads_[slot];
+    if (node.next != kNil) {
+      nodes_[node.next].prev = index;
+    }
+    heads_[slot] = index;
+    if (level == 0) {
+      level0_size_++;
+    }
+  }
+
+  void unlink(uint32_t index) {
+    Node &node = nodes_[index];
+    if (node.prev != kNil) {
+      nodes_[node.prev].next = node.next;
+    } else {
+      heads_[node.slot] = node.next;
+    }
+    if (node.next != kNil) {
+      nodes_[node.next].prev = node.prev;
+    }
+    if (node.slot < kSlots) {
+      level0_size_--;
+    }
+    node.slot = kNil;
+  }
+
+  // Moves every node in a coarse slot down to the finer levels.
+  void cascade(int level) {
+    uint32_t slot = level * kSlots + ((current_tick_ >> (kSlotBits * level)) & kSlotMask);
+    uint32_t index = heads_[slot];
+    heads_[slot] = kNil;
+    while (index != kNil) {
+      uint32_t next = nodes_[index].next;
+      link(index);
+      index = next;
+    }
+  }
+
+  // Advances the wheel by one tick, and fires the timers which expire on it.
+  void step() {
+    current_tick_++;
+    for (int level = 1; level < kLevels; level++) {
+      if ((current_tick_ & ((uint64_t(1) << (kSlotBits * level)) - 1)) != 0) {
+        break;
+      }
+      cascade(level);
+    }
+
+    uint32_t slot = current_tick_ & kSlotMask;
+    while (heads_[slot] != kNil) {
+      uint32_t index = heads_[slot];
+      unlink(index);
+      size_--;
+
+      // The handler may schedule more timers, and so grow `nodes_`.
+      std::function<void()> handler = std::move(nodes_[index].handler);
+      release(index);
+      handler();
+    }
+  }
+
+  // Keeps the asio timer waiting for the next tick which has work to do: the next tick,
+  // if any timer is in the finest level, or else the next cascade.
+  void arm() {
+    if (size_ == 0) {
+      return;
+    }
+
+    uint64_t wake_tick = level0_size_ != 0 ?
+        current_tick_ + 1 : ((current_tick_ >> kSlotBits) + 1) << kSlotBits;
+    if (armed_ && wake_tick_ <= wake_tick) {
+      return;
+    }
+
+    // Re-arming cancels any earlier wait, whose handler then sees operation_aborted.
+    armed_ = true;
+    wake_tick_ = wake_tick;
+    timer_.expires_at(start_ + wake_tick * tick_);
+    timer_.async_wait([this](const boost::system::error_code &error) {
+          if (error == boost::asio::error::operation_aborted) {
+            return;
+          }
+          armed_ = false;
+
+          uint64_t target = now_tick();
+          while (current_tick_ < target && size_ != 0) {
+            step();
+          }
+          if (size_ == 0) {
+            // Nothing to wait for, so skip straight to the present.
+            current_tick_ = std::max(current_tick_, target);
+          }
+          arm();
+        });
+  }
+
+  boost::asio::steady_timer timer_;
+  Clock::duration tick_;
+  Clock::time_point start_;
+  uint64_t current_tick_ = 0;
+  uint64_t wake_tick_ = 0;
+  bool armed_ = false;
+  size_t size_ = 0;
+  size_t level0_size_ = 0;
+  uint32_t free_ = kNil;
+  uint32_t heads_[kLevels * kSlots];
+  std::vector<Node> nodes_;
+};
+
+}
+
+#endif
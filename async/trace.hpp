@@ -0,0 +1,434 @@
+#pragma once
+
+#ifndef ASYNC_TRACE_HPP
+#define ASYNC_TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "each.hpp"
+#include "map.hpp"
+#include "parallel.hpp"
+#include "sequencer.hpp"
+
+namespace async {
+
+/**
+   Names the spans of a traced sequence, passed after the usual arguments, as Metrics
+   are:
+
+     async::series<int>(steps, final_callback, async::Trace("fetch"));
+
+   `label` must outlive the trace: a string literal is best.
+ */
+struct Trace {
+  explicit Trace(const char *label) : label(label) {}
+
+  const char *label;
+};
+
+namespace detail {
+
+// One item, from its spawn to its report.
+struct Span {
+  uint64_t begin;
+  uint64_t end;
+  const char *label;
+  const char *combinator;
+  uint32_t index;
+  int32_t error;
+  uint32_t begin_thread;
+  uint32_t end_thread;
+};
+
+/**
+   The spans completed on one thread, most recent last.  Only that thread writes to it,
+   so recording takes no lock, just a few relaxed stores; once full, the oldest span is
+   overwritten.  Each slot has a sequence number, which is odd while it is being written:
+   a reader which sees it change, or odd, skips the slot.
+ */
+class SpanBuffer {
+public:
+  explicit SpanBuffer(size_t capacity)
+    : slots_(new Slot[capacity]), capacity_(capacity) {
+    for (size_t i = 0; i < capacity; i++) {
+      slots_[i].sequence.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void push(const Span &span) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    Slot &slot = slots_[head % capacity_];
+    slot.sequence.store(2 * head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.begin.store(span.begin, std::memory_order_relaxed);
+    slot.end.store(span.end, std::memory_order_relaxed);
+    slot.label.store(span.label, std::memory_order_relaxed);
+    slot.combinator.store(span.combinator, std::memory_order_relaxed);
+    slot.index.store(span.index, std::memory_order_relaxed);
+    slot.error.store(span.error, std::memory_order_relaxed);
+    slot.begin_thread.store(span.begin_thread, std::memory_order_relaxed);
+    slot.end_thread.store(span.end_thread, std::memory_order_relaxed);
+
+    slot.sequence.store(2 * head + 2, std::memory_order_release);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Appends the spans still held to `spans`, oldest first.  Safe to call while the owning
+  // thread records.
+  void read(std::vector<Span> &spans) const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t first = head > capacity_ ? head - capacity_ : 0;
+    for (uint64_t position = first; position < head; position++) {
+      const Slot &slot = slots_[position % capacity_];
+      uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence != 2 * position + 2) {
+        continue;
+      }
+
+      Span span;
+      span.begin = slot.begin.load(std::memory_order_relaxed);
+      span.end = slot.end.load(std::memory_order_relaxed);
+      span.label = slot.label.load(std::memory_order_relaxed);
+      span.combinator = slot.combinator.load(std::memory_order_relaxed);
+      span.index = slot.index.load(std::memory_order_relaxed);
+      span.error = slot.error.load(std::memory_order_relaxed);
+      span.begin_thread = slot.begin_thread.load(std::memory_order_relaxed);
+      span.end_thread = slot.end_thread.load(std::memory_order_relaxed);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+        spans.push_back(span);
+      }
+    }
+  }
+
+  // Forgets the spans held, by marking every slot unwritten.
+  void clear() {
+    for (size_t i = 0; i < capacity_; i++) {
+      slots_[i].sequence.store(0, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> begin;
+    std::atomic<uint64_t> end;
+    std::atomic<const char*> label;
+    std::atomic<const char*> combinator;
+    std::atomic<uint32_t> index;
+    std::atomic<int32_t> error;
+    std::atomic<uint32_t> begin_thread;
+    std::atomic<uint32_t> end_thread;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t capacity_;
+  std::atomic<uint64_t> head_ { 0 };
+};
+
+class TraceObserver;
+
+}
+
+class Tracer;
+inline Tracer &tracer();
+
+/**
+   Collects the spans of traced sequences, and writes them out in Chrome's trace-event
+   format, to load into Perfetto (ui.perfetto.dev) or chrome://tracing.  Each item of a
+   traced sequence is a span from its spawn to its report, named for the sequence's
+   label and the item's index, with the combinator, the error, and the threads it began
+   and ended on.  Items in flight at once show as overlapping spans, so a slow step, or a
+   `parallel_limit` slot held by a slow task, stands out.
+
+     async::tracer().start();
+     ...
+     async::tracer().write_chrome_trace(file);
+
+   Nothing is recorded until `start()`.  While stopped, a traced sequence costs a relaxed
+   load per item; while started, two clock reads and a few stores into the ring buffer
+   of the thread the item reports back on.  Each thread's buffer is allocated the first
+   time it records, and holds its last `buffer_spans()` spans.
+ */
+class Tracer {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  void start() {
+    enabled_.store(true, std::memory_order_relaxed);
+  }
+
+  void stop() {
+    enabled_.store(false, std::memory_order_relaxed);
+  }
+
+  bool enabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  size_t buffer_spans() const {
+    return buffer_spans_;
+  }
+
+  // Only affects the buffers of threads which haven't yet recorded.
+  void set_buffer_spans(size_t spans) {
+    buffer_spans_ = std::max(spans, size_t(1));
+  }
+
+  // Forgets the spans recorded so far.  Only while no thread records.
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &buffer : buffers_) {
+      buffer->clear();
+    }
+  }
+
+  // Writes every span held as a JSON trace, with an async begin and end event per span.
+  void write_chrome_trace(std::ostream &out) const {
+    std::vector<detail::Span> spans;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto &buffer : buffers_) {
+        buffer->read(spans);
+      }
+    }
+    std::sort(spans.begin(), spans.end(), [](const detail::Span &a, const detail::Span &b) {
+          return a.begin < b.begin;
+        });
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    unsigned long id = 0;
+    for (const detail::Span &span : spans) {
+      out << (id == 0 ? "\n" : ",\n");
+      id++;
+      write_event(out, span, 'b', id, span.begin, span.begin_thread);
+      out << ",\n";
+      write_event(out, span, 'e', id, span.end, span.end_thread);
+    }
+    out << "\n]}\n";
+  }
+
+private:
+  friend class detail::TraceObserver;
+  friend Tracer &tracer();
+
+  // There is only the one, from `async::tracer()`, since each thread has one buffer.
+  Tracer() : epoch_(Clock::now()) {}
+
+  uint64_t now() const {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - epoch_).count()) + 1;
+  }
+
+  // The buffer of the calling thread.
+  detail::SpanBuffer &buffer() {
+    static thread_local std::shared_ptr<detail::SpanBuffer> buffer;
+    if (!buffer) {
+      buffer = std::make_shared<detail::SpanBuffer>(buffer_spans_);
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_.push_back(buffer);
+    }
+    return *buffer;
+  }
+
+  // A small number for the calling thread, as the trace's `tid`.
+  static uint32_t thread_id() {
+    static std::atomic<uint32_t> next_id { 1 };
+    static thread_local uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+    return id;
+  }
+
+  static void write_event(std::ostream &out, const detail::Span &span, char phase,
+      unsigned long id, uint64_t nanoseconds, uint32_t thread) {
+    out << "{\"name\":\"";
+    write_escaped(out, span.label);
+    out << " " << span.index << "\",\"cat\":\"" << span.combinator << "\",\"ph\":\"" << phase
+        << "\",\"id\":" << id << ",\"ts\":" << nanoseconds / 1000 << "."
+        << char('0' + nanoseconds / 100 % 10) << char('0' + nanoseconds / 10 % 10)
+        << char('0' + nanoseconds % 10)
+        << ",\"pid\":1,\"tid\":" << thread << ",\"args\":{";
+    if (phase == 'b') {
+      out << "\"index\":" << span.index;
+    } else {
+      out << "\"error\":" << span.error;
+    }
+    out << "}}";
+  }
+
+  static void write_escaped(std::ostream &out, const char *string) {
+    for (const char *c = string; *c; c++) {
+      if (*c == '"' || *c == '\\') {
+        out << '\\' << *c;
+      } else if (static_cast<unsigned char>(*c) >= 0x20) {
+        out << *c;
+      }
+    }
+  }
+
+  Clock::time_point epoch_;
+  std::atomic<bool> enabled_ { false };
+  size_t buffer_spans_ = 8192;
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<detail::SpanBuffer>> buffers_;
+};
+
+// The tracer, which every traced sequence records into.
+inline Tracer &tracer() {
+  static Tracer tracer;
+  return tracer;
+}
+
+namespace detail {
+
+// Records one sequence's items into the tracer, while it is started.  A span begun while
+// it was stopped is dropped.
+class TraceObserver {
+public:
+  struct Stamp {
+    uint64_t begin;
+    uint32_t index;
+    uint32_t thread;
+  };
+
+  TraceObserver(const Trace &trace, const char *combinator)
+    : label_(trace.label), combinator_(combinator) {}
+
+  Stamp item_spawned(unsigned int index, unsigned int outstanding) {
+    Tracer &tracer = async::tracer();
+    if (!tracer.enabled()) {
+      return Stamp { 0, index, 0 };
+    }
+    return Stamp { tracer.now(), index, Tracer::thread_id() };
+  }
+
+  void item_done(const Stamp &stamp, ErrorCode error) {
+    if (stamp.begin == 0) {
+      return;
+    }
+    Tracer &tracer = async::tracer();
+    Span span = { stamp.begin, tracer.now(), label_, combinator_, stamp.index, error,
+        stamp.thread, Tracer::thread_id() };
+    tracer.buffer().push(span);
+  }
+
+  void stopped(ErrorCode error) {}
+
+  void finished(ErrorCode error) {}
+
+private:
+  const char *label_;
+  const char *combinator_;
+};
+
+template<typename T, typename TTask, typename FinalCallback>
+void traced_parallel_limit(std::vector<TTask> &tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback,
+    const Trace &trace,
+    const char *combinator,
+    const CancellationToken &token) {
+
+  auto results = new ResultSlots<T>(tasks.size());
+
+  run_sequencer(tasks.begin(), tasks.end(), FixedLimit(limit),
+      ParallelSlotItemCallback<T, TTask>(results),
+      ParallelFinalCallback<ResultSlots<T>, FinalCallback>(final_callback, results),
+      token, TraceObserver(trace, combinator));
+}
+
+}
+
+// Same as `async::sequencer`, tracing each item; see Tracer.
+template <typename T, typename TIter, typename Callback, typename FinalCallback>
+void sequencer(TIter items_begin, TIter items_end,
+    unsigned int limit,
+    Callback callback,
+    FinalCallback final_callback,
+    const Trace &trace,
+    const CancellationToken &token=CancellationToken()) {
+
+  detail::run_sequencer(items_begin, items_end, detail::FixedLimit(limit),
+      std::move(callback), std::move(final_callback), token,
+      detail::TraceObserver(trace, "sequencer"));
+}
+
+// Same as `async::map`, tracing each item.
+template<typename T, typename Func, typename FinalCallback=TaskCompletionCallback<T>>
+void map(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    unsigned int task_limit,
+    const Trace &trace,
+    const CancellationToken &token=CancellationToken()) {
+
+  std::vector<T>* results = new std::vector<T>(data.size());
+
+  detail::run_sequencer(data.begin(), data.end(), detail::FixedLimit(task_limit),
+      detail::MapItemCallback<T, Func>(std::move(func), results),
+      detail::MapFinalCallback<T, FinalCallback>(final_callback, results),
+      token, detail::TraceObserver(trace, "map"));
+}
+
+// Same as `async::each`, tracing each item.
+template<typename T, typename Func, typename FinalCallback=ErrorCodeCallback>
+void each(std::vector<T> &data,
+    Func func,
+    const FinalCallback &final_callback,
+    unsigned int task_limit,
+    const Trace &trace,
+    const CancellationToken &token=CancellationToken()) {
+
+  detail::run_sequencer(data.begin(), data.end(), detail::FixedLimit(task_limit),
+      detail::EachItemCallback<T, Func>(std::move(func)),
+      typename std::decay<FinalCallback>::type(final_callback),
+      token, detail::TraceObserver(trace, "each"));
+}
+
+// Same as `async::parallel_limit`, tracing each task.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel_limit(std::vector<TTask> &tasks,
+    unsigned int limit,
+    const FinalCallback &final_callback,
+    const Trace &trace,
+    const CancellationToken &token=CancellationToken()) {
+
+  detail::traced_parallel_limit<T>(tasks, limit, final_callback, trace, "parallel_limit",
+      token);
+}
+
+// Same as `async::parallel`, tracing each task.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void parallel(std::vector<TTask> &tasks,
+    const FinalCallback &final_callback,
+    const Trace &trace,
+    const CancellationToken &token=CancellationToken()) {
+
+  detail::traced_parallel_limit<T>(tasks, 0, final_callback, trace, "parallel", token);
+}
+
+// Same as `async::series`, tracing each task.
+template<typename T, typename TTask=Task<T>, typename FinalCallback=TaskCompletionCallback<T>>
+void series(std::vector<TTask> &tasks,
+    const FinalCallback &final_callback,
+    const Trace &trace,
+    const CancellationToken &token=CancellationToken()) {
+
+  detail::traced_parallel_limit<T>(tasks, 1, final_callback, trace, "series", token);
+}
+
+}
+
+#endif
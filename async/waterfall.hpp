@@ -0,0 +1,213 @@
+#pragma once
+
+#ifndef ASYNC_WATERFALL_HPP
+#define ASYNC_WATERFALL_HPP
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "cancellation.hpp"
+#include "parallel_tuple.hpp"
+#include "result_slots.hpp"
+
+namespace async {
+
+namespace detail {
+
+/**
+   The result type of a waterfall step: the R of the TaskCallback<R> it accepts, as its
+   last parameter.  The first step takes only the callback, and each later step takes
+   the previous step's result first.
+ */
+template<typename Step>
+struct step_result : step_result<decltype(&Step::operator())> {};
+
+template<typename Callback>
+struct step_result<void (*)(Callback)>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename Input, typename Callback>
+struct step_result<void (*)(Input, Callback)>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename C, typename Callback>
+struct step_result<void (C::*)(Callback)>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename C, typename Input, typename Callback>
+struct step_result<void (C::*)(Input, Callback)>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename C, typename Callback>
+struct step_result<void (C::*)(Callback) const>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename C, typename Input, typename Callback>
+struct step_result<void (C::*)(Input, Callback) const>
+  : callback_result<typename std::decay<Callback>::type> {};
+
+template<typename State, size_t I>
+class WaterfallStepCallback {
+public:
+  explicit WaterfallStepCallback(State *state) : state_(state) {}
+
+  void operator()(ErrorCode error, typename State::template Result<I> result) const {
+    state_->template step_done<I>(error, std::move(result));
+  }
+
+private:
+  State *state_;
+};
+
+/**
+   Everything a waterfall needs, in one allocation: the steps, a ResultSlot per step,
+   and the final callback.  Each result is moved into its slot, and then out of it into
+   the next step.
+
+   As in the sequencer, a step is never started from the previous step's callback.  A
+   callback which arrives while the loop in `run()` is on the stack just marks the step
+   done, and the loop starts the next, so steps completing synchronously don't deepen
+   the stack.
+ */
+template<typename FinalCallback, typename... Steps>
+class WaterfallState {
+public:
+  template<size_t I>
+  using Result = typename step_result<
+      typename std::tuple_element<I, std::tuple<Steps...>>::type>::type;
+
+  static const size_t kSteps = sizeof...(Steps);
+
+  static_assert(sizeof...(Steps) > 0, "a waterfall needs a step");
+
+  WaterfallState(std::tuple<Steps...> &&steps, const FinalCallback &final_callback,
+      const CancellationToken &token)
+    : steps_(std::move(steps)), final_callback_(final_callback), token_(token) {}
+
+  void run() {
+    in_loop_ = true;
+    while (!outstanding_ && error_ == OK && next_ < kSteps) {
+      if (token_.is_cancelled()) {
+        error_ = token_.reason();
+        break;
+      }
+      outstanding_ = true;
+      spawn(next_++, typename MakeIndexSequence<sizeof...(Steps)>::type());
+    }
+    in_loop_ = false;
+
+    if (!outstanding_) {
+      finish();
+    }
+  }
+
+  template<size_t I>
+  void step_done(ErrorCode error, Result<I> &&result) {
+    if (!outstanding_ || next_ != I + 1) {
+      // The step invoked its callback twice.
+      return;
+    }
+    std::get<I>(slots_).set(std::move(result));
+    error_ = error;
+    outstanding_ = false;
+    if (!in_loop_) {
+      run();
+    }
+  }
+
+private:
+  static const size_t kLast = sizeof...(Steps) - 1;
+
+  template<size_t... I>
+  void spawn(size_t index, IndexSequence<I...>) {
+    typedef void (WaterfallState::*Spawn)();
+    static const Spawn spawns[] = { &WaterfallState::spawn_step<I>... };
+    (this->*spawns[index])();
+  }
+
+  template<size_t I>
+  void spawn_step() {
+    TaskCallback<Result<I>> callback(WaterfallStepCallback<WaterfallState, I>(this));
+    invoke_step<I>(std::integral_constant<bool, I == 0>(), callback);
+  }
+
+  template<size_t I, typename Callback>
+  void invoke_step(std::true_type first, Callback &callback) {
+    std::get<I>(steps_)(callback);
+  }
+
+  template<size_t I, typename Callback>
+  void invoke_step(std::false_type first, Callback &callback) {
+    std::get<I>(steps_)(std::move(std::get<I - 1>(slots_).get()), callback);
+  }
+
+  // Hands on the last step's result, or a value-initialized one if a step failed or the
+  // token was cancelled.
+  void finish() {
+    ResultSlot<Result<kLast>> &last = std::get<kLast>(slots_);
+    if (error_ == OK && last.ready()) {
+      final_callback_(OK, std::move(last.get()));
+    } else {
+      final_callback_(error_, Result<kLast>());
+    }
+    delete this;
+  }
+
+  template<typename Indices>
+  struct Slots;
+
+  template<size_t... I>
+  struct Slots<IndexSequence<I...>> {
+    typedef std::tuple<ResultSlot<Result<I>>...> type;
+  };
+
+  std::tuple<Steps...> steps_;
+  typename Slots<typename MakeIndexSequence<sizeof...(Steps)>::type>::type slots_;
+  typename std::decay<FinalCallback>::type final_callback_;
+  CancellationToken token_;
+  size_t next_ = 0;
+  ErrorCode error_ = OK;
+  bool outstanding_ = false;
+  bool in_loop_ = false;
+};
+
+}
+
+/**
+   Runs `steps` one at a time, handing each step's result to the next:
+
+     async::waterfall(std::make_tuple(
+             [](async::TaskCallback<Endpoint> callback) { resolve(host, callback); },
+             [](Endpoint endpoint, async::TaskCallback<Socket> callback) { ... },
+             [](Socket socket, async::TaskCallback<Response> callback) { ... }),
+         [](async::ErrorCode error, Response response) { ... });
+
+   The first step accepts a TaskCallback<R> for its result.  Each later step accepts the
+   previous step's result, by value or rvalue reference, and a callback for its own.
+   Results are moved from step to step, never copied.  `final_callback(error, result)`
+   is handed the last step's result as an rvalue.  If a step passes an error to its
+   callback, no more steps run, and `final_callback` is handed that error and a
+   value-initialized result.
+
+   `token` - if cancelled, no more steps are started, and the waterfall finishes with
+   the token's reason once the step in flight reports back.
+
+   The steps, their results and `final_callback` are kept in one allocation for the
+   whole waterfall.  Each step's callback is a single pointer, so it fits in the
+   small-object buffer of TaskCallback<R>.
+ */
+template<typename... Steps, typename FinalCallback>
+void waterfall(std::tuple<Steps...> steps,
+    const FinalCallback &final_callback,
+    const CancellationToken &token=CancellationToken()) {
+
+  auto state = new detail::WaterfallState<FinalCallback, Steps...>(
+      std::move(steps), final_callback, token);
+  state->run();
+}
+
+}
+
+#endif
@@ -10,51 +10,96 @@ namespace async {
 
 inline void noop_whilst_final_callback(ErrorCode) {};
 
-/**
-   Executes tasks while `test` returns `true`, and while `func` passes `OK` to its
-   callback.  Equivalent to `while` control flow.
- */
-inline void whilst(const std::function<bool()> &test,
-    const std::function<void(ErrorCodeCallback)> &func,
-    const ErrorCodeCallback &final_callback=noop_whilst_final_callback) {
+namespace detail {
+
+// The sequencer's callback for `whilst`, which owns `test` and `func`.
+class WhilstCallback {
+public:
+  WhilstCallback(CallbackFunction<bool()> &&test,
+      CallbackFunction<void(ErrorCodeCallback)> &&func)
+    : test_(std::move(test)), func_(std::move(func)) {}
 
-  auto wrapped_callback = [func, test](int item, int index, bool is_last_time,
+  void operator()(int item, int index, bool is_last_time,
       std::function<void(bool, ErrorCode)> callback_done) {
     auto task_callback = [callback_done](ErrorCode error) {
       callback_done(error == OK, error);
     };
 
-    if (test()) {
-      func(task_callback);
+    if (test_()) {
+      func_(task_callback);
     } else {
       // Forever_Iter_Stop iterating.
       callback_done(false, OK);
     }
-  };
+  }
+
+private:
+  CallbackFunction<bool()> test_;
+  CallbackFunction<void(ErrorCodeCallback)> func_;
+};
+
+// The sequencer's callback for `doWhilst`.  Each task's callback refers to `test`, which
+// lives as long as the sequence.
+class DoWhilstCallback {
+public:
+  DoWhilstCallback(CallbackFunction<void(ErrorCodeCallback)> &&func,
+      CallbackFunction<bool()> &&test)
+    : func_(std::move(func)), test_(std::move(test)) {}
+
+  void operator()(int item, int index, bool is_last_time,
+      std::function<void(bool, ErrorCode)> callback_done) {
+    const CallbackFunction<bool()> *test = &test_;
+    auto task_callback = [callback_done, test](ErrorCode error) {
+      callback_done(error == OK && (*test)(), error);
+    };
+
+    func_(task_callback);
+  }
+
+private:
+  CallbackFunction<void(ErrorCodeCallback)> func_;
+  CallbackFunction<bool()> test_;
+};
+
+// The inverse of a test, for `until` and `doUntil`.
+class NotTest {
+public:
+  explicit NotTest(CallbackFunction<bool()> &&test) : test_(std::move(test)) {}
+
+  bool operator()() {
+    return !test_();
+  }
+
+private:
+  CallbackFunction<bool()> test_;
+};
 
-  sequencer<int, ForeverIterator>
-      (ForeverIteratorInstance, ForeverIteratorInstance, 1, wrapped_callback, final_callback);
 }
 
 /**
    Executes tasks while `test` returns `true`, and while `func` passes `OK` to its
-   callback.  Equivalent to `do..while` control flow.
+   callback.  Equivalent to `while` control flow.
  */
-inline void doWhilst(const std::function<void(std::function<void(ErrorCode)>)> &func,
-    const std::function<bool()> &test,
-    const std::function<void(ErrorCode)> &final_callback=noop_whilst_final_callback) {
+inline void whilst(CallbackFunction<bool()> test,
+    CallbackFunction<void(ErrorCodeCallback)> func,
+    const ErrorCodeCallback &final_callback=noop_whilst_final_callback) {
 
-  auto wrapped_callback = [func, &test](int item, int index, bool is_last_time,
-      std::function<void(bool, ErrorCode)> callback_done) {
-    auto task_callback = [callback_done, test](ErrorCode error) {
-      callback_done(error == OK && test(), error);
-    };
+  sequencer<int, ForeverIterator>
+      (ForeverIteratorInstance, ForeverIteratorInstance, 1,
+       detail::WhilstCallback(std::move(test), std::move(func)), final_callback);
+}
 
-    func(task_callback);
-  };
+/**
+   Executes tasks while `test` returns `true`, and while `func` passes `OK` to its
+   callback.  Equivalent to `do..while` control flow.
+ */
+inline void doWhilst(CallbackFunction<void(ErrorCodeCallback)> func,
+    CallbackFunction<bool()> test,
+    const ErrorCodeCallback &final_callback=noop_whilst_final_callback) {
 
   sequencer<int, ForeverIterator>
-      (ForeverIteratorInstance, ForeverIteratorInstance, 1, wrapped_callback, final_callback);
+      (ForeverIteratorInstance, ForeverIteratorInstance, 1,
+       detail::DoWhilstCallback(std::move(func), std::move(test)), final_callback);
 }
 
 
@@ -62,10 +107,10 @@ inline void doWhilst(const std::function<void(std::function<void(ErrorCode)>)> &
    Perform task until `test` returns true, or until `func` does not pass `OK` to its
    callback.  Uses `while` control flow.  This is inverse of `whilst`.
  */
-inline void until(const std::function<bool()> &test,
-    const std::function<void(std::function<void(ErrorCode)>)> &func,
-    const std::function<void(ErrorCode)> &final_callback=noop_whilst_final_callback) {
-  whilst([test]() { return !test(); }, func, final_callback);
+inline void until(CallbackFunction<bool()> test,
+    CallbackFunction<void(ErrorCodeCallback)> func,
+    const ErrorCodeCallback &final_callback=noop_whilst_final_callback) {
+  whilst(detail::NotTest(std::move(test)), std::move(func), final_callback);
 }
 
 
@@ -73,33 +118,33 @@ inline void until(const std::function<bool()> &test,
    Perform task until test returns true, or until `func` does not pass `OK` to its
    callback.  Uses `do..while` control flow.  This is inverse of `doWhilst`.
  */
-inline void doUntil(const std::function<void(std::function<void(ErrorCode)>)> &func,
-    const std::function<bool()> &test,
-    const std::function<void(ErrorCode)> &final_callback=noop_whilst_final_callback) {
-  doWhilst(func, [test]() { return !test(); }, final_callback);
+inline void doUntil(CallbackFunction<void(ErrorCodeCallback)> func,
+    CallbackFunction<bool()> test,
+    const ErrorCodeCallback &final_callback=noop_whilst_final_callback) {
+  doWhilst(std::move(func), detail::NotTest(std::move(test)), final_callback);
 }
 
 
 /**
    Perform task until `func` does not pass `OK` to its callback.
  */
-inline void forever(const std::function<void(std::function<void(ErrorCode)>)> &func,
-    const std::function<void(ErrorCode)> &final_callback=noop_whilst_final_callback) {
-  whilst([]() { return true; }, func, final_callback);
+inline void forever(CallbackFunction<void(ErrorCodeCallback)> func,
+    const ErrorCodeCallback &final_callback=noop_whilst_final_callback) {
+  whilst([]() { return true; }, std::move(func), final_callback);
 }
 
 /**
    Perform task a fixed number of times, or until `func` does not pass `OK` to its callback.
  */
-inline void ntimes(int times, const std::function<void(std::function<void(ErrorCode)>)> &func,
-    const std::function<void(ErrorCode)> &final_callback=noop_whilst_final_callback) {
+inline void ntimes(int times, CallbackFunction<void(ErrorCodeCallback)> func,
+    const ErrorCodeCallback &final_callback=noop_whilst_final_callback) {
   int count = 0;
   whilst([count, times]() mutable {
         bool keep_going = count < times;
         count++;
         return keep_going;
       },
-      func, final_callback);
+      std::move(func), final_callback);
 }
 
 }
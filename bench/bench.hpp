@@ -0,0 +1,87 @@
+// Common benchmark utils.  Include from exactly one translation unit per binary: it
+// replaces the global allocation functions to count heap allocations.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <sys/resource.h>
+
+namespace bench {
+
+inline unsigned long *allocation_count() {
+  static unsigned long count = 0;
+  return &count;
+}
+
+// The most memory the process has held at once, in KiB.
+inline long peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// Lowers the peak to the memory held now, so that a run reports its own peak.  Only
+// Linux allows this; elsewhere the peak only rises, so run the larger cases last.
+inline void reset_peak_rss() {
+#ifdef __linux__
+  if (FILE *file = fopen("/proc/self/clear_refs", "w")) {
+    fputs("5", file);
+    fclose(file);
+  }
+#endif
+}
+
+struct Result {
+  double ns_per_item;
+  double allocations_per_item;
+};
+
+// Runs `func` once and reports wall time and heap allocations, per item, and the peak
+// memory held.  Given the ns/item of a `baseline`, reports how many times slower `func`
+// was.
+template<typename Func>
+Result run(const char *name, unsigned long items, Func func, double baseline=0) {
+  reset_peak_rss();
+  unsigned long allocations_start = *allocation_count();
+  auto time_start = std::chrono::steady_clock::now();
+
+  func();
+
+  auto time_end = std::chrono::steady_clock::now();
+  unsigned long allocations = *allocation_count() - allocations_start;
+  double ns = std::chrono::duration<double, std::nano>(time_end - time_start).count();
+
+  Result result = { ns / items, double(allocations) / items };
+  printf("%-40s %10lu items %10.2f ns/item %10.4f allocs/item %8.1f MB peak",
+      name, items, result.ns_per_item, result.allocations_per_item,
+      peak_rss_kb() / 1024.0);
+  if (baseline > 0) {
+    printf(" %8.2fx", result.ns_per_item / baseline);
+  }
+  printf("\n");
+  return result;
+}
+
+}
+
+void *operator new(std::size_t size) {
+  (*bench::allocation_count())++;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "../async/async.hpp"
+#include "bench.hpp"
+
+// Measures the per-item cost of each combinator, from 1 item to 10M, at several limits,
+// with items which complete inline and items whose completions are posted to an
+// io_service.  Each case is set against a hand-written loop of raw callbacks doing the
+// work of `map`, so the last column is the library's overhead: how many times slower it
+// ran.  `series` and `whilst` are set against the loop with a limit of 1.
+//
+// Sizes under a million items are repeated until they make a million.  Pass a smaller
+// largest size to finish sooner:
+//
+//   bin/combinatorbench 100000
+
+// Runs a completion inline, or posts it to `io_service`.
+struct Deferral {
+  boost::asio::io_service *io_service;
+
+  template<typename Completion>
+  void operator()(const Completion &completion) const {
+    if (io_service) {
+      io_service->post(completion);
+    } else {
+      completion();
+    }
+  }
+
+  // Runs whatever was posted.
+  void drain() const {
+    if (io_service) {
+      io_service->run();
+      io_service->reset();
+    }
+  }
+};
+
+struct Step {
+  Deferral defer;
+  template<typename CallbackDone>
+  void operator()(int item, int index, bool is_last_time, CallbackDone callback_done) const {
+    defer([callback_done]() { callback_done(true, async::OK); });
+  }
+};
+
+struct Square {
+  Deferral defer;
+  template<typename Callback>
+  void operator()(int value, Callback callback) const {
+    defer([callback, value]() { callback(async::OK, value * value); });
+  }
+};
+
+struct Ignore {
+  Deferral defer;
+  template<typename Callback>
+  void operator()(int value, Callback callback) const {
+    defer([callback]() { callback(async::OK); });
+  }
+};
+
+struct IsOdd {
+  Deferral defer;
+  template<typename Callback>
+  void operator()(int value, Callback callback) const {
+    defer([callback, value]() { callback(value % 2 == 1); });
+  }
+};
+
+struct ReturnOne {
+  Deferral defer;
+  template<typename Callback>
+  void operator()(Callback callback) const {
+    defer([callback]() { callback(async::OK, 1); });
+  }
+};
+
+/**
+   The baseline: about the least a caller could write by hand to do what `map` does,
+   with at most `limit` items outstanding.  No error handling, no cancellation, and no
+   type erasure.
+ */
+class RawMap {
+public:
+  RawMap(const std::vector<int> &data, unsigned int limit, Deferral defer)
+    : data_(data), results_(data.size()), limit_(limit ? limit : UINT_MAX), defer_(defer) {}
+
+  void run() {
+    running_ = true;
+    while (next_ < data_.size() && outstanding_ < limit_) {
+      RawMap *self = this;
+      unsigned int index = next_++;
+      int value = data_[index];
+      outstanding_++;
+      defer_([self, index, value]() { self->item_done(index, value * value); });
+    }
+    running_ = false;
+  }
+
+  const std::vector<int> &results() const {
+    return results_;
+  }
+
+private:
+  void item_done(unsigned int index, int result) {
+    results_[index] = result;
+    outstanding_--;
+    if (!running_) {
+      run();
+    }
+  }
+
+  const std::vector<int> &data_;
+  std::vector<int> results_;
+  unsigned int limit_;
+  Deferral defer_;
+  unsigned int next_ = 0;
+  unsigned int outstanding_ = 0;
+  bool running_ = false;
+};
+
+long sum = 0;
+
+void sink(async::ErrorCode error, std::vector<int> &results) {
+  sum += results.empty() ? 0 : results.back();
+}
+
+// Runs `func`, then whatever it posted, enough times to make `total` items.
+template<typename Func>
+double run(const std::string &name, unsigned long size, unsigned long total,
+    const Deferral &defer, Func func, double baseline=0) {
+  unsigned long repeats = std::max(total / size, 1ul);
+  return bench::run(name.c_str(), size * repeats, [&]() {
+        for (unsigned long i = 0; i < repeats; i++) {
+          func();
+          defer.drain();
+        }
+      }, baseline).ns_per_item;
+}
+
+std::string with_limit(const char *name, unsigned int limit) {
+  return std::string(name) + ", limit " + std::to_string(limit);
+}
+
+int main(int argc, char *argv[]) {
+  const unsigned long max_size = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000000;
+  const unsigned long total = 1000000;
+  const unsigned int limits[] = { 1, 16, 256 };
+  boost::asio::io_service io_service;
+
+  for (unsigned long size : { 1ul, 1000ul, 1000000ul, 10000000ul }) {
+    if (size > max_size) {
+      break;
+    }
+
+    std::vector<int> data(size);
+    for (unsigned long i = 0; i < size; i++) {
+      data[i] = i;
+    }
+
+    for (bool deferred : { false, true }) {
+      Deferral defer = { deferred ? &io_service : nullptr };
+      std::vector<ReturnOne> tasks(size, ReturnOne { defer });
+      printf("\n%lu items, %s\n", size,
+          deferred ? "completed through an io_service" : "completed inline");
+
+      double raw[3];
+      for (int i = 0; i < 3; i++) {
+        raw[i] = run(with_limit("raw callbacks", limits[i]), size, total, defer, [&]() {
+              RawMap raw_map(data, limits[i], defer);
+              raw_map.run();
+              defer.drain();
+              sum += raw_map.results().back();
+            });
+      }
+
+      for (int i = 0; i < 3; i++) {
+        run(with_limit("sequencer", limits[i]), size, total, defer, [&]() {
+              async::sequencer<int>(data.begin(), data.end(), limits[i], Step { defer },
+                  [](async::ErrorCode error) { sum++; });
+            }, raw[i]);
+      }
+
+      run("series", size, total, defer, [&]() {
+            async::series<int>(tasks, sink);
+          }, raw[0]);
+
+      for (int i = 0; i < 3; i++) {
+        run(with_limit("parallel_limit", limits[i]), size, total, defer, [&]() {
+              async::parallel_limit<int>(tasks, limits[i], sink);
+            }, raw[i]);
+      }
+
+      for (int i = 0; i < 3; i++) {
+        run(with_limit("map", limits[i]), size, total, defer, [&]() {
+              async::map<int>(data, Square { defer }, sink, limits[i]);
+            }, raw[i]);
+      }
+
+      for (int i = 0; i < 3; i++) {
+        run(with_limit("each", limits[i]), size, total, defer, [&]() {
+              async::each<int>(data, Ignore { defer },
+                  [](async::ErrorCode error) { sum++; }, limits[i]);
+            }, raw[i]);
+      }
+
+      for (int i = 0; i < 3; i++) {
+        run(with_limit("filter", limits[i]), size, total, defer, [&]() {
+              async::filter<int>(data, IsOdd { defer },
+                  [](std::vector<int> &results) { sum += results.size(); }, limits[i]);
+            }, raw[i]);
+      }
+
+      unsigned long count;
+      run("whilst", size, total, defer, [&]() {
+            count = 0;
+            async::whilst([&count, size]() { return count++ < size; },
+                [defer](async::ErrorCodeCallback callback) {
+                  defer([callback]() { callback(async::OK); });
+                },
+                [](async::ErrorCode error) { sum++; });
+          }, raw[0]);
+    }
+  }
+
+  return sum == 0;
+}
@@ -0,0 +1,62 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "../async/async.hpp"
+#include "bench.hpp"
+
+// Runs `concurrent::map` with its items completing on an io_service run by 1 to 16
+// threads.  Each completion does a little CPU work first, so with enough cores the
+// time per item should fall as threads are added, unless the sequencer's bookkeeping
+// is contended.
+
+// Roughly half a microsecond of work which the compiler can't drop.
+int spin(int value) {
+  volatile int x = value;
+  for (int i = 0; i < 200; i++) {
+    x = x * 31 + i;
+  }
+  return x;
+}
+
+int main(int argc, char *argv[]) {
+  const unsigned long items = 1000000;
+  std::vector<int> data(items, 3);
+
+  for (int thread_count : { 1, 2, 4, 8, 16 }) {
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work(
+        new boost::asio::io_service::work(io_service));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; i++) {
+      threads.emplace_back([&io_service]() { io_service.run(); });
+    }
+
+    std::string name = "concurrent::map, " + std::to_string(thread_count) + " threads";
+    bench::run(name.c_str(), items, [&]() {
+          std::atomic<bool> done(false);
+
+          async::concurrent::map<int>(data, [&io_service](int value, async::TaskCallback<int> callback) {
+                io_service.post([value, callback]() { callback(async::OK, spin(value)); });
+              },
+              [&done](async::ErrorCode error, std::vector<int> &results) {
+                done = true;
+              },
+              1024);
+
+          while (!done) {
+            std::this_thread::yield();
+          }
+        });
+
+    work.reset();
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "../async/coroutine.hpp"
+#include "bench.hpp"
+
+// Compares a chain of steps written as a TaskVector run by `series`, with the same chain
+// written as a coroutine awaiting one `task` per step.  Steps either complete immediately,
+// or are deferred through an io_service.
+
+async::task<int> step(int i) {
+  co_return i;
+}
+
+async::task<long> coroutine_chain(int steps) {
+  long sum = 0;
+  for (int i = 0; i < steps; i++) {
+    sum += co_await step(i);
+  }
+  co_return sum;
+}
+
+async::task<long> coroutine_chain_deferred(boost::asio::io_service &io_service, int steps) {
+  long sum = 0;
+  for (int i = 0; i < steps; i++) {
+    co_await async::co::post(io_service);
+    sum += co_await step(i);
+  }
+  co_return sum;
+}
+
+int main(int argc, char *argv[]) {
+  const int steps = 1000000;
+  long sum = 0;
+
+  // Warm up the coroutine frame pool.
+  async::co::start(coroutine_chain(1), [](long) {});
+
+  bench::run("series of std::function tasks", steps, [&]() {
+        async::TaskVector<int> tasks;
+        for (int i = 0; i < steps; i++) {
+          tasks.push_back([i](async::TaskCallback<int> &callback) { callback(async::OK, i); });
+        }
+        async::series<int>(tasks, [&sum](async::ErrorCode error, std::vector<int> &results) {
+              sum += results.back();
+            });
+      });
+  bench::run("coroutine awaiting tasks", steps, [&]() {
+        async::co::start(coroutine_chain(steps), [&sum](long result) { sum += result; });
+      });
+
+  boost::asio::io_service io_service;
+
+  bench::run("series of deferred std::function tasks", steps, [&]() {
+        async::TaskVector<int> tasks;
+        for (int i = 0; i < steps; i++) {
+          tasks.push_back([i, &io_service](async::TaskCallback<int> &callback) {
+                io_service.post([i, callback]() { callback(async::OK, i); });
+              });
+        }
+        async::series<int>(tasks, [&sum](async::ErrorCode error, std::vector<int> &results) {
+              sum += results.back();
+            });
+        io_service.run();
+        io_service.reset();
+      });
+  bench::run("coroutine awaiting deferred tasks", steps, [&]() {
+        async::co::start(coroutine_chain_deferred(io_service, steps),
+            [&sum](long result) { sum += result; });
+        io_service.run();
+        io_service.reset();
+      });
+
+  return sum == 0;
+}
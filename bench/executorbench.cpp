@@ -0,0 +1,52 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../async/async.hpp"
+#include "bench.hpp"
+
+// Compares a CPU-bound `map` run inline on the caller's thread with the same `map`
+// dispatched onto a work-stealing ThreadPool of 1, 4, 16 and 64 threads.
+
+// A few microseconds of work which the compiler can't drop.
+struct Work {
+  template<typename Callback>
+  void operator()(int value, Callback callback) const {
+    volatile int x = value;
+    for (int i = 0; i < 5000; i++) {
+      x = x * 31 + i;
+    }
+    callback(async::OK, x);
+  }
+};
+
+int main(int argc, char *argv[]) {
+  const unsigned long items = 100000;
+  std::vector<int> data(items, 3);
+
+  bench::run("map, inline", items, [&]() {
+        async::map<int>(data, Work(), [](async::ErrorCode error, std::vector<int> &results) {});
+      });
+
+  for (int thread_count : { 1, 4, 16, 64 }) {
+    async::ThreadPool pool(thread_count);
+
+    std::string name = "map, ThreadPool of " + std::to_string(thread_count);
+    bench::run(name.c_str(), items, [&]() {
+          std::atomic<bool> done(false);
+
+          async::map<int>(pool, data, Work(),
+              [&done](async::ErrorCode error, std::vector<int> &results) {
+                done = true;
+              },
+              thread_count * 4);
+
+          while (!done) {
+            std::this_thread::yield();
+          }
+        });
+  }
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+#include <vector>
+
+#include "../async/async.hpp"
+#include "bench.hpp"
+
+// Compares the per-item cost of `map`, `map_batch`, `each`, `filter`, `reduce_tree` and
+// `parallel_limit`
+// when the user callables are type-erased std::functions, and when they are plain
+// function objects which accept their callbacks generically.
+//
+// bin/mapbench-async-function is built from this file with ASYNC_USE_ASYNC_FUNCTION, so
+// that the type-erased callables are async::functions instead.  Compare the two for the
+// allocations std::function makes when a callback outgrows its small buffer.
+
+#ifdef ASYNC_USE_ASYNC_FUNCTION
+#define ERASED "async::function"
+#else
+#define ERASED "std::function"
+#endif
+
+struct Square {
+  template<typename Callback>
+  void operator()(int value, Callback callback) const {
+    callback(async::OK, value * value);
+  }
+};
+
+struct SquareBatch {
+  std::vector<int> *scratch;
+  template<typename Callback>
+  void operator()(async::Span<int> items, Callback callback) const {
+    scratch->clear();
+    for (int item : items) {
+      scratch->push_back(item * item);
+    }
+    callback(async::OK, *scratch);
+  }
+};
+
+struct Ignore {
+  template<typename Callback>
+  void operator()(int value, Callback callback) const {
+    callback(async::OK);
+  }
+};
+
+struct IsOdd {
+  template<typename Callback>
+  void operator()(int value, Callback callback) const {
+    callback(value % 2 == 1);
+  }
+};
+
+struct Add {
+  long operator()(long a, long b) const {
+    return a + b;
+  }
+};
+
+struct SquareLong {
+  template<typename Callback>
+  void operator()(int value, Callback callback) const {
+    callback(async::OK, long(value) * value);
+  }
+};
+
+struct ReturnOne {
+  template<typename Callback>
+  void operator()(Callback &callback) const {
+    callback(async::OK, 1);
+  }
+};
+
+struct Sink {
+  long *sum;
+  void operator()(async::ErrorCode error, std::vector<int> &results) const {
+    *sum += results.back();
+  }
+};
+
+int main(int argc, char *argv[]) {
+  const unsigned long items = 1000000;
+  std::vector<int> data(items, 3);
+  long sum = 0;
+
+  async::MapCallback<int> square_function = [](int value, async::TaskCallback<int> callback) {
+    callback(async::OK, value * value);
+  };
+  async::TaskCompletionCallback<int> sink_function = Sink { &sum };
+
+  bench::run("map, " ERASED, items, [&]() {
+        async::map<int>(data, square_function, sink_function);
+      });
+  bench::run("map, function objects", items, [&]() {
+        async::map<int>(data, Square(), Sink { &sum });
+      });
+  bench::run("map, function objects, limit 8", items, [&]() {
+        async::map<int>(data, Square(), Sink { &sum }, 8);
+      });
+  bench::run("map, function objects, limit 8, metrics", items, [&]() {
+        async::map<int>(data, Square(), Sink { &sum }, 8, async::metrics("map"));
+      });
+
+  // Here the task callback carries more than std::function keeps in place: the item's
+  // cancellation, or the time it was spawned.
+  async::CancellationSource source;
+  async::CallbackFunction<void(int, async::TaskCallback<int>, async::CancellationToken)>
+      cancellable_square_function = [](int value, async::TaskCallback<int> callback,
+          async::CancellationToken token) {
+        callback(async::OK, value * value);
+      };
+  bench::run("map, " ERASED ", with a token", items, [&]() {
+        async::map<int>(data, cancellable_square_function, sink_function, 0, source.token());
+      });
+  bench::run("map, " ERASED ", limit 8, metrics", items, [&]() {
+        async::map<int>(data, square_function, sink_function, 8, async::metrics("map " ERASED));
+      });
+
+  std::vector<int> scratch;
+  bench::run("map_batch, batches of 500", items, [&]() {
+        async::map_batch<int>(data, SquareBatch { &scratch }, Sink { &sum }, 500);
+      });
+  bench::run("map_stream, unordered", items, [&]() {
+        async::map_stream<int>(data, Square(),
+            [&sum](unsigned int index, int value) { sum += value; },
+            [](async::ErrorCode error) {});
+      });
+  bench::run("map_stream, window 64", items, [&]() {
+        async::map_stream<int>(data, Square(),
+            [&sum](unsigned int index, int value) { sum += value; },
+            [](async::ErrorCode error) {}, 0, 64);
+      });
+
+  bench::run("map, then summed", items, [&]() {
+        async::map<int>(data, Square(), [&sum](async::ErrorCode error, std::vector<int> &results) {
+              for (int result : results) {
+                sum += result;
+              }
+            });
+      });
+  bench::run("reduce_tree, limit 8", items, [&]() {
+        async::reduce_tree(data, 0L, SquareLong(), Add(),
+            [&sum](async::ErrorCode error, long result) { sum += result; }, 8);
+      });
+
+  async::CallbackFunction<void(int, async::ErrorCodeCallback)> ignore_function =
+      [](int value, async::ErrorCodeCallback callback) {
+        callback(async::OK);
+      };
+
+  bench::run("each, " ERASED, items, [&]() {
+        async::each<int>(data, ignore_function);
+      });
+  bench::run("each, function objects", items, [&]() {
+        async::each<int>(data, Ignore(), [](async::ErrorCode error) {});
+      });
+
+  std::vector<int> numbers;
+  for (unsigned long i = 0; i < items; i++) {
+    numbers.push_back(i);
+  }
+  async::CallbackFunction<void(int, async::BoolCallback)> is_odd_function =
+      [](int value, async::BoolCallback callback) {
+        callback(value % 2 == 1);
+      };
+
+  bench::run("filter, " ERASED, items, [&]() {
+        async::filter<int>(numbers, is_odd_function,
+            [&sum](std::vector<int> &results) { sum += results.size(); });
+      });
+  bench::run("filter, function objects, limit 8", items, [&]() {
+        async::filter<int>(numbers, IsOdd(),
+            [&sum](std::vector<int> &results) { sum += results.size(); }, 8);
+      });
+  bench::run("filter_in_place, function objects", items, [&]() {
+        std::vector<int> copy(numbers);
+        async::filter_in_place<int>(copy, IsOdd(),
+            [&sum](std::vector<int> &results) { sum += results.size(); });
+      });
+
+  async::TaskVector<int> tasks(items, [](async::TaskCallback<int> &callback) {
+        callback(async::OK, 1);
+      });
+  std::vector<ReturnOne> task_objects(items);
+
+  bench::run("parallel_limit, " ERASED, items, [&]() {
+        async::parallel_limit<int>(tasks, 8, sink_function);
+      });
+  bench::run("parallel_limit, function objects", items, [&]() {
+        async::parallel_limit<int>(task_objects, 8, Sink { &sum });
+      });
+
+  return sum == 0;
+}
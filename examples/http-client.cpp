@@ -2,6 +2,10 @@
 #include <boost/lexical_cast.hpp>
 #include <string>
 
+// Log each step as it happens.  Without this, the ASYNC_LOG lines below compile to
+// nothing.
+#define ASYNC_LOG_LEVEL ASYNC_LOG_INFO
+
 #include "http-client.hpp"
 
 // Based on boost_lib/boost_1_55_0/doc/html/boost_asio/example/cpp03/http/client/async_client.cpp
@@ -39,9 +43,6 @@ AsyncHttpClient::AsyncHttpClient(const std::string& uri,
     headers_(headers),
     body_(body) {
 
-  std::cout << "----------------------------------------" << std::endl;
-  std::cout << uri << std::endl;
-
   bool is_http = true;
   std::string uri_without_protocol;
 
@@ -77,10 +78,7 @@ AsyncHttpClient::AsyncHttpClient(const std::string& uri,
   port_ = port_string.length() > 0 ?
       std::stoi(port_string) : (is_http ? 80 : 443);
 
-  std::cout << "is_http: " << is_http << std::endl;
-  std::cout << "server: " << server_ << std::endl;
-  std::cout << "port: " << port_ << std::endl;
-  std::cout << "path: " << path_ << std::endl;
+  ASYNC_LOG(ASYNC_LOG_INFO, "is_http: {}, port: {}", is_http, port_);
 }
 
 AsyncHttpClient::~AsyncHttpClient() {
@@ -97,30 +95,27 @@ void AsyncHttpClient::fetch(std::function<std::string()> callback) {
   request_stream << "Accept: */*\r\n";
   request_stream << "Connection: close\r\n\r\n";
 
-  std::cout << "GET " << path_ << " HTTP 1.0\r\n";
-  std::cout << "Host: " << server_ << "\r\n";
-  std::cout << "Accept: */*\r\n";
-  std::cout << "Connection: close\r\n\r\n";
+  using boost::asio::ip::tcp;
 
-  async::TaskVector<int> steps {
+  // Each step hands its result to the next, so only what the asio calls themselves
+  // need, the socket and buffers, are kept as members.
+  async::waterfall(std::make_tuple(
     /*************************************************************
      * Step 1: Resolve the URL.
      */
-    [this](async::TaskCallback<int> callback) {
-      // Start an asynchronous resolve to translat ethe server and service names
+    [this](async::TaskCallback<tcp::resolver::iterator> callback) {
+      // Start an asynchronous resolve to translate the server and service names
       // into a list of endpoints.
-      boost::asio::ip::tcp::resolver::query query(server_,
-          boost::lexical_cast<std::string>(port_)); // TODO: handle port number.
+      tcp::resolver::query query(server_, boost::lexical_cast<std::string>(port_));
       resolver_.async_resolve(query,
           [=](const boost::system::error_code& err,
-              boost::asio::ip::tcp::resolver::iterator endpoint_iterator) {
-            endpoint_iterator_ = endpoint_iterator;
-
+              tcp::resolver::iterator endpoint_iterator) {
             if (err) {
-              callback(async::FAIL, 1);
+              ASYNC_LOG(ASYNC_LOG_ERROR, "resolve failed: {}", err.value());
+              callback(async::FAIL, endpoint_iterator);
             } else {
-              std::cout << "RESOLVED" << std::endl;
-              callback(async::OK, 1);
+              ASYNC_LOG(ASYNC_LOG_INFO, "resolved");
+              callback(async::OK, endpoint_iterator);
             }
           });
     },
@@ -128,19 +123,18 @@ void AsyncHttpClient::fetch(std::function<std::string()> callback) {
     /*************************************************************
      * Step 2: Connect to a valid endpoint that URL resolves to.
      */
-    [this](async::TaskCallback<int> callback) {
+    [this](tcp::resolver::iterator endpoint_iterator,
+        async::TaskCallback<tcp::endpoint> callback) {
       // Attempt a connection to each endpoint in the list until we
       // successfully establish a connection.
-
-      boost::asio::async_connect(socket_, endpoint_iterator_,
+      boost::asio::async_connect(socket_, endpoint_iterator,
           [=](const boost::system::error_code& err,
-              boost::asio::ip::tcp::resolver::iterator endpoint_iterator) {
+              tcp::resolver::iterator connected) {
             if (err) {
-              callback(async::FAIL, 2);
+              ASYNC_LOG(ASYNC_LOG_ERROR, "connect failed: {}", err.value());
+              callback(async::FAIL, tcp::endpoint());
             } else {
-              // The connection was successful.  Send the request in next step.
-              std::cout << "CONNECTED" << " " << err << std::endl;
-              callback(async::OK, 2);
+              callback(async::OK, connected->endpoint());
             }
           });
     },
@@ -148,127 +142,115 @@ void AsyncHttpClient::fetch(std::function<std::string()> callback) {
     /*************************************************************
      * Step 3: Write the URL request.
      */
-    [this](async::TaskCallback<int> callback) {
+    [this](tcp::endpoint endpoint, async::TaskCallback<std::size_t> callback) {
+      ASYNC_LOG(ASYNC_LOG_INFO, "connected to port {}", endpoint.port());
       boost::asio::async_write(socket_, request_,
           [=](const boost::system::error_code& err,
               const std::size_t bytes_transferred) {
             if (err) {
-              callback(async::FAIL, 3);
+              ASYNC_LOG(ASYNC_LOG_ERROR, "write failed: {}", err.value());
+              callback(async::FAIL, 0);
             } else {
-              std::cout << "WRITING REQUEST" << std::endl;
-              callback(async::OK, 3);
+              callback(async::OK, bytes_transferred);
             }
           });
     },
 
     /************************************************************
-     * Step 4: Read status line.
+     * Step 4: Read and parse the status line.
      */
-    [this](async::TaskCallback<int> callback) {
+    [this](std::size_t request_bytes, async::TaskCallback<unsigned int> callback) {
+      ASYNC_LOG(ASYNC_LOG_INFO, "wrote request: {} bytes", request_bytes);
+
       // Read the response status line.  The response_ streambuf will
       // automatically grow to accommodate the entire line.  The growth may be
       // limited by passing a maximum size to the streambuf constructor.
       boost::asio::async_read_until(socket_, response_, "\r\n",
           [=](const boost::system::error_code& err,
-              const std::size_t byes_transferred) {
-            std::cout << "READING STATUS LINE.  err: " << err << std::endl;
-
+              const std::size_t bytes_transferred) {
             if (err) {
-              callback(async::FAIL, 4);
+              ASYNC_LOG(ASYNC_LOG_ERROR, "reading status line failed: {}", err.value());
+              callback(async::FAIL, 0);
+              return;
+            }
+
+            // Check that response is OK.
+            std::istream response_stream(&response_);
+            std::string http_version;
+            response_stream >> http_version;
+            unsigned int status_code;
+            response_stream >> status_code;
+            std::string status_message;
+            std::getline(response_stream, status_message);
+
+            if (!response_stream || http_version.substr(0, 5) != "HTTP/") {
+              ASYNC_LOG(ASYNC_LOG_ERROR, "invalid response");
+              callback(async::FAIL, 0);
+            } else if (status_code != 200) {
+              ASYNC_LOG(ASYNC_LOG_ERROR, "response returned with status code {}", status_code);
+              callback(async::FAIL, status_code);
             } else {
-              std::cout << "READ STATUS LINE" << std::endl;
-              callback(async::OK, 4);
+              callback(async::OK, status_code);
             }
           });
     },
 
     /************************************************************
-     * Step 5: Parse status line.
+     * Step 5: Read and skip the headers.
      */
-    [this](async::TaskCallback<int> callback) {
-      // Check that response is OK.
-      std::istream response_stream(&response_);
-      std::string http_version;
-      response_stream >> http_version;
-      unsigned int status_code;
-      response_stream >> status_code;
-      std::string status_message;
-      std::getline(response_stream, status_message);
-
-      std::cout << "http_version: " << http_version << std::endl;
-      std::cout << "status_code: " << status_code << std::endl;
-      std::cout << "status_message: " << status_message << std::endl;
-
-      if (!response_stream || http_version.substr(0, 5) != "HTTP/") {
-        std::cout << "Invalid response" << std::endl;
-        // TODO: Handle error.
-        callback(async::FAIL, 51);
-        return;
-      }
-
-      if (status_code != 200) {
-        std::cout << "Response returned with status code " << status_code << std::endl;
-        callback(async::FAIL, 52);
-        return;
-      }
+    [this](unsigned int status_code, async::TaskCallback<unsigned int> callback) {
+      ASYNC_LOG(ASYNC_LOG_INFO, "status code {}", status_code);
 
       // Read the response headers, which are terminated by a blank line.
       boost::asio::async_read_until(socket_, response_, "\r\n\r\n",
           [=](const boost::system::error_code& err,
-              const std::size_t byes_transferred) {
-            std::cout << "Reading header" << std::endl;
-
+              const std::size_t bytes_transferred) {
             if (err) {
-              callback(async::FAIL, 53);
-            } else {
-              callback(async::OK, 5);
+              ASYNC_LOG(ASYNC_LOG_ERROR, "reading headers failed: {}", err.value());
+              callback(async::FAIL, 0);
+              return;
             }
+
+            std::istream response_stream(&response_);
+            std::string header;
+            unsigned int headers = 0;
+            while (std::getline(response_stream, header) && header != "\r") {
+              headers++;
+            }
+            callback(async::OK, headers);
           });
     },
 
     /************************************************************
-     * Step 6: Parse headers.
+     * Step 6: Read the content, until EOF.
      */
-    [this](async::TaskCallback<int> final_callback) {
-      // Process the response headers.
-      std::istream response_stream(&response_);
-      std::string header;
-      while (std::getline(response_stream, header) && header != "\r") {
-        std::cout << "Header: " << header << std::endl;
-      }
-      std::cout << std::endl;
-
-      // Read data until EOF.
+    [this](unsigned int headers, async::TaskCallback<std::string> final_callback) {
+      ASYNC_LOG(ASYNC_LOG_INFO, "read {} headers", headers);
+
+      // Whatever came after the headers stays in response_, and the rest is appended.
       async::forever([this, final_callback](async::ErrorCodeCallback keep_reading_callback) {
             boost::asio::async_read(socket_, response_,
                 boost::asio::transfer_at_least(1),
                 [this, final_callback, keep_reading_callback](const boost::system::error_code& err,
                     const std::size_t bytes_transferred) {
-
-                  if (response_.size() > 0) {
-                    content_ << &response_;
-                  }
-
                   if (err) {
                     keep_reading_callback(async::STOP);
 
-                    // Stop the main execution sequence.
-                    final_callback(err == boost::asio::error::eof ? async::OK : async::FAIL, 6);
+                    std::string content(boost::asio::buffers_begin(response_.data()),
+                        boost::asio::buffers_end(response_.data()));
+                    final_callback(err == boost::asio::error::eof ? async::OK : async::FAIL,
+                        std::move(content));
                   } else {
                     keep_reading_callback(async::OK);
                   }
                 });  // async_read()
           });  // forever()
-    }
-  };
-
-  async::series<int>(steps,
-      [this](async::ErrorCode error, std::vector<int> results) {
-        std::cout << "ERROR CODE: " << error << std::endl << std::endl;
+    }),
 
-        // Write all of the data that has been read so far.
-        std::cout << content_.str() << std::endl;
-      });
+    [](async::ErrorCode error, std::string content) {
+      ASYNC_LOG(ASYNC_LOG_INFO, "finished: {}", error);
+      std::cout << content << std::endl;
+    });
 
   io_service_.run();
 }
@@ -41,10 +41,8 @@ private:
   std::vector<std::string> headers_;
   std::string body_;
   std::string server_;
-  std::stringstream content_;
   int port_;
   std::string path_;
-  boost::asio::ip::tcp::resolver::iterator endpoint_iterator_;
 
   boost::asio::ip::tcp::resolver resolver_;
   boost::asio::ip::tcp::socket socket_;
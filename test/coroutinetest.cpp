@@ -0,0 +1,102 @@
+#include "../async/coroutine.hpp"
+
+#define BOOST_TEST_MODULE CoroutineTest
+#include <boost/test/included/unit_test.hpp>
+#include "test.hpp"
+
+async::task<int> square(int value) {
+  co_return value * value;
+}
+
+async::task<int> sum_of_squares(int n) {
+  int sum = 0;
+  for (int i = 1; i <= n; i++) {
+    sum += co_await square(i);
+  }
+  co_return sum;
+}
+
+BEGIN_SEQUENCER_TEST(test_task) {
+  int result = 0;
+  async::co::start(sum_of_squares(3), [&result](int sum) { result = sum; });
+  BOOST_CHECK_EQUAL(result, 14);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_map_filter_series) {
+  bool done = false;
+
+  auto run = [&done]() -> async::task<void> {
+    std::vector<int> data { 1, 2, 3, 4 };
+
+    auto squares = co_await async::co::map(data, [](int value, async::TaskCallback<int> callback) {
+          callback(async::OK, value * value);
+        }, 2);
+    std::vector<int> expected { 1, 4, 9, 16 };
+    BOOST_CHECK_EQUAL(squares.error, async::OK);
+    BOOST_CHECK_EQUAL_COLLECTIONS(begin(squares.value), end(squares.value),
+        begin(expected), end(expected));
+
+    auto evens = co_await async::co::filter(data, [](int value, async::BoolCallback callback) {
+          callback(value % 2 == 0);
+        });
+    std::vector<int> expected_evens { 2, 4 };
+    BOOST_CHECK_EQUAL_COLLECTIONS(begin(evens), end(evens),
+        begin(expected_evens), end(expected_evens));
+
+    async::TaskVector<int> tasks {
+      [](async::TaskCallback<int> &callback) { callback(async::OK, 1); },
+      [](async::TaskCallback<int> &callback) { callback(async::FAIL, 2); },
+      [](async::TaskCallback<int> &callback) { callback(async::OK, 3); },
+    };
+    auto results = co_await async::co::series<int>(tasks);
+    BOOST_CHECK_EQUAL(results.error, async::FAIL);
+    BOOST_CHECK_EQUAL(results.value.size(), 2);
+
+    int count = 0;
+    async::ErrorCode error = co_await async::co::ntimes(5, [&count](async::ErrorCodeCallback callback) {
+          count++;
+          callback(async::OK);
+        });
+    BOOST_CHECK_EQUAL(error, async::OK);
+    BOOST_CHECK_EQUAL(count, 5);
+
+    done = true;
+  };
+  async::co::start(run());
+  BOOST_CHECK(done);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_ASIO_TEST(test_asio) {
+  auto data = new std::vector<int> { 0, 1, 2, 3 };
+  bool done = false;
+
+  auto run = [&]() -> async::task<void> {
+    auto results = co_await async::co::map(*data, make_task_callback_square(io_service, timers, 1));
+    std::vector<int> expected { 0, 1, 4, 9 };
+    BOOST_CHECK_EQUAL_COLLECTIONS(begin(results.value), end(results.value),
+        begin(expected), end(expected));
+    CHECK_TIME_LAPSE(1000);
+
+    auto result = co_await async::co::call<int>(make_task_callback_no_input(io_service, timers, 1, 7));
+    BOOST_CHECK_EQUAL(result.error, async::OK);
+    BOOST_CHECK_EQUAL(result.value, 7);
+    CHECK_TIME_LAPSE(2000);
+
+    co_await async::co::post(io_service);
+    done = true;
+  };
+  async::co::start(run());
+  BOOST_CHECK(!done);  // Suspended, waiting on the timers.
+
+  io_service.run();
+  BOOST_CHECK(done);
+
+  END_SEQUENCER_ASIO_TEST(data);
+}
+
+BOOST_AUTO_TEST_CASE(coroutine_test) {
+}
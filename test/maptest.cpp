@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+
 #include "../async/async.hpp"
 
 #define BOOST_TEST_MODULE MapTest
@@ -105,5 +110,545 @@ BEGIN_SEQUENCER_ASIO_TEST(test_map_async2) {
   END_SEQUENCER_ASIO_TEST(data);
 }
 
+BEGIN_SEQUENCER_TEST(test_map_stream_ordered) {
+  // Items complete in reverse order within each group of three, but results must come out
+  // in order, with no more than three items in flight or waiting at once.
+  std::vector<int> data(12);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = i;
+  }
+  std::vector<async::TaskCallback<int>> pending;
+  std::vector<int> emitted;
+  unsigned int max_pending = 0;
+  bool callback_called = false;
+
+  async::map_stream<int>(data, [&](int value, async::TaskCallback<int> callback) {
+        pending.push_back(callback);
+        max_pending = std::max<unsigned int>(max_pending, pending.size());
+      },
+      [&emitted](unsigned int index, int value) {
+        BOOST_CHECK_EQUAL(index, value / 10);
+        emitted.push_back(value);
+      },
+      [&callback_called](async::ErrorCode error) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+      },
+      0,
+      3);
+
+  int next = 0;
+  while (!pending.empty()) {
+    std::vector<async::TaskCallback<int>> batch;
+    batch.swap(pending);
+    for (int i = batch.size() - 1; i >= 0; i--) {
+      batch[i](async::OK, (next + i) * 10);
+    }
+    next += batch.size();
+  }
+
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(max_pending, 3);
+  BOOST_CHECK_EQUAL(emitted.size(), data.size());
+  for (size_t i = 0; i < emitted.size(); i++) {
+    BOOST_CHECK_EQUAL(emitted[i], i * 10);
+  }
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_map_stream_error) {
+  // Item 1 waits for item 0, which fails.  Nothing is emitted, and the state is released.
+  std::vector<int> data { 0, 1, 2 };
+  std::vector<async::TaskCallback<int>> pending;
+  int emitted = 0;
+  bool callback_called = false;
+
+  async::map_stream<int>(data, [&](int value, async::TaskCallback<int> callback) {
+        pending.push_back(callback);
+      },
+      [&emitted](unsigned int index, int value) { emitted++; },
+      [&callback_called](async::ErrorCode error) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+      },
+      0,
+      2);
+
+  BOOST_CHECK_EQUAL(pending.size(), 2);
+  pending[1](async::OK, 1);
+  BOOST_CHECK(!callback_called);
+  pending[0](async::FAIL, 0);
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(emitted, 0);
+  BOOST_CHECK_EQUAL(pending.size(), 2);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_map_on_thread_pool) {
+  std::vector<int> data;
+  for (int i = 0; i < 1000; i++) {
+    data.push_back(i);
+  }
+  std::atomic<int> final_callbacks(0);
+
+  {
+    async::ThreadPool pool(4);
+    async::map<int>(pool, data, [](int value, async::TaskCallback<int> callback) {
+          callback(async::OK, value * value);
+        },
+        [&final_callbacks](async::ErrorCode error, std::vector<int> &results) {
+          final_callbacks++;
+          BOOST_CHECK_EQUAL(error, async::OK);
+          for (int i = 0; i < 1000; i++) {
+            BOOST_CHECK_EQUAL(results[i], i * i);
+          }
+        },
+        16);
+    // The pool runs all posted work before its destructor returns.
+  }
+
+  BOOST_CHECK_EQUAL(final_callbacks, 1);
+
+  END_SEQUENCER_TEST();
+}
+
+// Runs posted work only when asked.
+struct QueueExecutor {
+  template <typename F>
+  void post(F f) {
+    queue.push_back(f);
+  }
+
+  void run() {
+    for (size_t i = 0; i < queue.size(); i++) {
+      queue[i]();
+    }
+    queue.clear();
+  }
+
+  std::vector<std::function<void()>> queue;
+};
+
+BEGIN_SEQUENCER_TEST(test_each_on_executor_after_failure) {
+  // Every item is posted up front.  The first fails, and the final callback destroys the
+  // data, so the items still queued mustn't be run.
+  QueueExecutor executor;
+  auto data = new std::vector<int> { 0, 1, 2, 3 };
+  int runs = 0;
+  bool callback_called = false;
+
+  async::each<int>(executor, *data, [&runs](int &item, async::ErrorCodeCallback callback) {
+        runs++;
+        callback(item == 0 ? async::FAIL : async::OK);
+      },
+      [&](async::ErrorCode error) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+        delete data;
+      });
+  BOOST_CHECK_EQUAL(executor.queue.size(), 4);
+  executor.run();
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(runs, 1);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_map_on_thread_pool_after_failure) {
+  // Items fail while others are running on the pool.  The final callback destroys the
+  // data, and must wait for every item running to report back first.
+  auto data = new std::vector<int>(1000);
+  for (int i = 0; i < 1000; i++) {
+    (*data)[i] = i;
+  }
+  std::atomic<int> final_callbacks(0);
+
+  {
+    async::ThreadPool pool(4);
+    async::map<int>(pool, *data, [](int &value, async::TaskCallback<int> callback) {
+          int square = value * value;
+          callback(value % 100 == 99 ? async::FAIL : async::OK, square);
+        },
+        [&](async::ErrorCode error, std::vector<int> &results) {
+          final_callbacks++;
+          BOOST_CHECK_EQUAL(error, async::FAIL);
+          delete data;
+        });
+  }
+
+  BOOST_CHECK_EQUAL(final_callbacks, 1);
+
+  END_SEQUENCER_TEST();
+}
+
+// A payload which counts how often it is copied.
+struct Counted {
+  static int copies;
+
+  Counted() = default;
+  explicit Counted(int value) : value(value) {}
+  Counted(const Counted &other) : value(other.value) { copies++; }
+  Counted(Counted &&other) = default;
+  Counted& operator=(const Counted &other) { value = other.value; copies++; return *this; }
+  Counted& operator=(Counted &&other) = default;
+
+  int value = 0;
+};
+
+int Counted::copies = 0;
+
+BEGIN_SEQUENCER_TEST(test_no_copies) {
+  Counted::copies = 0;
+  std::vector<Counted> data;
+  for (int i = 0; i < 8; i++) {
+    data.emplace_back(i);
+  }
+  int final_callbacks = 0;
+
+  // Borrowed items are handed over by reference; results are moved in and out.
+  std::vector<Counted> squares;
+  async::map<Counted>(data, [](const Counted &item, async::TaskCallback<Counted> callback) {
+        callback(async::OK, Counted(item.value * item.value));
+      },
+      [&](async::ErrorCode error, std::vector<Counted> &results) {
+        final_callbacks++;
+        squares = std::move(results);
+      },
+      3);
+  BOOST_CHECK_EQUAL(squares.size(), 8);
+  BOOST_CHECK_EQUAL(squares[7].value, 49);
+
+  async::each<Counted>(data, [](Counted &item, async::ErrorCodeCallback callback) {
+        callback(async::OK);
+      },
+      [&](async::ErrorCode error) { final_callbacks++; });
+
+  // Items handed over by rvalue are moved into `func`.
+  async::map<Counted>(std::move(squares), [](Counted item, async::TaskCallback<Counted> callback) {
+        item.value++;
+        callback(async::OK, std::move(item));
+      },
+      [&](async::ErrorCode error, std::vector<Counted> &results) {
+        final_callbacks++;
+        BOOST_CHECK_EQUAL(results[7].value, 50);
+      });
+
+  async::filter<Counted>(std::move(data), [](const Counted &item, async::BoolCallback callback) {
+        callback(item.value % 2 == 0);
+      },
+      [&](std::vector<Counted> &results) {
+        final_callbacks++;
+        BOOST_CHECK_EQUAL(results.size(), 4);
+      });
+
+  std::vector<async::Task<Counted>> tasks;
+  for (int i = 0; i < 4; i++) {
+    tasks.push_back([i](async::TaskCallback<Counted> &callback) {
+          callback(async::OK, Counted(i));
+        });
+  }
+  async::parallel_limit<Counted>(tasks, 2,
+      [&](async::ErrorCode error, std::vector<Counted> &results) {
+        final_callbacks++;
+        BOOST_CHECK_EQUAL(results[3].value, 3);
+      });
+
+  BOOST_CHECK_EQUAL(final_callbacks, 5);
+  BOOST_CHECK_EQUAL(Counted::copies, 0);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_move_only) {
+  typedef std::unique_ptr<std::string> Item;
+  std::vector<Item> data;
+  data.emplace_back(new std::string("a"));
+  data.emplace_back(new std::string("bb"));
+  data.emplace_back(new std::string("c"));
+  std::vector<Item> doubled;
+
+  async::map<Item>(std::move(data), [](Item item, async::TaskCallback<Item> callback) {
+        *item += *item;
+        callback(async::OK, std::move(item));
+      },
+      [&doubled](async::ErrorCode error, std::vector<Item> &results) {
+        doubled = std::move(results);
+      });
+  BOOST_CHECK_EQUAL(doubled.size(), 3);
+  BOOST_CHECK_EQUAL(*doubled[1], "bbbb");
+
+  std::vector<Item> short_items;
+  async::reject<Item>(std::move(doubled), [](const Item &item, async::BoolCallback callback) {
+        callback(item->size() > 2);
+      },
+      [&short_items](std::vector<Item> &results) {
+        short_items = std::move(results);
+      });
+  BOOST_CHECK_EQUAL(short_items.size(), 2);
+  BOOST_CHECK_EQUAL(*short_items[1], "cc");
+
+  std::vector<async::Task<Item>> tasks(2, [](async::TaskCallback<Item> &callback) {
+        callback(async::OK, Item(new std::string("x")));
+      });
+  async::parallel<Item>(tasks, [](async::ErrorCode error, std::vector<Item> &results) {
+        BOOST_CHECK_EQUAL(results.size(), 2);
+        BOOST_CHECK_EQUAL(*results[0], "x");
+      });
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_filter_limit_and_in_place) {
+  // Enough items to span several words of the selection, and a partial last word.
+  std::vector<int> data;
+  for (int i = 0; i < 150; i++) {
+    data.push_back(i);
+  }
+  std::vector<std::pair<int, async::BoolCallback>> pending;
+  size_t max_pending = 0;
+  std::vector<int> multiples;
+
+  async::filter<int>(data, [&](int value, async::BoolCallback callback) {
+        pending.emplace_back(value, callback);
+        max_pending = std::max(max_pending, pending.size());
+      },
+      [&multiples](std::vector<int> &results) {
+        multiples = std::move(results);
+      },
+      4);
+
+  // Complete the tests last first, so that each completion spawns another.
+  while (!pending.empty()) {
+    auto item = pending.back();
+    pending.pop_back();
+    item.second(item.first % 3 == 0);
+  }
+  BOOST_CHECK_EQUAL(max_pending, 4);
+  BOOST_CHECK_EQUAL(multiples.size(), 50);
+  BOOST_CHECK_EQUAL(multiples[49], 147);
+  BOOST_CHECK_EQUAL(data.size(), 150);
+
+  // A bool is still taken for `invert`, as it was before there was a limit.
+  std::vector<int> others;
+  async::filter<int>(data, [](int value, async::BoolCallback callback) {
+        callback(value % 3 == 0);
+      },
+      [&others](std::vector<int> &results) {
+        others = std::move(results);
+      },
+      true);
+  BOOST_CHECK_EQUAL(others.size(), 100);
+  BOOST_CHECK_EQUAL(others[0], 1);
+
+  async::reject_in_place<int>(data, [](int value, async::BoolCallback callback) {
+        callback(value % 3 == 0);
+      },
+      [&data](std::vector<int> &results) {
+        BOOST_CHECK_EQUAL(&results, &data);
+      });
+  BOOST_CHECK_EQUAL(data.size(), 100);
+  BOOST_CHECK_EQUAL(data[0], 1);
+  BOOST_CHECK_EQUAL(data[1], 2);
+  BOOST_CHECK_EQUAL(data[99], 149);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_map_batch) {
+  std::vector<int> data;
+  for (int i = 0; i < 10; i++) {
+    data.push_back(i);
+  }
+  std::vector<std::pair<async::Span<int>, async::BatchCallback<int>>> pending;
+  std::vector<int> squares;
+
+  async::map_batch<int>(data, [&pending](async::Span<int> items,
+          async::BatchCallback<int> callback) {
+        pending.emplace_back(items, callback);
+      },
+      [&squares](async::ErrorCode error, std::vector<int> &results) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        squares = std::move(results);
+      },
+      4,
+      2);
+
+  // Batches of 4, 4 and 2, at most two outstanding.  Complete them last first.
+  BOOST_CHECK_EQUAL(pending.size(), 2);
+  while (!pending.empty()) {
+    auto batch = pending.back();
+    pending.pop_back();
+    std::vector<int> results;
+    for (int item : batch.first) {
+      results.push_back(item * item);
+    }
+    batch.second(async::OK, results);
+  }
+  BOOST_CHECK_EQUAL(squares.size(), 10);
+  for (int i = 0; i < 10; i++) {
+    BOOST_CHECK_EQUAL(squares[i], i * i);
+  }
+
+  // By size: 4 + 3 fits a budget of 8, and 9 is a batch by itself.
+  std::vector<int> sizes { 4, 3, 9, 2, 2, 2, 2, 1 };
+  std::vector<size_t> batch_sizes;
+  async::each_batch<int>(sizes, [&batch_sizes](async::Span<int> items,
+          async::ErrorCodeCallback callback) {
+        batch_sizes.push_back(items.size());
+        callback(async::OK);
+      },
+      [](async::ErrorCode error) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+      },
+      async::BatchSize<int>::bytes(8, [](const int &item) { return size_t(item); }));
+  std::vector<size_t> expected { 2, 1, 4, 1 };
+  BOOST_CHECK_EQUAL_COLLECTIONS(batch_sizes.begin(), batch_sizes.end(),
+      expected.begin(), expected.end());
+
+  // A batch which returns too few results fails.
+  bool callback_called = false;
+  async::map_batch<int>(data, [](async::Span<int> items, async::BatchCallback<int> callback) {
+        callback(async::OK, async::Span<int>(items.data(), items.size() - 1));
+      },
+      [&callback_called](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+      },
+      5);
+  BOOST_CHECK(callback_called);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_some_every_detect) {
+  std::vector<int> data { 1, 3, 4, 5, 7 };
+  int tested = 0;
+  auto is_even = [&tested](int value, async::BoolCallback callback) {
+    tested++;
+    callback(value % 2 == 0);
+  };
+
+  // Decided at the third item; the last two are never tested.
+  bool answer = false;
+  async::some<int>(data, is_even, [&answer](bool result) { answer = result; });
+  BOOST_CHECK(answer);
+  BOOST_CHECK_EQUAL(tested, 3);
+
+  tested = 0;
+  async::every<int>(data, is_even, [&answer](bool result) { answer = result; });
+  BOOST_CHECK(!answer);
+  BOOST_CHECK_EQUAL(tested, 1);
+
+  tested = 0;
+  int *found = nullptr;
+  async::detect<int>(data, is_even, [&found](int *item) { found = item; });
+  BOOST_CHECK_EQUAL(found, &data[2]);
+  BOOST_CHECK_EQUAL(tested, 3);
+
+  std::vector<int> odd { 1, 3, 5 };
+  async::any<int>(odd, is_even, [&answer](bool result) { answer = result; });
+  BOOST_CHECK(!answer);
+  async::detect<int>(odd, is_even, [&found](int *item) { found = item; });
+  BOOST_CHECK(found == nullptr);
+  std::vector<int> none;
+  async::every<int>(none, is_even, [&answer](bool result) { answer = result; });
+  BOOST_CHECK(answer);
+
+  // Deferred tests, two at a time: once one passes, the rest aren't started, and the test
+  // still in flight is told through its token.
+  std::vector<std::pair<int, async::BoolCallback>> pending;
+  int cancelled = 0;
+  answer = false;
+  async::some<int>(data, [&](int value, async::BoolCallback callback,
+          async::CancellationToken token) {
+        pending.emplace_back(value, callback);
+        token.on_cancel([&cancelled]() { cancelled++; });
+      },
+      [&answer](bool result) { answer = result; },
+      2);
+  BOOST_CHECK_EQUAL(pending.size(), 2);
+  pending[0].second(false);
+  BOOST_CHECK_EQUAL(pending.size(), 3);
+  pending[2].second(true);
+  BOOST_CHECK(answer);
+  BOOST_CHECK_EQUAL(cancelled, 1);
+  BOOST_CHECK_EQUAL(pending.size(), 3);
+  pending[1].second(false);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_reduce) {
+  std::vector<int> data { 1, 2, 3, 4 };
+  std::string folded;
+  async::reduce(data, std::string(">"),
+      [](std::string memo, int value, async::TaskCallback<std::string> callback) {
+        callback(async::OK, memo + std::to_string(value));
+      },
+      [&folded](async::ErrorCode error, std::string memo) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        folded = memo;
+      });
+  BOOST_CHECK_EQUAL(folded, ">1234");
+
+  // Concatenation is associative but not commutative, so the tree must combine values in
+  // order however they finish.  Finish them in a scrambled order, four at a time.
+  std::vector<int> items;
+  for (int i = 0; i < 100; i++) {
+    items.push_back(i % 10);
+  }
+  std::string expected = ">";
+  for (int item : items) {
+    expected += std::to_string(item);
+  }
+  std::vector<std::pair<int, async::TaskCallback<std::string>>> pending;
+  size_t max_pending = 0;
+  async::reduce_tree(items, std::string(">"),
+      [&](int value, async::TaskCallback<std::string> callback) {
+        pending.emplace_back(value, callback);
+        max_pending = std::max(max_pending, pending.size());
+      },
+      [](std::string a, std::string b) { return a + b; },
+      [&folded](async::ErrorCode error, std::string result) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        folded = result;
+      },
+      4);
+  std::mt19937 random(1);
+  while (!pending.empty()) {
+    size_t next = random() % pending.size();
+    auto item = pending[next];
+    pending.erase(pending.begin() + next);
+    item.second(async::OK, std::to_string(item.first));
+  }
+  BOOST_CHECK_EQUAL(max_pending, 4);
+  BOOST_CHECK_EQUAL(folded, expected);
+
+  // A failure hands back the initial value.
+  async::ErrorCode final_error = async::OK;
+  async::reduce_tree(items, 0,
+      [](int value, async::TaskCallback<int> callback) {
+        callback(value == 5 ? async::FAIL : async::OK, value);
+      },
+      [](int a, int b) { return a + b; },
+      [&](async::ErrorCode error, int result) {
+        final_error = error;
+        BOOST_CHECK_EQUAL(result, 0);
+      });
+  BOOST_CHECK_EQUAL(final_error, async::FAIL);
+
+  std::vector<int> none;
+  int sum = -1;
+  async::reduce_tree(none, 7,
+      [](int value, async::TaskCallback<int> callback) { callback(async::OK, value); },
+      [](int a, int b) { return a + b; },
+      [&sum](async::ErrorCode error, int result) { sum = result; });
+  BOOST_CHECK_EQUAL(sum, 7);
+
+  END_SEQUENCER_TEST();
+}
+
 BOOST_AUTO_TEST_CASE(map_test) {
 }
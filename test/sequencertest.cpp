@@ -0,0 +1,465 @@
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// For test_log: compile in everything but debug records.
+#define ASYNC_LOG_LEVEL ASYNC_LOG_INFO
+
+#include "../async/async.hpp"
+
+#define BOOST_TEST_MODULE SequencerTest
+#include <boost/test/included/unit_test.hpp>
+#include "test.hpp"
+
+BEGIN_SEQUENCER_TEST(test_sync_items_after_deferred_item) {
+  // One deferred item followed by many items that complete synchronously.  Once the
+  // deferred callback fires, the synchronous items must run from the sequencer's loop.
+  // If each were spawned from its predecessor's callback instead, this would overflow
+  // the stack.
+  const int sync_items = 10000000;
+  std::vector<int> data(sync_items + 1);
+  async::ErrorCodeCallback deferred_callback;
+  int items_run = 0;
+  bool callback_called = false;
+
+  async::each<int>(data, [&](int value, async::ErrorCodeCallback callback) {
+        if (items_run++ == 0) {
+          deferred_callback = callback;
+        } else {
+          callback(async::OK);
+        }
+      },
+      [&callback_called](async::ErrorCode error) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+      },
+      1);
+
+  BOOST_CHECK_EQUAL(items_run, 1);
+  BOOST_CHECK(!callback_called);
+
+  // Invoke the callback.
+  deferred_callback(async::OK);
+
+  BOOST_CHECK_EQUAL(items_run, sync_items + 1);
+  BOOST_CHECK(callback_called);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_concurrent_map_on_thread_pool) {
+  // Items complete on an io_service run by several threads, so completions race with each
+  // other and with the thread spawning items.
+  const int items = 100000;
+  std::vector<int> data(items);
+  for (int i = 0; i < items; i++) {
+    data[i] = i;
+  }
+  std::atomic<int> final_callbacks(0);
+
+  boost::asio::io_service io_service;
+  std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&io_service]() { io_service.run(); });
+  }
+
+  async::concurrent::map<int>(data, [&io_service](int value, async::TaskCallback<int> callback) {
+        io_service.post([value, callback]() { callback(async::OK, value * 2); });
+      },
+      [&](async::ErrorCode error, std::vector<int> &results) {
+        final_callbacks++;
+        BOOST_CHECK_EQUAL(error, async::OK);
+        for (int i = 0; i < items; i++) {
+          if (results[i] != i * 2) {
+            BOOST_ERROR("result " << i << " is " << results[i]);
+            break;
+          }
+        }
+        work.reset();
+      },
+      64);
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  BOOST_CHECK_EQUAL(final_callbacks, 1);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_concurrent_map_failure_waits_for_items) {
+  // Each task runs on a thread of its own, and the last fails first.  The others still
+  // write their results, so the final callback must wait for them.
+  std::vector<int> data { 0, 1, 2, 3, 4, 5, 6, 7 };
+  std::vector<std::thread> threads;
+  std::atomic<int> reported(0);
+  std::atomic<int> final_callbacks(0);
+
+  async::concurrent::map<int>(data, [&](int value, async::TaskCallback<int> callback) {
+        threads.emplace_back([&reported, value, callback]() {
+              std::this_thread::sleep_for(std::chrono::milliseconds(value == 7 ? 1 : 20));
+              reported++;
+              callback(value == 7 ? async::FAIL : async::OK, value * 2);
+            });
+      },
+      [&](async::ErrorCode error, std::vector<int> &results) {
+        final_callbacks++;
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+        BOOST_CHECK_EQUAL(reported, 8);
+        for (int i = 0; i < 7; i++) {
+          BOOST_CHECK_EQUAL(results[i], i * 2);
+        }
+      });
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  BOOST_CHECK_EQUAL(final_callbacks, 1);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_failure_cancels_items_in_flight) {
+  // Item 0 is still in flight when item 2 fails, so its handler must fire.  Item 1 has
+  // already completed, so its handler must not.
+  std::vector<int> data = { 0, 1, 2, 3 };
+  std::vector<bool> handler_fired(data.size(), false);
+  int items_run = 0;
+  bool callback_called = false;
+
+  async::map<int>(data, [&](int value, async::TaskCallback<int> callback,
+          async::CancellationToken token) {
+        items_run++;
+        token.on_cancel([&handler_fired, value, callback]() {
+              handler_fired[value] = true;
+              callback(async::CANCELLED, 0);
+            });
+        if (value == 1) {
+          callback(async::OK, value);
+        } else if (value == 2) {
+          callback(async::FAIL, value);
+        }
+      },
+      [&callback_called](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+      });
+
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(items_run, 3);
+  BOOST_CHECK(handler_fired[0]);
+  BOOST_CHECK(!handler_fired[1]);
+  BOOST_CHECK(!handler_fired[2]);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_external_cancel) {
+  // Cancelling from outside finishes the sequence with CANCELLED straight away.  Items in
+  // flight report back later, and nothing is spawned after the cancel.
+  std::vector<int> data(10);
+  std::vector<async::ErrorCodeCallback> deferred_callbacks;
+  async::CancellationSource source;
+  int cancelled_items = 0;
+  int callback_calls = 0;
+
+  async::each<int>(data, [&](int value, async::ErrorCodeCallback callback,
+          async::CancellationToken token) {
+        token.on_cancel([&cancelled_items]() { cancelled_items++; });
+        deferred_callbacks.push_back(callback);
+      },
+      [&callback_calls](async::ErrorCode error) {
+        callback_calls++;
+        BOOST_CHECK_EQUAL(error, async::CANCELLED);
+      },
+      3,
+      source.token());
+
+  BOOST_CHECK_EQUAL(deferred_callbacks.size(), 3);
+  source.cancel();
+  BOOST_CHECK_EQUAL(callback_calls, 1);
+  BOOST_CHECK_EQUAL(cancelled_items, 3);
+
+  for (auto &callback : deferred_callbacks) {
+    callback(async::OK);
+  }
+  BOOST_CHECK_EQUAL(deferred_callbacks.size(), 3);
+  BOOST_CHECK_EQUAL(callback_calls, 1);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_cancellable_tasks) {
+  std::vector<async::TaskCallback<int>> deferred_callbacks;
+  bool first_cancelled = false;
+  bool callback_called = false;
+
+  std::vector<async::CancellableTask<int>> tasks = {
+    [&](async::TaskCallback<int> &callback, async::CancellationToken token) {
+      token.on_cancel([&first_cancelled]() { first_cancelled = true; });
+      deferred_callbacks.push_back(callback);
+    },
+    [](async::TaskCallback<int> &callback, async::CancellationToken token) {
+      callback(async::FAIL, 1);
+    },
+  };
+
+  async::parallel<int>(tasks, [&](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+      });
+
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK(first_cancelled);
+  deferred_callbacks[0](async::CANCELLED, 0);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_metrics) {
+  async::MetricsRegistry registry;
+  async::Metrics &metrics = registry.get("fetch");
+  BOOST_CHECK_EQUAL(&registry.get("fetch"), &metrics);
+
+  std::vector<int> data = { 1, 2, 3, 4, 5 };
+  std::vector<async::TaskCallback<int>> deferred_callbacks;
+  bool callback_called = false;
+
+  async::map<int>(data, [&](int value, async::TaskCallback<int> callback) {
+        deferred_callbacks.push_back(callback);
+      },
+      [&](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+      },
+      2, metrics);
+
+  BOOST_CHECK_EQUAL(metrics.sequences(), 1);
+  BOOST_CHECK_EQUAL(metrics.in_flight(), 2);
+  BOOST_CHECK_EQUAL(metrics.queued(), 3);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  for (size_t i = 0; i < deferred_callbacks.size(); i++) {
+    deferred_callbacks[i](async::OK, data[i]);
+  }
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(metrics.items(), 5);
+  BOOST_CHECK_EQUAL(metrics.failures(), 0);
+  BOOST_CHECK_EQUAL(metrics.in_flight(), 0);
+  BOOST_CHECK_EQUAL(metrics.max_in_flight(), 2);
+  BOOST_CHECK_EQUAL(metrics.queued(), 0);
+  BOOST_CHECK_EQUAL(metrics.latency().count(), 5);
+  BOOST_CHECK(metrics.latency().max() >= std::chrono::milliseconds(10));
+
+  // A failure stops the sequence, and the items never spawned leave the queue.
+  async::Metrics &failing = registry.get("check");
+  async::each<int>(data, [](int value, async::ErrorCodeCallback callback) {
+        callback(value == 2 ? async::FAIL : async::OK);
+      },
+      [](async::ErrorCode error) {}, 0, failing);
+  BOOST_CHECK_EQUAL(failing.items(), 2);
+  BOOST_CHECK_EQUAL(failing.failures(), 1);
+  BOOST_CHECK_EQUAL(failing.sequences_stopped(), 1);
+  BOOST_CHECK_EQUAL(failing.queued(), 0);
+
+  std::vector<std::string> names;
+  registry.for_each([&names](const async::Metrics &metrics) {
+        names.push_back(metrics.name());
+      });
+  BOOST_CHECK(names == std::vector<std::string>({ "check", "fetch" }));
+
+  // Percentiles are within the histogram's precision.
+  async::LatencyHistogram histogram;
+  for (int i = 1; i <= 1000; i++) {
+    histogram.record(std::chrono::microseconds(i));
+  }
+  double p50 = std::chrono::duration<double, std::micro>(histogram.percentile(0.5)).count();
+  double p99 = std::chrono::duration<double, std::micro>(histogram.percentile(0.99)).count();
+  BOOST_CHECK_CLOSE(p50, 500, 3.2);
+  BOOST_CHECK_CLOSE(p99, 990, 3.2);
+  BOOST_CHECK(histogram.max() == std::chrono::microseconds(1000));
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_trace) {
+  async::tracer().clear();
+
+  std::vector<async::TaskCallback<int>> deferred_callbacks;
+  async::TaskVector<int> tasks(3, [&](async::TaskCallback<int> &callback) {
+        deferred_callbacks.push_back(callback);
+      });
+
+  // Not recorded: the tracer hasn't started.
+  async::series<int>(tasks, [](async::ErrorCode error, std::vector<int> &results) {},
+      async::Trace("before"));
+  for (size_t i = 0; i < deferred_callbacks.size(); i++) {
+    deferred_callbacks[i](async::OK, 0);
+  }
+  deferred_callbacks.clear();
+
+  async::tracer().start();
+  async::parallel_limit<int>(tasks, 2,
+      [](async::ErrorCode error, std::vector<int> &results) {},
+      async::Trace("fetch \"all\""));
+  BOOST_CHECK_EQUAL(deferred_callbacks.size(), 2);
+  deferred_callbacks[1](async::OK, 1);
+  deferred_callbacks[0](async::OK, 0);
+  deferred_callbacks[2](async::FAIL, 2);
+  async::tracer().stop();
+
+  std::ostringstream out;
+  async::tracer().write_chrome_trace(out);
+  std::string trace = out.str();
+
+  BOOST_CHECK(trace.find("before") == std::string::npos);
+  BOOST_CHECK(trace.find("\"name\":\"fetch \\\"all\\\" 1\"") != std::string::npos);
+  BOOST_CHECK(trace.find("\"cat\":\"parallel_limit\"") != std::string::npos);
+  BOOST_CHECK(trace.find("\"error\":-1") != std::string::npos);
+
+  size_t begins = 0;
+  size_t ends = 0;
+  for (size_t at = 0; (at = trace.find("\"ph\":\"", at)) != std::string::npos; at++) {
+    char phase = trace[at + 6];
+    begins += phase == 'b';
+    ends += phase == 'e';
+  }
+  BOOST_CHECK_EQUAL(begins, 3);
+  BOOST_CHECK_EQUAL(ends, 3);
+
+  END_SEQUENCER_TEST();
+}
+
+BOOST_AUTO_TEST_CASE(test_log) {
+  std::ostringstream out;
+  async::logger().set_output(out);
+
+  int evaluated = 0;
+  ASYNC_LOG(ASYNC_LOG_DEBUG, "compiled out {}", ++evaluated);
+  ASYNC_LOG(ASYNC_LOG_INFO, "step {} of {}: {}, {}", 2, 3u, async::FAIL, "retrying");
+  std::thread([]() { ASYNC_LOG(ASYNC_LOG_WARN, "took {}s", 1.5); }).join();
+  ASYNC_LOG(ASYNC_LOG_ERROR, "no arguments, so {} stays");
+  async::logger().flush();
+
+  std::string log = out.str();
+  async::logger().set_output(std::clog);
+
+  BOOST_CHECK_EQUAL(evaluated, 0);
+  BOOST_CHECK(log.find("compiled out") == std::string::npos);
+  BOOST_CHECK(log.find("I +") == 0);
+  BOOST_CHECK(log.find(": step 2 of 3: -1, retrying\n") != std::string::npos);
+  BOOST_CHECK(log.find("\nW +") != std::string::npos);
+  BOOST_CHECK(log.find(": took 1.5s\n") != std::string::npos);
+  BOOST_CHECK(log.find("\nE +") != std::string::npos);
+  BOOST_CHECK(log.find(": no arguments, so {} stays\n") != std::string::npos);
+  BOOST_CHECK_EQUAL(async::logger().dropped(), 0);
+}
+
+// Holds a move-only value, so can't be kept in a std::function.
+struct AddOwned {
+  std::unique_ptr<int> value;
+  void operator()(async::ErrorCode error, int result) const {
+    *value += result;
+  }
+};
+
+BOOST_AUTO_TEST_CASE(test_function) {
+  typedef async::function<void(async::ErrorCode, int)> Callback;
+  struct Large {
+    int *total;
+    char padding[128];
+    void operator()(async::ErrorCode error, int result) const {
+      *total += result;
+    }
+  };
+  BOOST_CHECK(Callback::fits_inline<AddOwned>::value);
+  BOOST_CHECK(!Callback::fits_inline<Large>::value);
+
+  int total = 0;
+  Callback large = Large { &total, {} };
+  Callback copy = large;
+  large(async::OK, 1);
+  copy(async::OK, 2);
+  BOOST_CHECK_EQUAL(total, 3);
+
+  AddOwned add_owned { std::unique_ptr<int>(new int(0)) };
+  int *owned = add_owned.value.get();
+  Callback moved = std::move(add_owned);
+  Callback moved_again = std::move(moved);
+  BOOST_CHECK(!moved);
+  moved_again(async::OK, 5);
+  BOOST_CHECK_EQUAL(*owned, 5);
+
+  void (*no_function)(async::ErrorCode, int) = nullptr;
+  BOOST_CHECK(Callback(no_function) == nullptr);
+  BOOST_CHECK(Callback(std::function<void(async::ErrorCode, int)>()) == nullptr);
+
+  // A callback of map's, made a TaskCallback which can hold more.
+  std::vector<int> data { 1, 2, 3 };
+  async::map<int>(data, [](int value, async::function<void(async::ErrorCode, int), 64> callback) {
+        callback(async::OK, value * 2);
+      },
+      [&total](async::ErrorCode error, std::vector<int> &results) {
+        total = results[0] + results[1] + results[2];
+      });
+  BOOST_CHECK_EQUAL(total, 12);
+}
+
+BEGIN_SEQUENCER_TEST(test_whilst_owns_its_functions) {
+  // `test` is a temporary, gone once doWhilst returns, but the sequence kept its own, so
+  // later iterations may still run it.
+  async::ErrorCodeCallback pending;
+  int runs = 0;
+  bool callback_called = false;
+  async::doWhilst([&runs, &pending](async::ErrorCodeCallback callback) {
+        runs++;
+        pending = callback;
+      },
+      [&runs]() { return runs < 3; },
+      [&callback_called](async::ErrorCode error) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+      });
+  while (pending) {
+    async::ErrorCodeCallback callback = pending;
+    pending = nullptr;
+    callback(async::OK);
+  }
+  BOOST_CHECK_EQUAL(runs, 3);
+  BOOST_CHECK(callback_called);
+
+#ifdef ASYNC_USE_ASYNC_FUNCTION
+  // Functions which own a std::unique_ptr are moved in, not copied.
+  struct CountDown {
+    std::unique_ptr<int> left;
+    bool operator()() {
+      return (*left)-- > 0;
+    }
+  };
+  struct Step {
+    std::unique_ptr<int> steps;
+    int *seen;
+    void operator()(async::ErrorCodeCallback callback) {
+      *seen = ++*steps;
+      callback(async::OK);
+    }
+  };
+  int steps = 0;
+  async::whilst(CountDown { std::unique_ptr<int>(new int(4)) },
+      Step { std::unique_ptr<int>(new int(0)), &steps });
+  BOOST_CHECK_EQUAL(steps, 4);
+
+  steps = 0;
+  async::doWhilst(Step { std::unique_ptr<int>(new int(0)), &steps },
+      CountDown { std::unique_ptr<int>(new int(2)) });
+  BOOST_CHECK_EQUAL(steps, 3);
+#endif
+
+  END_SEQUENCER_TEST();
+}
+
+BOOST_AUTO_TEST_CASE(sequencer_test) {
+}
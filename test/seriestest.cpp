@@ -1,4 +1,11 @@
+#include <chrono>
+#include <random>
+
 #include "../async/async.hpp"
+#include "../async/hedge.hpp"
+#include "../async/rate_limit.hpp"
+#include "../async/retry.hpp"
+#include "../async/timeout.hpp"
 
 #define BOOST_TEST_MODULE SeriesTest
 #include <boost/test/included/unit_test.hpp>
@@ -231,5 +238,763 @@ BEGIN_SEQUENCER_ASIO_TEST(test_asio_series_no_delay) {
   END_SEQUENCER_ASIO_TEST(tasks);
 }
 
+// Has no default constructor, so results must be constructed in place.
+struct Tagged {
+  explicit Tagged(int value) : value(value) {}
+  int value;
+};
+
+BEGIN_SEQUENCER_TEST(test_parallel_task_order) {
+  // Tasks complete in reverse order, but results must line up with the tasks, unless
+  // completion order is asked for.
+  std::vector<async::TaskCallback<Tagged>> pending;
+  std::vector<std::function<void(async::TaskCallback<Tagged>&)>> tasks;
+  for (int i = 0; i < 4; i++) {
+    tasks.push_back([&pending](async::TaskCallback<Tagged> &callback) {
+          pending.push_back(callback);
+        });
+  }
+  std::vector<int> task_order;
+  std::vector<int> completion_order;
+
+  async::parallel<Tagged>(tasks, [&](async::ErrorCode error, std::vector<Tagged> &results) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        for (auto &result : results) {
+          task_order.push_back(result.value);
+        }
+      });
+  async::parallel<Tagged>(tasks, [&](async::ErrorCode error, std::vector<Tagged> &results) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        for (auto &result : results) {
+          completion_order.push_back(result.value);
+        }
+      },
+      async::COMPLETION_ORDER);
+
+  BOOST_CHECK_EQUAL(pending.size(), 8);
+  for (int i = 3; i >= 0; i--) {
+    pending[i](async::OK, Tagged(i));
+    pending[i + 4](async::OK, Tagged(i));
+  }
+
+  std::vector<int> expected_task_order { 0, 1, 2, 3 };
+  std::vector<int> expected_completion_order { 3, 2, 1, 0 };
+  BOOST_CHECK_EQUAL_COLLECTIONS(begin(task_order), end(task_order),
+      begin(expected_task_order), end(expected_task_order));
+  BOOST_CHECK_EQUAL_COLLECTIONS(begin(completion_order), end(completion_order),
+      begin(expected_completion_order), end(expected_completion_order));
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_ASIO_TEST(test_asio_series_task_timeout) {
+  // The second task takes three seconds, but may only take one.
+  async::TimingWheel wheel(io_service);
+  auto tasks = new async::TaskVector<int> {
+    make_task_callback_no_input(io_service, timers, 0, 0),
+    make_task_callback_no_input(io_service, timers, 3, 1),
+    make_task_callback_no_input(io_service, timers, 0, 2),
+  };
+  auto start = std::chrono::steady_clock::now();
+  bool callback_called = false;
+
+  async::series<int>(*tasks, [&](async::ErrorCode error, std::vector<int> &results) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        callback_called = true;
+        std::vector<int> expected { 0 };
+        BOOST_CHECK_EQUAL_COLLECTIONS(begin(results), end(results), begin(expected), end(expected));
+        BOOST_CHECK_EQUAL(error, async::TIMEOUT);
+        BOOST_CHECK(elapsed >= std::chrono::seconds(1));
+        BOOST_CHECK(elapsed < std::chrono::milliseconds(1500));
+      },
+      async::Timeouts(wheel, std::chrono::seconds(1)));
+
+  // The state is released once the slow task reports back.
+  io_service.run();
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+
+  END_SEQUENCER_ASIO_TEST(tasks);
+}
+
+BEGIN_SEQUENCER_ASIO_TEST(test_asio_parallel_deadline) {
+  // Every task is well within the task timeout, but together they exceed the deadline.
+  async::TimingWheel wheel(io_service);
+  auto tasks = new async::TaskVector<int> {
+    make_task_callback_no_input(io_service, timers, 1, 0),
+    make_task_callback_no_input(io_service, timers, 1, 1),
+    make_task_callback_no_input(io_service, timers, 1, 2),
+  };
+  auto start = std::chrono::steady_clock::now();
+  bool callback_called = false;
+
+  async::parallel_limit<int>(*tasks, 1, [&](async::ErrorCode error, std::vector<int> &results) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::TIMEOUT);
+        BOOST_CHECK_EQUAL(results.size(), 1);
+        BOOST_CHECK(elapsed >= std::chrono::milliseconds(1500));
+        BOOST_CHECK(elapsed < std::chrono::seconds(2));
+      },
+      async::Timeouts(wheel, std::chrono::seconds(5), std::chrono::milliseconds(1500)));
+
+  io_service.run();
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+
+  END_SEQUENCER_ASIO_TEST(tasks);
+}
+
+BEGIN_SEQUENCER_TEST(test_timing_wheel) {
+  // Microsecond ticks, so that delays of up to 300ms cascade through three levels.
+  boost::asio::io_service io_service;
+  async::TimingWheel wheel(io_service, std::chrono::microseconds(1));
+  typedef std::chrono::steady_clock Clock;
+  const int count = 10000;
+  std::vector<Clock::time_point> due(count);
+  std::vector<async::TimerHandle> handles(count);
+  int fired = 0;
+  int early = 0;
+  int fired_cancelled = 0;
+  std::mt19937 random(1);
+
+  for (int i = 0; i < count; i++) {
+    auto delay = std::chrono::microseconds(random() % 300000);
+    due[i] = Clock::now() + delay;
+    handles[i] = wheel.schedule(delay, [&, i]() {
+          fired++;
+          early += Clock::now() < due[i];
+          fired_cancelled += i % 2;
+        });
+  }
+  for (int i = 1; i < count; i += 2) {
+    BOOST_CHECK(wheel.cancel(handles[i]));
+  }
+  BOOST_CHECK_EQUAL(wheel.size(), count / 2);
+
+  io_service.run();
+  BOOST_CHECK_EQUAL(fired, count / 2);
+  BOOST_CHECK_EQUAL(early, 0);
+  BOOST_CHECK_EQUAL(fired_cancelled, 0);
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+  BOOST_CHECK(!wheel.cancel(handles[0]));
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_adaptive_limit) {
+  // A dependency which serves 6 requests at once in 2ms.  Beyond that they queue, and
+  // latency grows with the load.
+  boost::asio::io_service io_service;
+  std::vector<std::unique_ptr<boost::asio::steady_timer>> timers;
+  async::AdaptiveLimit limit(1, 64);
+  unsigned int in_flight = 0;
+  unsigned int max_in_flight = 0;
+  std::vector<int> data(600, 1);
+  bool callback_called = false;
+
+  auto func = [&](int value, async::TaskCallback<int> callback) {
+    in_flight++;
+    max_in_flight = std::max(max_in_flight, in_flight);
+    timers.emplace_back(new boost::asio::steady_timer(io_service));
+    timers.back()->expires_from_now(
+        std::chrono::microseconds(2000 * std::max(in_flight, 6u) / 6));
+    timers.back()->async_wait([&in_flight, callback, value](
+            const boost::system::error_code &error) {
+          in_flight--;
+          callback(async::OK, value);
+        });
+  };
+  async::map<int>(data, func, [&](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+        BOOST_CHECK_EQUAL(results.size(), 600);
+      },
+      limit);
+  io_service.run();
+
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(limit.in_flight(), 0);
+  // Grown from 1 towards the dependency's capacity, but kept from pushing latency far
+  // past the baseline.
+  BOOST_CHECK_GE(limit.limit(), 4);
+  BOOST_CHECK_LE(limit.limit(), 12);
+  BOOST_CHECK_LE(max_in_flight, 13);
+  BOOST_CHECK(limit.baseline_latency() >= std::chrono::microseconds(1500));
+  BOOST_CHECK(limit.baseline_latency() < std::chrono::milliseconds(3));
+
+  // A failure cuts the limit straight away.
+  async::AdaptiveLimit failing(10);
+  std::vector<int> one { 1 };
+  async::each<int>(one, [](int value, async::ErrorCodeCallback callback) {
+        callback(async::FAIL);
+      },
+      [](async::ErrorCode error) {},
+      failing);
+  BOOST_CHECK_EQUAL(failing.limit(), 9);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_rate_limit) {
+  // 1000 a second, in bursts of up to 10: the first 10 go at once, and the rest follow
+  // a token at a time.  No prefix of the spawns may beat the bucket.
+  typedef std::chrono::steady_clock Clock;
+  boost::asio::io_service io_service;
+  async::TimingWheel wheel(io_service);
+  async::RateLimit quota(wheel, 1000, 10);
+  std::vector<int> data(60, 1);
+  std::vector<Clock::time_point> spawned;
+  bool callback_called = false;
+  auto start = Clock::now();
+
+  async::map<int>(data, [&](int value, async::TaskCallback<int> callback) {
+        spawned.push_back(Clock::now());
+        callback(async::OK, value);
+      },
+      [&](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+        BOOST_CHECK_EQUAL(results.size(), 60);
+      },
+      0, quota);
+  BOOST_CHECK_EQUAL(spawned.size(), 10);
+  io_service.run();
+
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(spawned.size(), 60);
+  int over_quota = 0;
+  for (size_t i = 0; i < spawned.size(); i++) {
+    double allowed = 10 + std::chrono::duration<double>(spawned[i] - start).count() * 1000;
+    over_quota += i + 1 > allowed + 0.001;
+  }
+  BOOST_CHECK_EQUAL(over_quota, 0);
+  auto elapsed = spawned.back() - start;
+  BOOST_CHECK(elapsed >= std::chrono::milliseconds(50));
+  BOOST_CHECK(elapsed < std::chrono::milliseconds(150));
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+
+  // Cancelled while waiting for a token: the wait is dropped along with the state.
+  async::RateLimit slow(wheel, 1);
+  async::CancellationSource source;
+  async::ErrorCode each_error = async::OK;
+  int each_spawned = 0;
+  async::each<int>(data, [&](int value, async::ErrorCodeCallback callback) {
+        each_spawned++;
+        callback(async::OK);
+      },
+      [&](async::ErrorCode error) { each_error = error; },
+      1, slow, source.token());
+  BOOST_CHECK_EQUAL(each_spawned, 1);
+  BOOST_CHECK_EQUAL(wheel.size(), 1);
+  source.cancel();
+  BOOST_CHECK_EQUAL(each_error, async::CANCELLED);
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+
+  // parallel_limit takes the rate limit after its final callback, as map and each do.
+  async::RateLimit burst(wheel, 1000, 2);
+  int tasks_run = 0;
+  async::TaskVector<int> tasks(4, [&tasks_run](async::TaskCallback<int> &callback) {
+        tasks_run++;
+        callback(async::OK, 1);
+      });
+  callback_called = false;
+  async::parallel_limit<int>(tasks, 0, [&](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+      },
+      burst);
+  BOOST_CHECK_EQUAL(tasks_run, 2);
+  io_service.reset();
+  io_service.run();
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(tasks_run, 4);
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_retry) {
+  typedef std::chrono::steady_clock Clock;
+  boost::asio::io_service io_service;
+  async::TimingWheel wheel(io_service);
+  async::RetryPolicy policy(wheel, 3, std::chrono::milliseconds(10));
+  policy.set_jitter(0);
+
+  // Fails twice, then succeeds on the third attempt.  The task after it waits, since the
+  // retries keep the slot.
+  int attempts = 0;
+  std::vector<int> order;
+  async::TaskVector<int> tasks {
+    async::retry<int>(policy, [&](async::TaskCallback<int> &callback) {
+          attempts++;
+          order.push_back(1);
+          callback(attempts < 3 ? async::FAIL : async::OK, 1);
+        }),
+    [&](async::TaskCallback<int> &callback) {
+      order.push_back(2);
+      callback(async::OK, 2);
+    },
+  };
+  bool callback_called = false;
+  auto start = Clock::now();
+  async::parallel_limit<int>(tasks, 1, [&](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+        std::vector<int> expected { 1, 2 };
+        BOOST_CHECK_EQUAL_COLLECTIONS(begin(results), end(results), begin(expected), end(expected));
+        // Waits of 10ms, then 20ms.
+        BOOST_CHECK(Clock::now() - start >= std::chrono::milliseconds(30));
+      });
+  io_service.run();
+  BOOST_CHECK(callback_called);
+  std::vector<int> expected_order { 1, 1, 1, 2 };
+  BOOST_CHECK_EQUAL_COLLECTIONS(begin(order), end(order),
+      begin(expected_order), end(expected_order));
+
+  // Out of attempts: the last failure stops the sequence.
+  attempts = 0;
+  async::ErrorCode final_error = async::OK;
+  auto always_fails = async::retry<int>(policy, [&](async::TaskCallback<int> &callback) {
+        attempts++;
+        callback(async::FAIL, -1);
+      });
+  async::TaskVector<int> failing { always_fails };
+  async::series<int>(failing, [&](async::ErrorCode error, std::vector<int> &results) {
+        final_error = error;
+      });
+  io_service.reset();
+  io_service.run();
+  BOOST_CHECK_EQUAL(final_error, async::FAIL);
+  BOOST_CHECK_EQUAL(attempts, 3);
+
+  // Errors which aren't retryable aren't retried.
+  attempts = 0;
+  async::TaskVector<int> stopping { async::retry<int>(policy,
+      [&](async::TaskCallback<int> &callback) {
+        attempts++;
+        callback(async::STOP, -1);
+      }) };
+  async::series<int>(stopping, [&](async::ErrorCode error, std::vector<int> &results) {
+        final_error = error;
+      });
+  BOOST_CHECK_EQUAL(final_error, async::STOP);
+  BOOST_CHECK_EQUAL(attempts, 1);
+
+  // With a budget of 50ms, the second wait (of 40ms, 20ms in) would overrun it.
+  async::RetryPolicy budgeted(wheel, 10, std::chrono::milliseconds(20));
+  budgeted.set_jitter(0).set_budget(std::chrono::milliseconds(50));
+  attempts = 0;
+  async::TaskVector<int> over_budget { async::retry<int>(budgeted,
+      [&](async::TaskCallback<int> &callback) {
+        attempts++;
+        callback(async::FAIL, -1);
+      }) };
+  async::series<int>(over_budget, [&](async::ErrorCode error, std::vector<int> &results) {
+        final_error = error;
+      });
+  io_service.reset();
+  io_service.run();
+  BOOST_CHECK_EQUAL(final_error, async::FAIL);
+  BOOST_CHECK_EQUAL(attempts, 2);
+
+  // Cancelled while waiting to retry: the wait is dropped, and the sequence released.
+  async::RetryPolicy patient(wheel, 3, std::chrono::seconds(10));
+  async::CancellationSource source;
+  attempts = 0;
+  std::vector<async::CancellableTask<int>> cancellable { async::retry<int>(patient,
+      [&](async::TaskCallback<int> &callback, async::CancellationToken token) {
+        attempts++;
+        callback(async::FAIL, -1);
+      }) };
+  async::parallel_limit<int>(cancellable, 1,
+      [&](async::ErrorCode error, std::vector<int> &results) {
+        final_error = error;
+      },
+      source.token());
+  BOOST_CHECK_EQUAL(wheel.size(), 1);
+  source.cancel();
+  BOOST_CHECK_EQUAL(final_error, async::CANCELLED);
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+  BOOST_CHECK_EQUAL(attempts, 1);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_hedge) {
+  typedef std::chrono::steady_clock Clock;
+  boost::asio::io_service io_service;
+  async::TimingWheel wheel(io_service);
+  std::vector<std::unique_ptr<boost::asio::steady_timer>> timers;
+
+  // The first copy of each task takes 200ms, and the second 1ms.  Losers which accept a
+  // token stop when it is cancelled.
+  int losers_cancelled = 0;
+  auto slow_then_fast = [&](std::shared_ptr<int> copies) {
+    return [&, copies](async::TaskCallback<int> &callback, async::CancellationToken token) {
+      bool first = (*copies)++ == 0;
+      timers.emplace_back(new boost::asio::steady_timer(io_service));
+      boost::asio::steady_timer *timer = timers.back().get();
+      timer->expires_from_now(std::chrono::milliseconds(first ? 200 : 1));
+      timer->async_wait([callback, first](const boost::system::error_code &error) {
+            callback(error ? async::CANCELLED : async::OK, first ? 1 : 2);
+          });
+      token.on_cancel([&losers_cancelled, timer]() {
+            losers_cancelled++;
+            timer->cancel();
+          });
+    };
+  };
+
+  async::Hedging hedging(wheel, std::chrono::milliseconds(10), 1.0);
+  std::vector<async::CancellableTask<int>> tasks {
+    async::hedge<int>(hedging, slow_then_fast(std::make_shared<int>(0))),
+    async::hedge<int>(hedging, slow_then_fast(std::make_shared<int>(0))),
+  };
+  bool callback_called = false;
+  auto start = Clock::now();
+  async::parallel<int>(tasks, [&](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+        std::vector<int> expected { 2, 2 };
+        BOOST_CHECK_EQUAL_COLLECTIONS(begin(results), end(results), begin(expected), end(expected));
+        BOOST_CHECK(Clock::now() - start >= std::chrono::milliseconds(10));
+        BOOST_CHECK(Clock::now() - start < std::chrono::milliseconds(100));
+      });
+  io_service.run();
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(hedging.requests(), 2);
+  BOOST_CHECK_EQUAL(hedging.hedges_launched(), 2);
+  BOOST_CHECK_EQUAL(hedging.hedges_won(), 2);
+  BOOST_CHECK_EQUAL(losers_cancelled, 2);
+
+  // Losers which report back from their cancel handlers, while the winner's callback, or
+  // the token's, is still on the stack.
+  auto cancelled_first = [&](std::shared_ptr<int> copies) {
+    return [&, copies](async::TaskCallback<int> &callback, async::CancellationToken token) {
+      if ((*copies)++ == 0) {
+        token.on_cancel([callback]() { callback(async::CANCELLED, 0); });
+        return;
+      }
+      timers.emplace_back(new boost::asio::steady_timer(io_service));
+      timers.back()->expires_from_now(std::chrono::milliseconds(1));
+      timers.back()->async_wait([callback](const boost::system::error_code &error) {
+            callback(async::OK, 2);
+          });
+    };
+  };
+  int result = 0;
+  async::hedge<int>(hedging, cancelled_first(std::make_shared<int>(0)))(
+      [&](async::ErrorCode error, int value) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        result = value;
+      });
+  io_service.reset();
+  io_service.run();
+  BOOST_CHECK_EQUAL(result, 2);
+
+  async::CancellationSource source;
+  async::ErrorCode cancelled_error = async::OK;
+  async::hedge<int>(hedging, cancelled_first(std::make_shared<int>(0)))(
+      [&](async::ErrorCode error, int value) { cancelled_error = error; }, source.token());
+  source.cancel(async::CANCELLED);
+  BOOST_CHECK_EQUAL(cancelled_error, async::CANCELLED);
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+
+  // A budget of one hedge in four.  Plain tasks' losers are left to finish, and ignored.
+  async::Hedging budgeted(wheel, std::chrono::milliseconds(5), 0.25);
+  int copies = 0;
+  async::TaskVector<int> plain;
+  for (int i = 0; i < 8; i++) {
+    plain.push_back(async::hedge<int>(budgeted, [&](async::TaskCallback<int> &callback) {
+          copies++;
+          timers.emplace_back(new boost::asio::steady_timer(io_service));
+          timers.back()->expires_from_now(std::chrono::milliseconds(20));
+          timers.back()->async_wait([callback](const boost::system::error_code &error) {
+                callback(async::OK, 1);
+              });
+        }));
+  }
+  callback_called = false;
+  async::parallel<int>(plain, [&](async::ErrorCode error, std::vector<int> &results) {
+        callback_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+        BOOST_CHECK_EQUAL(results.size(), 8);
+      });
+  io_service.reset();
+  io_service.run();
+  BOOST_CHECK(callback_called);
+  BOOST_CHECK_EQUAL(budgeted.hedges_launched(), 2);
+  BOOST_CHECK_EQUAL(copies, 10);
+
+  // A task which fails before the hedge is due isn't hedged.
+  async::ErrorCode final_error = async::OK;
+  async::TaskVector<int> failing { async::hedge<int>(budgeted,
+      [](async::TaskCallback<int> &callback) { callback(async::FAIL, -1); }) };
+  async::series<int>(failing, [&](async::ErrorCode error, std::vector<int> &results) {
+        final_error = error;
+      });
+  BOOST_CHECK_EQUAL(final_error, async::FAIL);
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+
+  // By percentile: once there are enough samples, the delay follows the latencies seen.
+  async::Hedging by_percentile(wheel, 0.95, std::chrono::seconds(1));
+  async::TaskVector<int> quick(32, async::hedge<int>(by_percentile,
+      [](async::TaskCallback<int> &callback) { callback(async::OK, 1); }));
+  async::parallel<int>(quick, [](async::ErrorCode error, std::vector<int> &results) {});
+  BOOST_CHECK(by_percentile.delay() < std::chrono::milliseconds(1));
+  BOOST_CHECK_EQUAL(by_percentile.hedges_launched(), 0);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_ASIO_TEST(test_race_and_quorum) {
+  // The 1-second task wins the race; the 2-second one is left to finish.
+  auto tasks = new async::TaskVector<int> {
+    make_task_callback_no_input(io_service, timers, 2, 0),
+    make_task_callback_no_input(io_service, timers, 1, 1),
+  };
+  bool race_called = false;
+  async::race<int>(*tasks, [&](async::ErrorCode error, int result) {
+        race_called = true;
+        BOOST_CHECK_EQUAL(error, async::OK);
+        BOOST_CHECK_EQUAL(result, 1);
+        CHECK_TIME_LAPSE(1000);
+      });
+
+  // A failure which finishes first wins too.
+  std::vector<async::Task<int>> failing { task_fail, task1 };
+  async::race<int>(failing, [](async::ErrorCode error, int result) {
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+        BOOST_CHECK_EQUAL(result, -1);
+      });
+
+  // Two of three: decided by the second task to succeed, and the third isn't started.
+  int started = 0;
+  auto counted = [&started](int value) {
+    return [&started, value](async::TaskCallback<int> &callback) {
+      started++;
+      callback(value < 0 ? async::FAIL : async::OK, value);
+    };
+  };
+  async::TaskVector<int> replicas { counted(1), counted(-1), counted(2), counted(3) };
+  async::quorum<int>(2, replicas, [](async::ErrorCode error, std::vector<int> &results) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        std::vector<int> expected { 1, 2 };
+        BOOST_CHECK_EQUAL_COLLECTIONS(begin(results), end(results),
+            begin(expected), end(expected));
+      });
+  BOOST_CHECK_EQUAL(started, 3);
+
+  // Three of four can't be had once two have failed.
+  started = 0;
+  async::TaskVector<int> failing_replicas { counted(-1), counted(1), counted(-2), counted(2) };
+  async::quorum<int>(3, failing_replicas, [](async::ErrorCode error, std::vector<int> &results) {
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+        BOOST_CHECK_EQUAL(results.size(), 1);
+      });
+  BOOST_CHECK_EQUAL(started, 3);
+
+  async::quorum<int>(5, replicas, [](async::ErrorCode error, std::vector<int> &results) {
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+      });
+
+  io_service.run();
+  BOOST_CHECK(race_called);
+
+  END_SEQUENCER_ASIO_TEST(tasks);
+}
+
+void task_name(async::TaskCallback<std::string> &callback) { callback(async::OK, "name"); }
+
+BEGIN_SEQUENCER_TEST(test_tuple) {
+  std::vector<std::string> order;
+  async::TaskCallback<double> deferred_callback;
+  bool called = false;
+
+  async::series(std::make_tuple(
+          task_name,
+          [&order](async::TaskCallback<int> callback) {
+            order.push_back("int");
+            callback(async::OK, 1);
+          },
+          [&order, &deferred_callback](const async::TaskCallback<double> &callback) {
+            order.push_back("double");
+            deferred_callback = callback;
+          },
+          async::Task<std::vector<int>>([&order](async::TaskCallback<std::vector<int>> &callback) {
+            order.push_back("vector");
+            callback(async::OK, std::vector<int> { 1, 2, 3 });
+          })),
+      [&called](async::ErrorCode error,
+          std::tuple<std::string, int, double, std::vector<int>> &results) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        BOOST_CHECK_EQUAL(std::get<0>(results), "name");
+        BOOST_CHECK_EQUAL(std::get<1>(results), 1);
+        BOOST_CHECK_EQUAL(std::get<2>(results), 2.5);
+        BOOST_CHECK_EQUAL(std::get<3>(results).size(), 3);
+        called = true;
+      });
+
+  // In series, the last task waits for the deferred one.
+  BOOST_CHECK_EQUAL(order.size(), 2);
+  deferred_callback(async::OK, 2.5);
+  BOOST_CHECK_EQUAL(order.size(), 3);
+  BOOST_CHECK(called);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_tuple_failure) {
+  async::TaskCallback<std::string> deferred_callback;
+  async::TaskCallback<int> cancelled_callback;
+  async::CancellationToken slow_token;
+  bool called = false;
+
+  async::parallel(std::make_tuple(
+          [&deferred_callback](async::TaskCallback<std::string> callback,
+              async::CancellationToken token) {
+            deferred_callback = callback;
+          },
+          async::CancellableTask<int>([&cancelled_callback, &slow_token](
+              async::TaskCallback<int> &callback, async::CancellationToken token) {
+            cancelled_callback = callback;
+            slow_token = token;
+          }),
+          [](async::TaskCallback<char> callback) { callback(async::FAIL, 'x'); }),
+      [&called](async::ErrorCode error, std::tuple<std::string, int, char> results) {
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+        BOOST_CHECK_EQUAL(std::get<0>(results), "");
+        BOOST_CHECK_EQUAL(std::get<1>(results), 0);
+        BOOST_CHECK_EQUAL(std::get<2>(results), 'x');
+        called = true;
+      });
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(slow_token.is_cancelled());
+
+  // Reports from tasks still in flight are dropped.
+  deferred_callback(async::OK, "late");
+  cancelled_callback(async::CANCELLED, 0);
+
+  END_SEQUENCER_TEST();
+}
+
+// Counts its copies, to check that a waterfall only moves results.
+struct CopyCounter {
+  CopyCounter() {}
+  CopyCounter(const CopyCounter &other) : copies(other.copies + 1) {}
+  CopyCounter(CopyCounter &&other) : copies(other.copies) {}
+  CopyCounter& operator=(CopyCounter &&other) {
+    copies = other.copies;
+    return *this;
+  }
+
+  int copies = 0;
+};
+
+BEGIN_SEQUENCER_TEST(test_waterfall) {
+  async::TaskCallback<CopyCounter> deferred_callback;
+  bool called = false;
+
+  async::waterfall(std::make_tuple(
+          [](async::TaskCallback<int> &callback) { callback(async::OK, 6); },
+          [](int value, async::TaskCallback<std::unique_ptr<int>> callback) {
+            callback(async::OK, std::unique_ptr<int>(new int(value * 7)));
+          },
+          [&deferred_callback](std::unique_ptr<int> &&value,
+              const async::TaskCallback<CopyCounter> &callback) {
+            BOOST_CHECK_EQUAL(*value, 42);
+            deferred_callback = callback;
+          },
+          [](CopyCounter counter, async::TaskCallback<std::string> callback) {
+            callback(async::OK, std::to_string(counter.copies));
+          }),
+      [&called](async::ErrorCode error, std::string result) {
+        BOOST_CHECK_EQUAL(error, async::OK);
+        BOOST_CHECK_EQUAL(result, "0");
+        called = true;
+      });
+
+  BOOST_CHECK(!called);
+  deferred_callback(async::OK, CopyCounter());
+  BOOST_CHECK(called);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_waterfall_failure) {
+  int steps_run = 0;
+  bool called = false;
+
+  async::waterfall(std::make_tuple(
+          [&steps_run](async::TaskCallback<int> callback) {
+            steps_run++;
+            callback(async::FAIL, 1);
+          },
+          [&steps_run](int value, async::TaskCallback<int> callback) {
+            steps_run++;
+            callback(async::OK, value);
+          }),
+      [&called](async::ErrorCode error, int result) {
+        BOOST_CHECK_EQUAL(error, async::FAIL);
+        BOOST_CHECK_EQUAL(result, 0);
+        called = true;
+      });
+
+  BOOST_CHECK_EQUAL(steps_run, 1);
+  BOOST_CHECK(called);
+
+  // Cancelled while the first step is in flight: the second never starts.
+  async::CancellationSource source;
+  async::TaskCallback<int> deferred_callback;
+  called = false;
+
+  async::waterfall(std::make_tuple(
+          [&deferred_callback](async::TaskCallback<int> callback) {
+            deferred_callback = callback;
+          },
+          [&steps_run](int value, async::TaskCallback<int> callback) {
+            steps_run++;
+            callback(async::OK, value);
+          }),
+      [&called](async::ErrorCode error, int result) {
+        BOOST_CHECK_EQUAL(error, async::CANCELLED);
+        called = true;
+      },
+      source.token());
+
+  source.cancel();
+  deferred_callback(async::OK, 1);
+  BOOST_CHECK_EQUAL(steps_run, 1);
+  BOOST_CHECK(called);
+
+  END_SEQUENCER_TEST();
+}
+
+BEGIN_SEQUENCER_TEST(test_waterfall_stack) {
+  // Steps which complete synchronously run from the waterfall's loop, not from each
+  // other's callbacks.
+  char *first_frame = nullptr;
+  long depth = 0;
+
+  async::waterfall(std::make_tuple(
+          [&first_frame](async::TaskCallback<int> callback) {
+            char frame;
+            first_frame = &frame;
+            callback(async::OK, 0);
+          },
+          [&first_frame, &depth](int value, async::TaskCallback<int> callback) {
+            char frame;
+            depth = first_frame - &frame;
+            callback(async::OK, value);
+          }),
+      [](async::ErrorCode error, int result) {});
+
+  BOOST_CHECK(depth > -64 && depth < 64);
+
+  END_SEQUENCER_TEST();
+}
+
 BOOST_AUTO_TEST_CASE(series_test) {
 }